@@ -28,6 +28,13 @@
  
 #include <dns_sd.h>
 #include <CoreFoundation/CoreFoundation.h>
+#include <dispatch/dispatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "KerberosHelperContext.h"
 
 #define MAX_DOMAIN_LABEL 63
 #define MAX_DOMAIN_NAME 255
@@ -207,6 +214,113 @@ static Boolean DeconstructServiceName(const domainname *const fqdn, domainlabel
 }
 
 
+/*
+ * Resolves are bounded by RESOLVE_TIMEOUT and the answers, including
+ * failures, are remembered for a short while so that a burst of
+ * connections to the same service only resolves it once.
+ */
+
+#define RESOLVE_TIMEOUT			5
+#define RESOLVE_CACHE_TTL		10
+#define RESOLVE_CACHE_NEGATIVE_TTL	5
+#define RESOLVE_CACHE_MAX_ENTRIES	32
+
+struct resolve_state {
+	DNSServiceRef serviceRef;
+	dispatch_source_t source;
+	dispatch_semaphore_t done;
+	char *hostTarget;
+	int finished;
+};
+
+struct resolve_cache_entry {
+	struct resolve_cache_entry *next;
+	char *name;
+	char *hostTarget; /* NULL for failed resolves */
+	time_t expire;
+};
+
+static struct {
+	dispatch_queue_t q;
+	struct resolve_cache_entry *entries;
+	size_t len;
+} resolver;
+
+static dispatch_queue_t
+resolver_queue(void)
+{
+	static dispatch_once_t once;
+	dispatch_once(&once, ^{
+		resolver.q = dispatch_queue_create("com.apple.KerberosHelper.resolve", NULL);
+	});
+	return resolver.q;
+}
+
+static void
+resolve_cache_free_entry(struct resolve_cache_entry *e)
+{
+	free(e->name);
+	free(e->hostTarget);
+	free(e);
+}
+
+/* must be called on resolver.q, returns 1 if the name was found */
+static int
+resolve_cache_lookup(const char *name, int *found, char **hostTarget)
+{
+	struct resolve_cache_entry **prev = &resolver.entries, *e;
+	time_t now = time(NULL);
+
+	*found = 0;
+	*hostTarget = NULL;
+
+	while ((e = *prev) != NULL) {
+		if (e->expire <= now) {
+			*prev = e->next;
+			resolver.len--;
+			resolve_cache_free_entry(e);
+			continue;
+		}
+		if (!*found && strcasecmp(e->name, name) == 0) {
+			*found = 1;
+			if (e->hostTarget)
+				*hostTarget = strdup(e->hostTarget);
+		}
+		prev = &e->next;
+	}
+	return *found;
+}
+
+/* must be called on resolver.q */
+static void
+resolve_cache_store(const char *name, const char *hostTarget)
+{
+	struct resolve_cache_entry **prev, *e;
+
+	if ((e = calloc(1, sizeof(*e))) == NULL)
+		return;
+	e->name = strdup(name);
+	e->hostTarget = hostTarget ? strdup(hostTarget) : NULL;
+	if (e->name == NULL || (hostTarget && e->hostTarget == NULL)) {
+		resolve_cache_free_entry(e);
+		return;
+	}
+	e->expire = time(NULL) + (hostTarget ? RESOLVE_CACHE_TTL : RESOLVE_CACHE_NEGATIVE_TTL);
+
+	/* full, drop the oldest entry, its at the end of the list */
+	if (resolver.len >= RESOLVE_CACHE_MAX_ENTRIES) {
+		for (prev = &resolver.entries; (*prev)->next != NULL; prev = &(*prev)->next)
+			;
+		resolve_cache_free_entry(*prev);
+		*prev = NULL;
+		resolver.len--;
+	}
+
+	e->next = resolver.entries;
+	resolver.entries = e;
+	resolver.len++;
+}
+
 static void mDNSServiceCallBack(
 								  DNSServiceRef serviceRef,
 								  DNSServiceFlags flags,
@@ -220,11 +334,104 @@ static void mDNSServiceCallBack(
 								  void *ctx
 								  )
 {
-	char **hostname = (char **)ctx;
-	
-	if (errorCode == kDNSServiceErr_NoError && hostname) {
-		*hostname = strdup (hostTarget);
+	struct resolve_state *state = (struct resolve_state *)ctx;
+
+	if (state->finished)
+		return;
+	if (errorCode == kDNSServiceErr_NoError && hostTarget)
+		state->hostTarget = strdup (hostTarget);
+	state->finished = 1;
+	dispatch_semaphore_signal(state->done);
+}
+
+/*
+ * Resolve the service and wait at most RESOLVE_TIMEOUT seconds for
+ * the answer, the DNSService socket is serviced on resolver.q.
+ */
+
+static char *
+resolve_service(const char *namestr, const char *typestr, const char *domainstr)
+{
+	struct resolve_state *state;
+	DNSServiceErrorType error;
+	__block char *hostTarget = NULL;
+	int fd;
+
+	if ((state = calloc(1, sizeof(*state))) == NULL)
+		return NULL;
+	if ((state->done = dispatch_semaphore_create(0)) == NULL) {
+		free(state);
+		return NULL;
+	}
+
+	error = DNSServiceResolve (&state->serviceRef,
+				   0,	// No flags
+				   0,	// All network interfaces
+				   namestr,
+				   typestr,
+				   domainstr,	// domain
+				   (DNSServiceResolveReply) mDNSServiceCallBack,
+				   state);
+	if (kDNSServiceErr_NoError != error || (fd = DNSServiceRefSockFD(state->serviceRef)) < 0) {
+		if (state->serviceRef)
+			DNSServiceRefDeallocate(state->serviceRef);
+		dispatch_release(state->done);
+		free(state);
+		return NULL;
+	}
+
+	state->source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, fd, 0, resolver_queue());
+	if (state->source == NULL) {
+		DNSServiceRefDeallocate(state->serviceRef);
+		dispatch_release(state->done);
+		free(state);
+		return NULL;
 	}
+	dispatch_source_set_event_handler(state->source, ^{
+		if (DNSServiceProcessResult(state->serviceRef) != kDNSServiceErr_NoError && !state->finished) {
+			state->finished = 1;
+			dispatch_semaphore_signal(state->done);
+		}
+	});
+	/* the state is only freed once the source can't fire anymore */
+	dispatch_source_set_cancel_handler(state->source, ^{
+		DNSServiceRefDeallocate(state->serviceRef);
+		dispatch_release(state->source);
+		dispatch_release(state->done);
+		free(state->hostTarget);
+		free(state);
+	});
+	dispatch_resume(state->source);
+
+	(void)dispatch_semaphore_wait(state->done, dispatch_time(DISPATCH_TIME_NOW, RESOLVE_TIMEOUT * NSEC_PER_SEC));
+
+	dispatch_sync(resolver_queue(), ^{
+		state->finished = 1;
+		hostTarget = state->hostTarget;
+		state->hostTarget = NULL;
+		dispatch_source_cancel(state->source);
+	});
+
+	return hostTarget;
+}
+
+/*
+ * Cheap check before the full parse: a service name has a _tcp or
+ * _udp label, plain DNS host names don't.
+ */
+
+static Boolean
+may_be_service_name(const char *name)
+{
+	const char *p;
+
+	for (p = name; (p = strchr(p, '.')) != NULL; p++) {
+		if (p[1] == '_' &&
+		    (strncasecmp(&p[2], "tcp", 3) == 0 || strncasecmp(&p[2], "udp", 3) == 0) &&
+		    (p[5] == '.' || p[5] == '\0'))
+			return true;
+	}
+	return false;
 }
 
 /*
@@ -237,11 +444,13 @@ _CFNetServiceDeconstructServiceName(CFStringRef inHostName, char **inHostNameStr
 
 	Boolean result = false;
 	char serviceNameStr[MAX_ESCAPED_DOMAIN_NAME];
-	DNSServiceRef serviceRef = NULL;
 
 	if (CFStringGetCString(inHostName, serviceNameStr, MAX_ESCAPED_DOMAIN_NAME, kCFStringEncodingUTF8)) {
 		domainname domainName;
 
+		if (!may_be_service_name(serviceNameStr))
+			return false;
+
 		if (MakeDomainNameFromDNSNameString(&domainName, serviceNameStr)) {
 			domainlabel nameLabel;
 			domainname typeDomain;
@@ -251,36 +460,33 @@ _CFNetServiceDeconstructServiceName(CFStringRef inHostName, char **inHostNameStr
 				char namestr   [MAX_DOMAIN_LABEL+1];
 				char typestr   [MAX_ESCAPED_DOMAIN_NAME];
 				char domainstr [MAX_ESCAPED_DOMAIN_NAME];
-				DNSServiceErrorType error;
-				
-				ConvertDomainLabelToCString_unescaped(&nameLabel, namestr);
-				ConvertDomainNameToCString(&typeDomain, typestr);
-				ConvertDomainNameToCString(&domainDomain, domainstr);
-
-				error = DNSServiceResolve (&serviceRef,
-										   0,	// No flags
-										   0,	// All network interfaces
-										   namestr,
-										   typestr,
-										   domainstr,	// domain
-										   (DNSServiceResolveReply) mDNSServiceCallBack,
-										   inHostNameString);
-
-				if (kDNSServiceErr_NoError != error) {
-					goto Error;
+				const char *key = serviceNameStr;
+				__block int found = 0;
+				__block char *hostTarget = NULL;
+
+				dispatch_sync(resolver_queue(), ^{
+					resolve_cache_lookup(key, &found, &hostTarget);
+				});
+				KRBStatsCacheRecord(KRB_CACHE_SERVICE_NAME, found);
+				if (!found) {
+					ConvertDomainLabelToCString_unescaped(&nameLabel, namestr);
+					ConvertDomainNameToCString(&typeDomain, typestr);
+					ConvertDomainNameToCString(&domainDomain, domainstr);
+
+					hostTarget = resolve_service(namestr, typestr, domainstr);
+
+					dispatch_sync(resolver_queue(), ^{
+						resolve_cache_store(key, hostTarget);
+					});
 				}
 
-				error = DNSServiceProcessResult(serviceRef);
-				if (kDNSServiceErr_NoError != error) {
-					goto Error;
+				if (hostTarget) {
+					*inHostNameString = hostTarget;
+					result = true;
 				}
-				
-				result = true;
 			}
 		}
 	}
-Error:
-	if (serviceRef) { DNSServiceRefDeallocate(serviceRef); }
 
 	return result;
 }
@@ -26,6 +26,7 @@
 #include <DiskArbitration/DiskArbitration.h>
 
 #include "NetworkAuthenticationHelper.h"
+#include "utils.h"
 
 #include <sys/types.h>
 #include <stdio.h>
@@ -34,26 +35,46 @@
 
 #include <xpc/xpc.h>
 
-static char *
-cf2cstring(CFStringRef inString)
+/*
+ * Unmounts tend to come in bursts (logout, network going away), so
+ * collect the identifiers for a short while and release them with a
+ * single pass over the credentials.  Everything runs on the main
+ * queue.
+ */
+
+#define COALESCE_DELAY_MS 200
+
+static CFMutableArrayRef pending;
+
+static void
+flush_pending(void)
 {
-    char *string = NULL;
-    CFIndex length;
-    
-    string = (char *) CFStringGetCStringPtr(inString, kCFStringEncodingUTF8);
-    if (string)
-        return strdup(string);
-    
-    length = CFStringGetMaximumSizeForEncoding(CFStringGetLength(inString),
-                                               kCFStringEncodingUTF8) + 1;
-    string = malloc (length);
-    if (string == NULL)
-        return NULL;
-    if (!CFStringGetCString(inString, string, length, kCFStringEncodingUTF8)) {
-        free (string);
-        return NULL;
+    CFArrayRef idents = pending;
+
+    pending = NULL;
+    if (idents == NULL)
+        return;
+
+    os_log(OS_LOG_DEFAULT, "DiskUnmountWatcher: %s releasing %d labels", __func__, (int)CFArrayGetCount(idents));
+    NAHFindByLabelsAndRelease(idents);
+    CFRelease(idents);
+}
+
+static void
+queue_release(CFStringRef ident)
+{
+    if (pending == NULL) {
+        pending = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+        if (pending == NULL) {
+            NAHFindByLabelAndRelease(ident);
+            return;
+        }
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, COALESCE_DELAY_MS * NSEC_PER_MSEC),
+                       dispatch_get_main_queue(), ^{
+                           flush_pending();
+                       });
     }
-    return string;
+    CFArrayAppendValue(pending, ident);
 }
 
 static void
@@ -61,7 +82,9 @@ callback(xpc_object_t disk)
 {
     CFDictionaryRef dict = NULL;
     CFStringRef path, ident;
-    char *str, *str2;
+    __KRBStringView view;
+    const char *str;
+    char *str2 = NULL;
     CFURLRef url;
     size_t len;
     
@@ -83,24 +106,29 @@ callback(xpc_object_t disk)
     if (path == NULL)
         goto out;
     
-    str = cf2cstring(path);
-    CFRelease(path);
-    if (str == NULL)
+    str = __KRBStringViewInit(&view, path);
+    if (str == NULL) {
+        __KRBStringViewRelease(&view);
+        CFRelease(path);
         goto out;
+    }
     
     /* remove trailing / */
-    len = strlen(str);
+    len = view.len;
     if (len > 0 && str[len - 1] == '/')
         len--;
     
     asprintf(&str2, "fs:%.*s", (int)len, str);
-    free(str);
+    __KRBStringViewRelease(&view);
+    CFRelease(path);
+    if (str2 == NULL)
+        goto out;
     
     ident = CFStringCreateWithCString(NULL, str2, kCFStringEncodingUTF8);
     os_log(OS_LOG_DEFAULT, "DiskUnmountWatcher: %s find and release %s", __func__, str2);
     free(str2);
     if (ident) {
-        NAHFindByLabelAndRelease(ident);
+        queue_release(ident);
         CFRelease(ident);
     }
 out:
@@ -25,6 +25,7 @@
 #include "KerberosHelper.h"
 #include "KerberosHelperContext.h"
 #include "lookupDSLocalKDC.h"
+#include "LKDC-lookup-plugin.h"
 #include "util.h"
 
 #include <Heimdal/locate_plugin.h>
@@ -41,11 +42,20 @@
 #include <Security/SecCertificatePriv.h>
 #include <CommonCrypto/CommonDigest.h>
 #include <unistd.h>
+#include <ctype.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <notify.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <dispatch/dispatch.h>
+#include <Block.h>
+#include <stdatomic.h>
+#include <dlfcn.h>
+#include <mach-o/dyld.h>
 
 #include <os/log.h>
+#include <os/signpost.h>
 
 #include "DeconstructServiceName.h"
 #include "spnego_asn1.h"
@@ -75,106 +85,1335 @@ _k5_check_err(krb5_error_code error, const char *function, const char *file, int
 
 static const char lkdc_prefix[] = "LKDC:";
 
+#define IS_CANCELLED(hCtx) ((hCtx)->cancel != NULL && *(hCtx)->cancel)
+
 /*
  *
  */
 
-static const char wellknown_lkdc[] = "WELLKNOWN:COM.APPLE.LKDC";
+static const char wellknown_lkdc[] = "WELLKNOWN:COM.APPLE.LKDC";
+
+static int
+is_lkdc_realm(const char *realm)
+{
+    if (realm == NULL)
+	return 0;
+    return strncmp(realm, lkdc_prefix, sizeof(lkdc_prefix)-1) == 0 ||
+	strncmp(realm, wellknown_lkdc, sizeof(wellknown_lkdc) - 1) == 0;
+}
+
+/*
+ * Phase statistics.  Every phase is an os_signpost interval, and its
+ * count, total time and a latency histogram are kept so a summary can
+ * be had from KRBCopyStatistics() or by posting
+ * KRB_STATS_NOTIFICATION, which logs it, without verbose logging.
+ */
+
+#define KRB_STATS_NOTIFICATION	"com.apple.KerberosHelper.statistics"
+
+static const char *krb_phase_names[KRB_PHASE_MAX] = {
+    "Deconstruct", "KDCLookup", "GetAddrInfo", "ReverseDNS", "FindMapping",
+    "CacheScan", "Certificate", "NTLMEnumeration", "ASExchange"
+};
+
+static const char *krb_cache_names[KRB_CACHE_MAX] = {
+    "Host", "CredentialCache", "Certificate", "NegTokenInit", "ServiceName"
+};
+
+static struct {
+    struct {
+	_Atomic uint64_t count;
+	_Atomic uint64_t total_us;
+	_Atomic uint64_t histogram[KRB_STATS_BUCKETS];
+    } phases[KRB_PHASE_MAX];
+    struct {
+	_Atomic uint64_t hits;
+	_Atomic uint64_t misses;
+    } caches[KRB_CACHE_MAX];
+} krb_stats;
+
+static void krb_stats_log(void);
+
+static os_log_t
+krb_stats_oslog(void)
+{
+    static dispatch_once_t once;
+    static os_log_t log;
+    static int token;
+
+    dispatch_once(&once, ^{
+	log = os_log_create("com.apple.KerberosHelper", "Performance");
+	(void)notify_register_dispatch(KRB_STATS_NOTIFICATION, &token,
+				       dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0),
+				       ^(int t) { krb_stats_log(); });
+    });
+    return log;
+}
+
+/* os_signpost wants literal names */
+#define PHASE_SIGNPOST(phase, name)					\
+    case phase:								\
+	if (begin)							\
+	    os_signpost_interval_begin(log, id, name);			\
+	else								\
+	    os_signpost_interval_end(log, id, name);			\
+	break
+
+static void
+phase_signpost(int begin, enum krb_phase phase, os_signpost_id_t id)
+{
+    os_log_t log = krb_stats_oslog();
+
+    if (!os_signpost_enabled(log))
+	return;
+
+    switch (phase) {
+	PHASE_SIGNPOST(KRB_PHASE_DECONSTRUCT, "Deconstruct");
+	PHASE_SIGNPOST(KRB_PHASE_KDC_LOOKUP, "KDCLookup");
+	PHASE_SIGNPOST(KRB_PHASE_GETADDRINFO, "GetAddrInfo");
+	PHASE_SIGNPOST(KRB_PHASE_REVERSE_DNS, "ReverseDNS");
+	PHASE_SIGNPOST(KRB_PHASE_FIND_MAPPING, "FindMapping");
+	PHASE_SIGNPOST(KRB_PHASE_CACHE_SCAN, "CacheScan");
+	PHASE_SIGNPOST(KRB_PHASE_CERTIFICATE, "Certificate");
+	PHASE_SIGNPOST(KRB_PHASE_NTLM_ENUM, "NTLMEnumeration");
+	PHASE_SIGNPOST(KRB_PHASE_AS_EXCHANGE, "ASExchange");
+    default:
+	break;
+    }
+}
+
+void
+KRBPhaseBegin(struct krb_phase_timer *timer, enum krb_phase phase)
+{
+    timer->phase = phase;
+    timer->spid = os_signpost_id_generate(krb_stats_oslog());
+    timer->start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    phase_signpost(1, phase, timer->spid);
+}
+
+void
+KRBPhaseEnd(struct krb_phase_timer *timer)
+{
+    uint64_t us;
+    unsigned b;
+
+    if (timer->phase >= KRB_PHASE_MAX)
+	return;
+
+    us = (clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - timer->start) / 1000;
+    phase_signpost(0, timer->phase, timer->spid);
+
+    /* bucket b holds [2^(b-1), 2^b) microseconds, the last one the rest */
+    for (b = 0; b < KRB_STATS_BUCKETS - 1 && (us >> b) != 0; b++)
+	;
+
+    atomic_fetch_add(&krb_stats.phases[timer->phase].count, 1);
+    atomic_fetch_add(&krb_stats.phases[timer->phase].total_us, us);
+    atomic_fetch_add(&krb_stats.phases[timer->phase].histogram[b], 1);
+
+    timer->phase = KRB_PHASE_MAX;
+}
+
+void
+KRBStatsCacheRecord(enum krb_cache cache, int hit)
+{
+    if (cache >= KRB_CACHE_MAX)
+	return;
+    if (hit)
+	atomic_fetch_add(&krb_stats.caches[cache].hits, 1);
+    else
+	atomic_fetch_add(&krb_stats.caches[cache].misses, 1);
+}
+
+static void
+stats_set_number(CFMutableDictionaryRef dict, CFStringRef key, CFNumberType type, const void *value)
+{
+    CFNumberRef num = CFNumberCreate(NULL, type, value);
+    if (num) {
+	CFDictionarySetValue(dict, key, num);
+	CFRelease(num);
+    }
+}
+
+static void
+stats_set_dictionary(CFMutableDictionaryRef dict, const char *name, CFDictionaryRef value)
+{
+    CFStringRef key = CFStringCreateWithCString(NULL, name, kCFStringEncodingUTF8);
+    if (key) {
+	CFDictionarySetValue(dict, key, value);
+	CFRelease(key);
+    }
+}
+
+/*
+ * The LKDC locate plugin is a bundle Heimdal loads on its own, so its
+ * counters are found by looking for the loaded image rather than by
+ * linking against it.
+ */
+
+typedef void (*lkdc_stats_f)(struct LKDCPluginStatistics *);
+
+static lkdc_stats_f
+find_lkdc_plugin_statistics(void)
+{
+    static _Atomic(lkdc_stats_f) found;
+    lkdc_stats_f f = atomic_load(&found);
+    uint32_t i, count;
+
+    if (f)
+	return f;
+
+    count = _dyld_image_count();
+    for (i = 0; i < count && f == NULL; i++) {
+	const char *name = _dyld_get_image_name(i);
+	void *handle;
+
+	if (name == NULL || strstr(name, "LKDCLocate") == NULL)
+	    continue;
+	handle = dlopen(name, RTLD_LAZY | RTLD_NOLOAD);
+	if (handle == NULL)
+	    continue;
+	f = (lkdc_stats_f)dlsym(handle, "LKDCPluginGetStatistics");
+	/* the plugin stays loaded, the handle only pins it */
+    }
+    if (f)
+	atomic_store(&found, f);
+    return f;
+}
+
+static CFDictionaryRef
+copy_lkdc_plugin_statistics(void)
+{
+    lkdc_stats_f f = find_lkdc_plugin_statistics();
+    struct LKDCPluginStatistics s;
+    CFMutableDictionaryRef d;
+
+    if (f == NULL)
+	return NULL;
+
+    d = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (d == NULL)
+	return NULL;
+
+    f(&s);
+    stats_set_number(d, CFSTR("Lookups"), kCFNumberSInt64Type, &s.lookups);
+    stats_set_number(d, CFSTR("CacheHits"), kCFNumberSInt64Type, &s.cacheHits);
+    stats_set_number(d, CFSTR("CacheNegativeHits"), kCFNumberSInt64Type, &s.cacheNegativeHits);
+    stats_set_number(d, CFSTR("Resolutions"), kCFNumberSInt64Type, &s.resolutions);
+    stats_set_number(d, CFSTR("ResolutionFailures"), kCFNumberSInt64Type, &s.resolutionFailures);
+    stats_set_number(d, CFSTR("ResolutionMicroseconds"), kCFNumberSInt64Type, &s.resolutionTimeTotalUsec);
+    stats_set_number(d, CFSTR("ResolutionMaxMicroseconds"), kCFNumberSInt64Type, &s.resolutionTimeMaxUsec);
+    stats_set_number(d, CFSTR("CallbackErrors"), kCFNumberSInt64Type, &s.callbackErrors);
+    return d;
+}
+
+/*
+  KRBCopyStatistics returns the per phase counts, total times and
+  latency histograms, and the hit ratios of the lookup caches, for
+  this process, and the LKDC locate plugin counters if it is loaded.
+*/
+
+CFDictionaryRef
+KRBCopyStatistics(void)
+{
+    CFMutableDictionaryRef result, phases, caches, d;
+    CFDictionaryRef lkdc;
+    CFMutableArrayRef histogram;
+    uint64_t v, hits, misses;
+    double ratio;
+    size_t i, b;
+
+    result = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    phases = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    caches = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (result == NULL || phases == NULL || caches == NULL)
+	goto out;
+
+    for (i = 0; i < KRB_PHASE_MAX; i++) {
+	d = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	histogram = CFArrayCreateMutable(NULL, KRB_STATS_BUCKETS, &kCFTypeArrayCallBacks);
+	if (d && histogram) {
+	    v = atomic_load(&krb_stats.phases[i].count);
+	    stats_set_number(d, CFSTR("Count"), kCFNumberSInt64Type, &v);
+	    v = atomic_load(&krb_stats.phases[i].total_us);
+	    stats_set_number(d, CFSTR("TotalMicroseconds"), kCFNumberSInt64Type, &v);
+	    for (b = 0; b < KRB_STATS_BUCKETS; b++) {
+		v = atomic_load(&krb_stats.phases[i].histogram[b]);
+		CFNumberRef num = CFNumberCreate(NULL, kCFNumberSInt64Type, &v);
+		if (num) {
+		    CFArrayAppendValue(histogram, num);
+		    CFRelease(num);
+		}
+	    }
+	    CFDictionarySetValue(d, CFSTR("Histogram"), histogram);
+	    stats_set_dictionary(phases, krb_phase_names[i], d);
+	}
+	if (d)
+	    CFRelease(d);
+	if (histogram)
+	    CFRelease(histogram);
+    }
+
+    for (i = 0; i < KRB_CACHE_MAX; i++) {
+	d = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	if (d == NULL)
+	    continue;
+	hits = atomic_load(&krb_stats.caches[i].hits);
+	misses = atomic_load(&krb_stats.caches[i].misses);
+	ratio = hits + misses ? (double)hits / (double)(hits + misses) : 0.0;
+	stats_set_number(d, CFSTR("Hits"), kCFNumberSInt64Type, &hits);
+	stats_set_number(d, CFSTR("Misses"), kCFNumberSInt64Type, &misses);
+	stats_set_number(d, CFSTR("HitRatio"), kCFNumberDoubleType, &ratio);
+	stats_set_dictionary(caches, krb_cache_names[i], d);
+	CFRelease(d);
+    }
+
+    CFDictionarySetValue(result, kKRBStatisticsPhases, phases);
+    CFDictionarySetValue(result, kKRBStatisticsCaches, caches);
+
+    lkdc = copy_lkdc_plugin_statistics();
+    if (lkdc) {
+	CFDictionarySetValue(result, kKRBStatisticsLKDCPlugin, lkdc);
+	CFRelease(lkdc);
+    }
+
+ out:
+    if (phases)
+	CFRelease(phases);
+    if (caches)
+	CFRelease(caches);
+    return result;
+}
+
+static void
+krb_stats_log(void)
+{
+    os_log_t log = krb_stats_oslog();
+    uint64_t count, total, hits, misses;
+    size_t i;
+
+    for (i = 0; i < KRB_PHASE_MAX; i++) {
+	count = atomic_load(&krb_stats.phases[i].count);
+	total = atomic_load(&krb_stats.phases[i].total_us);
+	os_log(log, "phase %{public}s: count %llu total %llu us average %llu us",
+	       krb_phase_names[i], (unsigned long long)count, (unsigned long long)total,
+	       (unsigned long long)(count ? total / count : 0));
+    }
+    for (i = 0; i < KRB_CACHE_MAX; i++) {
+	hits = atomic_load(&krb_stats.caches[i].hits);
+	misses = atomic_load(&krb_stats.caches[i].misses);
+	os_log(log, "cache %{public}s: hits %llu misses %llu",
+	       krb_cache_names[i], (unsigned long long)hits, (unsigned long long)misses);
+    }
+}
+
+/* If realms a and b have a common subrealm, returns the number of
+ * common components.  Otherwise, returns zero.
+ */
+static int
+has_common_subrealm(const char *a, const char *b)
+{
+    const char *ap = &a[strlen(a)];
+    const char *bp = &b[strlen(b)];
+    unsigned int n = 0;
+
+    if (ap == a || bp == b)
+        return 0;
+    for (--ap, --bp; ap >= a && bp >= b && *ap == *bp; --ap, --bp)
+        if ((ap == a && bp == b) ||
+            (ap == a && '.' == bp[-1]) ||
+            (bp == b && '.' == ap[-1]) ||
+            ('.' == ap[-1] && '.' == bp[-1]))
+            ++n;
+    return n;
+}
+
+static const char *
+principal_realm(const char *princ)
+{
+    const char *p = &princ[strlen(princ)];
+
+    while (p > princ) {
+        if ('@' == p[0] && '\\' != p[-1])
+            break;
+        --p;
+    }
+    if (p == princ)
+        return NULL;
+    else
+        return &p[1];
+}
+
+/*
+ * Session arena
+ */
+
+struct krb_arena_chunk {
+    struct krb_arena_chunk *next;
+    size_t size;
+    char data[] __attribute__((aligned(16)));
+};
+
+#define ARENA_ALIGN(x)	(((x) + 15) & ~(size_t)15)
+
+static void
+arena_init(struct krb_arena *arena)
+{
+    arena->chunks = NULL;
+    arena->ptr = arena->initial;
+    arena->avail = sizeof(arena->initial);
+}
+
+static void *
+arena_alloc(struct krb_arena *arena, size_t len)
+{
+    struct krb_arena_chunk *c;
+    size_t size;
+    void *p;
+
+    len = ARENA_ALIGN(len);
+    if (len > arena->avail) {
+	size = arena->chunks ? arena->chunks->size * 2 : 2 * KRB_ARENA_INITIAL;
+	if (size < len)
+	    size = len;
+	if ((c = malloc(sizeof(*c) + size)) == NULL)
+	    return NULL;
+	c->size = size;
+	c->next = arena->chunks;
+	arena->chunks = c;
+	arena->ptr = c->data;
+	arena->avail = size;
+    }
+    p = arena->ptr;
+    arena->ptr += len;
+    arena->avail -= len;
+    return p;
+}
+
+static char *
+arena_strdup(struct krb_arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *p;
+
+    if ((p = arena_alloc(arena, len)) != NULL)
+	memcpy(p, str, len);
+    return p;
+}
+
+static void
+arena_free(struct krb_arena *arena)
+{
+    struct krb_arena_chunk *c;
+
+    while ((c = arena->chunks) != NULL) {
+	arena->chunks = c->next;
+	free(c);
+    }
+    arena_init(arena);
+}
+
+/* FNV-1a over the lowercased realm, realms compare case insensitive */
+static unsigned long
+realm_hash(const char *realm)
+{
+    unsigned long h = 2166136261UL;
+
+    for (; *realm; realm++) {
+	h ^= (unsigned char)tolower((unsigned char)*realm);
+	h *= 16777619UL;
+    }
+    return h;
+}
+
+static void
+add_mapping(KRBHelperContextRef hCtx, const char *hostname, const char *realm, int islkdc, int source)
+{
+    struct realm_mappings *p, *m;
+
+    /* grow geometrically, the old array stays in the arena */
+    if (hCtx->realms.len == hCtx->realms.alloc) {
+	size_t alloc = hCtx->realms.alloc ? hCtx->realms.alloc * 2 : 4;
+
+	p = arena_alloc(&hCtx->arena, sizeof(hCtx->realms.data[0]) * alloc);
+	if (p == NULL)
+	    return;
+	if (hCtx->realms.len)
+	    memcpy(p, hCtx->realms.data, sizeof(hCtx->realms.data[0]) * hCtx->realms.len);
+	hCtx->realms.data = p;
+	hCtx->realms.alloc = alloc;
+    }
+
+    m = &hCtx->realms.data[hCtx->realms.len];
+    m->lkdc = islkdc;
+    m->source = source;
+    m->realmhash = realm_hash(realm);
+    if ((m->hostname = arena_strdup(&hCtx->arena, hostname)) == NULL)
+	return;
+    if ((m->realm = arena_strdup(&hCtx->arena, realm)) == NULL)
+	return;
+    hCtx->realms.len++;
+}
+
+static void
+find_mapping(KRBHelperContextRef hCtx, const char *hostname, int source)
+{
+    struct krb_phase_timer phase;
+    krb5_error_code ret;
+    char **realmlist = NULL;
+    size_t i;
+	
+    for (i = 0; i < hCtx->realms.len; i++)
+	if (strcasecmp(hCtx->realms.data[i].hostname, hostname) == 0)
+	    return;
+	
+    KRBPhaseBegin(&phase, KRB_PHASE_FIND_MAPPING);
+    ret = krb5_get_host_realm(hCtx->krb5_ctx, hostname, &realmlist);
+    KRBPhaseEnd(&phase);
+    if (ret == 0) {
+	for (i = 0; realmlist && realmlist[i] && *(realmlist[i]); i++)
+	    add_mapping(hCtx, hostname, realmlist[i], 0, source);
+	if (i == 0)
+            KHLog ("    %s: krb5_get_host_realm returned unusable realm!", __func__);
+    }
+
+    if (realmlist)
+        krb5_free_host_realm (hCtx->krb5_ctx, realmlist);
+}
+
+/*
+ * Process wide cache of hostname -> (canonical name, realm mappings)
+ * so that repeated sessions to the same host don't redo the KDC
+ * referral, forward and reverse DNS lookups and host realm mapping.
+ *
+ * Entries that were produced when we skipped the reverse lookup
+ * because the hint realm matched are marked incomplete; they are
+ * only used by callers whose hint realm matches too.
+ */
+
+#define HOSTCACHE_TTL		60
+#define HOSTCACHE_NEGATIVE_TTL	10
+#define HOSTCACHE_MAX_ENTRIES	128
+#define HOSTCACHE_FLIGHT_MARGIN	5	/* seconds past the leader's reverse lookup timeout */
+
+struct hostcache_entry {
+    struct hostcache_entry *next;
+    char *name;
+    char *canonname;
+    struct realm_mappings *data;
+    size_t len;
+    time_t expire;
+    unsigned noGuessing:1;
+    unsigned complete:1;
+};
+
+static struct {
+    dispatch_queue_t q;
+    struct hostcache_entry *entries;
+    size_t len;
+} hostcache;
+
+static dispatch_queue_t
+hostcache_queue(void)
+{
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+	hostcache.q = dispatch_queue_create("com.apple.KerberosHelper.hostcache", NULL);
+    });
+    return hostcache.q;
+}
+
+static void
+hostcache_free_entry(struct hostcache_entry *e)
+{
+    size_t i;
+
+    for (i = 0; i < e->len; i++) {
+	free(e->data[i].hostname);
+	free(e->data[i].realm);
+    }
+    free(e->data);
+    free(e->name);
+    free(e->canonname);
+    free(e);
+}
+
+/* must be called on hostcache.q */
+static void
+hostcache_remove(const char *name, time_t now)
+{
+    struct hostcache_entry **prev = &hostcache.entries, *e;
+
+    while ((e = *prev) != NULL) {
+	if ((name && strcasecmp(e->name, name) == 0) || (name == NULL && e->expire <= now)) {
+	    *prev = e->next;
+	    hostcache.len--;
+	    hostcache_free_entry(e);
+	} else {
+	    prev = &e->next;
+	}
+    }
+}
+
+/*
+ * Returns 1 and fills in the mappings of hCtx if there is a usable
+ * entry for `name', *canonname is set to a copy of the canonical
+ * name allocated in the session arena.
+ */
+
+static int
+hostcache_lookup(KRBhelperContext *hCtx, const char *name, const char *hintrealm, char **canonname)
+{
+    __block int found = 0;
+
+    *canonname = NULL;
+
+    dispatch_sync(hostcache_queue(), ^{
+	time_t now = time(NULL);
+	struct hostcache_entry *e;
+	size_t i;
+
+	for (e = hostcache.entries; e != NULL; e = e->next) {
+	    if (strcasecmp(e->name, name) != 0)
+		continue;
+	    if (e->expire <= now) {
+		hostcache_remove(name, now);
+		return;
+	    }
+	    if (!e->complete) {
+		if (hintrealm == NULL)
+		    return;
+		for (i = 0; i < e->len; i++)
+		    if (strcmp(hintrealm, e->data[i].realm) == 0)
+			break;
+		if (i == e->len)
+		    return;
+	    }
+	    if (e->canonname && (*canonname = arena_strdup(&hCtx->arena, e->canonname)) == NULL)
+		return;
+	    for (i = 0; i < e->len; i++)
+		add_mapping(hCtx, e->data[i].hostname, e->data[i].realm, e->data[i].lkdc, e->data[i].source);
+	    hCtx->noGuessing = e->noGuessing;
+	    found = 1;
+	    return;
+	}
+    });
+
+    return found;
+}
+
+/*
+ * Realms the host cache has for hostname, for NAHCreate, which
+ * otherwise asks krb5_get_host_realm().  LKDC realms are left out,
+ * NAH finds those on its own.  Returns 1 and a NULL terminated list
+ * to be freed with krb5_free_host_realm() on a hit.
+ */
+
+int
+KRBHostCacheCopyRealms(const char *hostname, char ***realms)
+{
+    __block int found = 0;
+    __block char **list = NULL;
+    char *name;
+    size_t len;
+
+    *realms = NULL;
+
+    if (hostname == NULL || (name = strdup(hostname)) == NULL)
+	return 0;
+    len = strlen(name);
+    if (len && name[len - 1] == '.')
+	name[len - 1] = '\0';
+
+    dispatch_sync(hostcache_queue(), ^{
+	time_t now = time(NULL);
+	struct hostcache_entry *e;
+	size_t i, j, n = 0;
+
+	for (e = hostcache.entries; e != NULL; e = e->next)
+	    if (strcasecmp(e->name, name) == 0)
+		break;
+	if (e == NULL || e->expire <= now || e->len == 0)
+	    return;
+
+	if ((list = calloc(e->len + 1, sizeof(list[0]))) == NULL)
+	    return;
+	for (i = 0; i < e->len; i++) {
+	    if (e->data[i].lkdc)
+		continue;
+	    for (j = 0; j < n; j++)
+		if (strcmp(list[j], e->data[i].realm) == 0)
+		    break;
+	    if (j < n)
+		continue;
+	    if ((list[n] = strdup(e->data[i].realm)) == NULL)
+		break;
+	    n++;
+	}
+	found = n > 0;
+    });
+    free(name);
+
+    KRBStatsCacheRecord(KRB_CACHE_HOST, found);
+
+    if (!found) {
+	if (list) {
+	    size_t i;
+	    for (i = 0; list[i]; i++)
+		free(list[i]);
+	    free(list);
+	}
+	return 0;
+    }
+    *realms = list;
+    return 1;
+}
+
+static void
+hostcache_store(KRBhelperContext *hCtx, const char *name, const char *canonname, int complete)
+{
+    struct hostcache_entry *e;
+    size_t i;
+
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+	return;
+
+    e->name = strdup(name);
+    e->canonname = canonname ? strdup(canonname) : NULL;
+    if (e->name == NULL || (canonname && e->canonname == NULL))
+	goto fail;
+
+    if (hCtx->realms.len) {
+	e->data = calloc(hCtx->realms.len, sizeof(e->data[0]));
+	if (e->data == NULL)
+	    goto fail;
+	for (i = 0; i < hCtx->realms.len; i++) {
+	    e->data[i].lkdc = hCtx->realms.data[i].lkdc;
+	    e->data[i].source = hCtx->realms.data[i].source;
+	    e->data[i].hostname = strdup(hCtx->realms.data[i].hostname);
+	    e->data[i].realm = strdup(hCtx->realms.data[i].realm);
+	    e->len++;
+	    if (e->data[i].hostname == NULL || e->data[i].realm == NULL)
+		goto fail;
+	}
+    }
+    e->noGuessing = hCtx->noGuessing;
+    e->complete = complete;
+    e->expire = time(NULL) + (e->len ? HOSTCACHE_TTL : HOSTCACHE_NEGATIVE_TTL);
+
+    dispatch_sync(hostcache_queue(), ^{
+	hostcache_remove(name, 0);
+	hostcache_remove(NULL, time(NULL));
+
+	/* still full, drop the oldest entry, its at the end of the list */
+	if (hostcache.len >= HOSTCACHE_MAX_ENTRIES) {
+	    struct hostcache_entry **prev = &hostcache.entries;
+	    while ((*prev)->next)
+		prev = &(*prev)->next;
+	    hostcache_free_entry(*prev);
+	    *prev = NULL;
+	    hostcache.len--;
+	}
+
+	e->next = hostcache.entries;
+	hostcache.entries = e;
+	hostcache.len++;
+    });
+    return;
+
+ fail:
+    hostcache_free_entry(e);
+}
+
+/*
+ * Concurrent lookups of the same host are coalesced: the first one
+ * does the work and stores it in the host cache, the others wait for
+ * it and then use the cached result.
+ */
+
+struct hostcache_flight {
+    struct hostcache_flight *next;
+    char *name;
+    dispatch_group_t group;
+    int refs;
+    time_t deadline;		/* when the waiters give up on the leader */
+};
+
+static struct hostcache_flight *hostcache_flights; /* on hostcache.q */
+
+/* must be called on hostcache.q */
+static void
+hostcache_flight_release(struct hostcache_flight *f)
+{
+    if (--f->refs)
+	return;
+    dispatch_release(f->group);
+    free(f->name);
+    free(f);
+}
+
+/*
+ * Returns 1 if the caller should do the lookup, *flight is then set
+ * and must be passed to hostcache_flight_end().  Returns 0 after
+ * having waited for someone else's lookup of the same name, or given
+ * up on it HOSTCACHE_FLIGHT_MARGIN seconds after its reverse lookups
+ * should have timed out.
+ */
+
+static int
+hostcache_flight_begin(KRBhelperContext *hCtx, const char *name, double rdnsTimeout,
+		       struct hostcache_flight **flight)
+{
+    __block struct hostcache_flight *f = NULL, *wait = NULL;
+    __block time_t deadline = 0;
+
+    dispatch_sync(hostcache_queue(), ^{
+	for (f = hostcache_flights; f != NULL; f = f->next) {
+	    if (strcasecmp(f->name, name) == 0) {
+		f->refs++;
+		wait = f;
+		deadline = f->deadline;
+		f = NULL;
+		return;
+	    }
+	}
+	if ((f = calloc(1, sizeof(*f))) == NULL)
+	    return;
+	f->name = strdup(name);
+	f->group = dispatch_group_create();
+	if (f->name == NULL || f->group == NULL) {
+	    if (f->group)
+		dispatch_release(f->group);
+	    free(f->name);
+	    free(f);
+	    f = NULL;
+	    return;
+	}
+	dispatch_group_enter(f->group);
+	f->refs = 1;
+	f->deadline = time(NULL) + (rdnsTimeout > 0 ? (time_t)rdnsTimeout : 0) + HOSTCACHE_FLIGHT_MARGIN;
+	f->next = hostcache_flights;
+	hostcache_flights = f;
+    });
+
+    *flight = f;
+    if (wait == NULL)
+	return 1;
+
+    KHLog ("    %s: waiting for concurrent lookup of %s", __func__, name);
+
+    while (dispatch_group_wait(wait->group, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC)) != 0) {
+	if (IS_CANCELLED(hCtx))
+	    break;
+	if (time(NULL) >= deadline) {
+	    KHLog ("    %s: concurrent lookup of %s timed out", __func__, name);
+	    break;
+	}
+    }
+
+    dispatch_sync(hostcache_queue(), ^{
+	hostcache_flight_release(wait);
+    });
+    return 0;
+}
+
+static void
+hostcache_flight_end(struct hostcache_flight *f)
+{
+    dispatch_sync(hostcache_queue(), ^{
+	struct hostcache_flight **prev;
+
+	for (prev = &hostcache_flights; *prev != NULL; prev = &(*prev)->next) {
+	    if (*prev == f) {
+		*prev = f->next;
+		break;
+	    }
+	}
+	dispatch_group_leave(f->group);
+	hostcache_flight_release(f);
+    });
+}
+
+void
+KRBFlushHostRealmCache(CFStringRef inHostName)
+{
+    char *name = NULL;
+
+    if (inHostName && __KRBCreateUTF8StringFromCFString(inHostName, &name) != noErr)
+	return;
+
+    KHLog ("    %s: flushing %s", __func__, name ? name : "all entries");
+
+    dispatch_sync(hostcache_queue(), ^{
+	struct hostcache_entry *e;
+
+	if (name) {
+	    hostcache_remove(name, 0);
+	    return;
+	}
+	while ((e = hostcache.entries) != NULL) {
+	    hostcache.entries = e->next;
+	    hostcache_free_entry(e);
+	}
+	hostcache.len = 0;
+    });
+
+    if (name)
+	__KRBReleaseUTF8String(name);
+}
+
+/*
+ * Pool of initialised krb5 and hx509 contexts.  Setting up a krb5
+ * context parses the configuration files and loads the plugins, so
+ * sessions, NAH objects and the reference count functions borrow one
+ * from here and give it back when they are done.
+ *
+ * The configuration files are stat()ed when a context is borrowed;
+ * if any of them changed the pooled krb5 and hx509 contexts are
+ * thrown away, contexts that are still borrowed are freed when they
+ * come back,
+ * and the host realm cache is flushed since its mappings came from
+ * the old configuration.
+ */
+
+#define CTXPOOL_MAX	8
+
+/* krb5 or hx509 context, they are told apart by the pointer */
+struct ctxpool_borrowed {
+    void *context;
+    unsigned long generation;
+};
+
+struct ctxpool_stale {
+    krb5_context krb5[CTXPOOL_MAX];
+    size_t krb5_len;
+    hx509_context hx509[CTXPOOL_MAX];
+    size_t hx509_len;
+};
+
+static struct {
+    dispatch_queue_t q;
+    unsigned long generation;
+    uint64_t signature;
+    krb5_context krb5[CTXPOOL_MAX];
+    size_t krb5_len;
+    hx509_context hx509[CTXPOOL_MAX];
+    size_t hx509_len;
+    struct ctxpool_borrowed *borrowed;
+    size_t borrowed_len;
+} ctxpool;
+
+static dispatch_queue_t
+ctxpool_queue(void)
+{
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+	ctxpool.q = dispatch_queue_create("com.apple.KerberosHelper.ctxpool", NULL);
+    });
+    return ctxpool.q;
+}
+
+static uint64_t
+config_signature(void)
+{
+    uint64_t sig = 14695981039346656037ULL;
+    char **files = NULL;
+    struct stat sb;
+    size_t i;
+
+    if (krb5_get_default_config_files(&files) != 0)
+	return 0;
+
+    for (i = 0; files && files[i]; i++) {
+	uint64_t v[4] = { 0, 0, 0, 0 };
+	size_t j;
+
+	if (stat(files[i], &sb) == 0) {
+	    v[0] = (uint64_t)sb.st_ino;
+	    v[1] = (uint64_t)sb.st_size;
+	    v[2] = (uint64_t)sb.st_mtimespec.tv_sec;
+	    v[3] = (uint64_t)sb.st_mtimespec.tv_nsec;
+	}
+	for (j = 0; j < sizeof(v)/sizeof(v[0]); j++) {
+	    sig ^= v[j];
+	    sig *= 1099511628211ULL;
+	}
+    }
+    krb5_free_config_files(files);
+
+    return sig;
+}
+
+/*
+ * Must be called on ctxpool.q.  If the configuration changed, starts
+ * a new generation and moves all pooled contexts to stale, returns
+ * true if there was an older configuration.
+ */
+static int
+ctxpool_check_signature(uint64_t sig, struct ctxpool_stale *stale)
+{
+    int changed;
+
+    if (sig == ctxpool.signature)
+	return 0;
+
+    changed = ctxpool.signature != 0;
+    ctxpool.signature = sig;
+    ctxpool.generation++;
+    memcpy(stale->krb5, ctxpool.krb5, ctxpool.krb5_len * sizeof(stale->krb5[0]));
+    stale->krb5_len = ctxpool.krb5_len;
+    ctxpool.krb5_len = 0;
+    memcpy(stale->hx509, ctxpool.hx509, ctxpool.hx509_len * sizeof(stale->hx509[0]));
+    stale->hx509_len = ctxpool.hx509_len;
+    ctxpool.hx509_len = 0;
+
+    return changed;
+}
+
+static void
+ctxpool_free_stale(struct ctxpool_stale *stale, int changed)
+{
+    size_t i;
+
+    for (i = 0; i < stale->krb5_len; i++)
+	krb5_free_context(stale->krb5[i]);
+    for (i = 0; i < stale->hx509_len; i++)
+	hx509_context_free(&stale->hx509[i]);
+    if (changed) {
+	KHLog ("    %s: configuration changed, reloading", __func__);
+	KRBFlushHostRealmCache(NULL);
+    }
+}
 
+/* remember a borrowed context and the generation it came from */
 static int
-is_lkdc_realm(const char *realm)
+ctxpool_add_borrowed(void *context, unsigned long generation)
 {
-    if (realm == NULL)
-	return 0;
-    return strncmp(realm, lkdc_prefix, sizeof(lkdc_prefix)-1) == 0 ||
-	strncmp(realm, wellknown_lkdc, sizeof(wellknown_lkdc) - 1) == 0;
+    __block int failed = 0;
+
+    dispatch_sync(ctxpool_queue(), ^{
+	struct ctxpool_borrowed *p, *b;
+
+	p = realloc(ctxpool.borrowed, sizeof(ctxpool.borrowed[0]) * (ctxpool.borrowed_len + 1));
+	if (p == NULL) {
+	    failed = 1;
+	    return;
+	}
+	ctxpool.borrowed = p;
+	b = &ctxpool.borrowed[ctxpool.borrowed_len++];
+	b->context = context;
+	b->generation = generation;
+    });
+    return failed;
 }
 
-/* If realms a and b have a common subrealm, returns the number of
- * common components.  Otherwise, returns zero.
- */
+/* must be called on ctxpool.q, returns true if context is still current */
 static int
-has_common_subrealm(const char *a, const char *b)
+ctxpool_remove_borrowed(void *context)
 {
-    const char *ap = &a[strlen(a)];
-    const char *bp = &b[strlen(b)];
-    unsigned int n = 0;
+    size_t i;
+    int current = 0;
 
-    if (ap == a || bp == b)
-        return 0;
-    for (--ap, --bp; ap >= a && bp >= b && *ap == *bp; --ap, --bp)
-        if ((ap == a && bp == b) ||
-            (ap == a && '.' == bp[-1]) ||
-            (bp == b && '.' == ap[-1]) ||
-            ('.' == ap[-1] && '.' == bp[-1]))
-            ++n;
-    return n;
+    for (i = 0; i < ctxpool.borrowed_len; i++) {
+	if (ctxpool.borrowed[i].context != context)
+	    continue;
+	current = ctxpool.borrowed[i].generation == ctxpool.generation;
+	ctxpool.borrowed[i] = ctxpool.borrowed[--ctxpool.borrowed_len];
+	break;
+    }
+    return current;
 }
 
-static const char *
-principal_realm(const char *princ)
+krb5_error_code
+KRBContextPoolGetKrb5(krb5_context *context)
 {
-    const char *p = &princ[strlen(princ)];
+    uint64_t sig = config_signature();
+    __block krb5_context pooled = NULL;
+    __block struct ctxpool_stale stale;
+    __block unsigned long generation;
+    __block int changed = 0;
+    krb5_error_code ret;
 
-    while (p > princ) {
-        if ('@' == p[0] && '\\' != p[-1])
-            break;
-        --p;
+    *context = NULL;
+    memset(&stale, 0, sizeof(stale));
+
+    dispatch_sync(ctxpool_queue(), ^{
+	changed = ctxpool_check_signature(sig, &stale);
+	if (ctxpool.krb5_len > 0)
+	    pooled = ctxpool.krb5[--ctxpool.krb5_len];
+	generation = ctxpool.generation;
+    });
+
+    ctxpool_free_stale(&stale, changed);
+
+    if (pooled == NULL) {
+	ret = krb5_init_context(&pooled);
+	if (ret)
+	    return ret;
     }
-    if (p == princ)
-        return NULL;
-    else
-        return &p[1];
+
+    if (ctxpool_add_borrowed(pooled, generation)) {
+	krb5_free_context(pooled);
+	return ENOMEM;
+    }
+
+    *context = pooled;
+    return 0;
 }
 
-static void
-add_mapping(KRBHelperContextRef hCtx, const char *hostname, const char *realm, int islkdc)
+void
+KRBContextPoolPutKrb5(krb5_context context)
 {
-    struct realm_mappings *p;
+    __block int keep = 0;
 
-    p = realloc(hCtx->realms.data, sizeof(hCtx->realms.data[0]) * (hCtx->realms.len + 1));
-    if (p == NULL)
+    if (context == NULL)
 	return;
-    hCtx->realms.data = p;
 
-    hCtx->realms.data[hCtx->realms.len].lkdc = islkdc;
-    hCtx->realms.data[hCtx->realms.len].hostname = strdup(hostname);
-    if (hCtx->realms.data[hCtx->realms.len].hostname == NULL)
-	return;
+    dispatch_sync(ctxpool_queue(), ^{
+	if (ctxpool_remove_borrowed(context) && ctxpool.krb5_len < CTXPOOL_MAX) {
+	    ctxpool.krb5[ctxpool.krb5_len++] = context;
+	    keep = 1;
+	}
+    });
 
-    hCtx->realms.data[hCtx->realms.len].realm = strdup(realm);
-    if (hCtx->realms.data[hCtx->realms.len].realm == NULL) {
-	free(hCtx->realms.data[hCtx->realms.len].hostname);
-	return;
+    if (!keep)
+	krb5_free_context(context);
+}
+
+int
+KRBContextPoolGetHx509(hx509_context *context)
+{
+    uint64_t sig = config_signature();
+    __block hx509_context pooled = NULL;
+    __block struct ctxpool_stale stale;
+    __block unsigned long generation;
+    __block int changed = 0;
+    int ret;
+
+    *context = NULL;
+    memset(&stale, 0, sizeof(stale));
+
+    dispatch_sync(ctxpool_queue(), ^{
+	changed = ctxpool_check_signature(sig, &stale);
+	if (ctxpool.hx509_len > 0)
+	    pooled = ctxpool.hx509[--ctxpool.hx509_len];
+	generation = ctxpool.generation;
+    });
+
+    ctxpool_free_stale(&stale, changed);
+
+    if (pooled == NULL) {
+	ret = hx509_context_init(&pooled);
+	if (ret)
+	    return ret;
     }
-    hCtx->realms.len++;
+
+    if (ctxpool_add_borrowed(pooled, generation)) {
+	hx509_context_free(&pooled);
+	return ENOMEM;
+    }
+
+    *context = pooled;
+    return 0;
 }
 
-static void
-find_mapping(KRBHelperContextRef hCtx, const char *hostname)
+void
+KRBContextPoolPutHx509(hx509_context context)
+{
+    __block int keep = 0;
+
+    if (context == NULL)
+	return;
+
+    dispatch_sync(ctxpool_queue(), ^{
+	if (ctxpool_remove_borrowed(context) && ctxpool.hx509_len < CTXPOOL_MAX) {
+	    ctxpool.hx509[ctxpool.hx509_len++] = context;
+	    keep = 1;
+	}
+    });
+
+    if (!keep)
+	hx509_context_free(&context);
+}
+
+/*
+ * Snapshot of the credential cache collection.  Walking the
+ * collection costs a few IPCs per cache when it is KCM backed, and
+ * NAHCreate and KRBCreateSessionInfo used to do it several times per
+ * call.  The snapshot is built in one pass and is kept for a few
+ * seconds; it is dropped earlier when the cache collection change
+ * notification fires or when we store new credentials ourselves.
+ */
+
+#define CCSNAPSHOT_TTL		5
+#define CCSNAPSHOT_NOTIFICATION	"com.apple.Kerberos.cache.changed"
+
+static struct {
+    dispatch_queue_t q;
+    KRBCacheSnapshotRef current;
+    time_t created;
+    int notify_token;
+    int can_cache;
+} ccsnapshot;
+
+static dispatch_queue_t
+ccsnapshot_queue(void)
+{
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+	ccsnapshot.q = dispatch_queue_create("com.apple.KerberosHelper.ccsnapshot", NULL);
+	/* Without the notification we can't tell when to drop it, don't cache */
+	if (notify_register_dispatch(CCSNAPSHOT_NOTIFICATION, &ccsnapshot.notify_token, ccsnapshot.q, ^(int token) {
+		    KRBCacheSnapshotRef old = ccsnapshot.current;
+		    ccsnapshot.current = NULL;
+		    KRBReleaseCacheSnapshot(old);
+		}) == NOTIFY_STATUS_OK)
+	    ccsnapshot.can_cache = 1;
+    });
+    return ccsnapshot.q;
+}
+
+static KRBCacheSnapshotRef
+ccsnapshot_create(krb5_context context)
 {
+    KRBCacheSnapshotRef snap;
+    krb5_cccol_cursor cursor;
+    krb5_principal client;
     krb5_error_code ret;
-    char **realmlist = NULL;
+    krb5_ccache id;
+    time_t now = time(NULL);
+
+    if ((snap = calloc(1, sizeof(*snap))) == NULL)
+	return NULL;
+    snap->refs = 1;
+
+    ret = krb5_cccol_cursor_new(context, &cursor);
+    if (ret) {
+	free(snap);
+	return NULL;
+    }
+
+    while ((ret = krb5_cccol_cursor_next(context, cursor, &id)) == 0 && id != NULL) {
+	struct ccache_snapshot_entry *e, *p;
+	krb5_data data;
+	time_t t;
+
+	ret = krb5_cc_get_principal(context, id, &client);
+	if (ret) {
+	    krb5_cc_close(context, id);
+	    continue;
+	}
+
+	p = realloc(snap->val, sizeof(snap->val[0]) * (snap->len + 1));
+	if (p == NULL) {
+	    krb5_free_principal(context, client);
+	    krb5_cc_close(context, id);
+	    break;
+	}
+	snap->val = p;
+	e = &snap->val[snap->len];
+	memset(e, 0, sizeof(*e));
+
+	if (krb5_cc_get_full_name(context, id, &e->name) != 0 ||
+	    krb5_unparse_name(context, client, &e->client) != 0 ||
+	    (e->realm = strdup(krb5_principal_get_realm(context, client))) == NULL)
+	{
+	    free(e->name);
+	    free(e->client);
+	    krb5_free_principal(context, client);
+	    krb5_cc_close(context, id);
+	    continue;
+	}
+
+	if (krb5_cc_get_lifetime(context, id, &t) == 0 && t > 0)
+	    e->expire = now + t;
+
+	e->lkdc = krb5_principal_is_lkdc(context, client);
+	krb5_free_principal(context, client);
+
+	if (e->lkdc && krb5_cc_get_config(context, id, NULL, "lkdc-hostname", &data) == 0) {
+	    e->lkdc_hostname = strndup(data.data, data.length);
+	    krb5_data_free(&data);
+	}
+	if (krb5_cc_get_config(context, id, NULL, "FriendlyName", &data) == 0) {
+	    e->friendly_name = strndup(data.data, data.length);
+	    krb5_data_free(&data);
+	}
+
+	krb5_cc_close(context, id);
+	snap->len++;
+    }
+
+    krb5_cccol_cursor_free(context, &cursor);
+
+    return snap;
+}
+
+KRBCacheSnapshotRef
+KRBCopyCacheSnapshot(krb5_context context)
+{
+    __block KRBCacheSnapshotRef snap = NULL;
+    dispatch_queue_t q = ccsnapshot_queue();
+    struct krb_phase_timer phase;
+
+    dispatch_sync(q, ^{
+	if (ccsnapshot.current && time(NULL) - ccsnapshot.created < CCSNAPSHOT_TTL) {
+	    snap = ccsnapshot.current;
+	    atomic_fetch_add(&snap->refs, 1);
+	}
+    });
+    KRBStatsCacheRecord(KRB_CACHE_CCACHE_SNAPSHOT, snap != NULL);
+    if (snap)
+	return snap;
+
+    KRBPhaseBegin(&phase, KRB_PHASE_CACHE_SCAN);
+    snap = ccsnapshot_create(context);
+    KRBPhaseEnd(&phase);
+    if (snap == NULL || !ccsnapshot.can_cache)
+	return snap;
+
+    atomic_fetch_add(&snap->refs, 1);
+    dispatch_sync(q, ^{
+	KRBCacheSnapshotRef old = ccsnapshot.current;
+	ccsnapshot.current = snap;
+	ccsnapshot.created = time(NULL);
+	KRBReleaseCacheSnapshot(old);
+    });
+
+    return snap;
+}
+
+void
+KRBReleaseCacheSnapshot(KRBCacheSnapshotRef snap)
+{
     size_t i;
-	
-    for (i = 0; i < hCtx->realms.len; i++)
-	if (strcasecmp(hCtx->realms.data[i].hostname, hostname) == 0)
-	    return;
-	
-    ret = krb5_get_host_realm(hCtx->krb5_ctx, hostname, &realmlist);
-    if (ret == 0) {
-	for (i = 0; realmlist && realmlist[i] && *(realmlist[i]); i++)
-	    add_mapping(hCtx, hostname, realmlist[i], 0);
-	if (i == 0)
-            KHLog ("    %s: krb5_get_host_realm returned unusable realm!", __func__);
+
+    if (snap == NULL || atomic_fetch_sub(&snap->refs, 1) != 1)
+	return;
+
+    for (i = 0; i < snap->len; i++) {
+	free(snap->val[i].name);
+	free(snap->val[i].client);
+	free(snap->val[i].realm);
+	free(snap->val[i].lkdc_hostname);
+	free(snap->val[i].friendly_name);
     }
+    free(snap->val);
+    free(snap);
+}
 
-    if (realmlist)
-        krb5_free_host_realm (hCtx->krb5_ctx, realmlist);
+void
+KRBInvalidateCacheSnapshot(void)
+{
+    dispatch_sync(ccsnapshot_queue(), ^{
+	KRBCacheSnapshotRef old = ccsnapshot.current;
+	ccsnapshot.current = NULL;
+	KRBReleaseCacheSnapshot(old);
+    });
 }
 
 static int
-parse_principal_name(krb5_context ctx, const char *princname, char **namep, char **instancep, char **realmp)
+parse_principal_name(krb5_context ctx, struct krb_arena *arena, const char *princname, char **namep, char **instancep, char **realmp)
 {
     krb5_principal principal = NULL;
     int err = 0;
@@ -190,10 +1429,10 @@ parse_principal_name(krb5_context ctx, const char *princname, char **namep, char
     
     len = krb5_principal_get_num_comp(ctx, principal);
     if (len > 0)
-	*namep = strdup(krb5_principal_get_comp_string(ctx, principal, 0));
+	*namep = arena_strdup(arena, krb5_principal_get_comp_string(ctx, principal, 0));
     if (len > 1)
-	*instancep = strdup(krb5_principal_get_comp_string(ctx, principal, 1));
-    *realmp = strdup(krb5_principal_get_realm(ctx, principal));
+	*instancep = arena_strdup(arena, krb5_principal_get_comp_string(ctx, principal, 1));
+    *realmp = arena_strdup(arena, krb5_principal_get_realm(ctx, principal));
     
  fin:
     if (NULL != principal)
@@ -206,9 +1445,10 @@ static int
 lookup_by_kdc(KRBhelperContext *hCtx, const char *name, char **realm)
 {
     krb5_error_code ret;
-    krb5_cccol_cursor cursor;
+    KRBCacheSnapshotRef snap;
     krb5_ccache id;
     krb5_creds mcred, *creds;
+    size_t i;
 
     memset(&mcred, 0, sizeof(mcred));
     *realm = NULL;
@@ -219,33 +1459,35 @@ lookup_by_kdc(KRBhelperContext *hCtx, const char *name, char **realm)
     if (ret)
 	return ret;
 
-    ret = krb5_cccol_cursor_new(hCtx->krb5_ctx, &cursor);
-    if (ret)
-	return ret;
+    snap = KRBCopyCacheSnapshot(hCtx->krb5_ctx);
+    if (snap == NULL) {
+	krb5_free_principal(hCtx->krb5_ctx, mcred.server);
+	return memFullErr;
+    }
+
+    ret = KRB5_CC_END;
 
-    while ((ret = krb5_cccol_cursor_next(hCtx->krb5_ctx, cursor, &id)) == 0) {
+    for (i = 0; i < snap->len; i++) {
+	const struct ccache_snapshot_entry *e = &snap->val[i];
 	const char *errmsg = NULL;
-	char *clientname;
 
-	if (id == NULL) {
-	    ret = memFullErr; /* XXX */
+	if (IS_CANCELLED(hCtx)) {
+	    ret = userCanceledErr;
 	    break;
 	}
 
-	ret = krb5_cc_get_principal(hCtx->krb5_ctx, id, &mcred.client);
+	ret = krb5_cc_resolve(hCtx->krb5_ctx, e->name, &id);
 	if (ret)
-	    goto next;
+	    continue;
 
-	ret = krb5_unparse_name(hCtx->krb5_ctx, mcred.client, &clientname);
+	ret = krb5_parse_name(hCtx->krb5_ctx, e->client, &mcred.client);
 	if (ret) {
-	    krb5_free_principal(hCtx->krb5_ctx, mcred.client);
-	    KHLog ("Failed to unparse name %s () - %d", __func__, ret);
+	    KHLog ("Failed to parse name %s () - %d", __func__, ret);
 	    goto next;
 	}
 
-	ret = krb5_principal_set_realm(hCtx->krb5_ctx, mcred.server, mcred.client->realm);
+	ret = krb5_principal_set_realm(hCtx->krb5_ctx, mcred.server, e->realm);
 	if (ret) {
-	    free(clientname);
 	    krb5_free_principal(hCtx->krb5_ctx, mcred.client);
 	    goto next;
 	}
@@ -255,10 +1497,9 @@ lookup_by_kdc(KRBhelperContext *hCtx, const char *name, char **realm)
 	if (ret)
 	    errmsg = krb5_get_error_message(hCtx->krb5_ctx, ret);
 	KHLog ("krb5_get_credentials(%s): referrals %s () - %s (%d)",
-	       clientname, __func__, errmsg ? errmsg : "success", ret);
+	       e->client, __func__, errmsg ? errmsg : "success", ret);
 	if (errmsg)
 	    krb5_free_error_message(hCtx->krb5_ctx, errmsg);
-	free(clientname);
 	if (ret == 0) {
 	    *realm = strdup(creds->server->realm);
 	    krb5_free_creds(hCtx->krb5_ctx, creds);
@@ -270,7 +1511,7 @@ lookup_by_kdc(KRBhelperContext *hCtx, const char *name, char **realm)
     }
 
     krb5_free_principal(hCtx->krb5_ctx, mcred.server);
-    krb5_cccol_cursor_free(hCtx->krb5_ctx, &cursor);
+    KRBReleaseCacheSnapshot(snap);
 
     return ret;
 }
@@ -308,6 +1549,180 @@ is_local_hostname(const char *host)
     return 0;
 }
 
+/*
+ * Reverse lookups of all addresses of the host, the lookups are done
+ * in parallel on the global queues and we wait at most `timeout'
+ * seconds for the answers. If a name maps to the hint realm, we
+ * stop waiting for the rest of the lookups.
+ *
+ * The worker blocks might outlive the caller, so they only touch the
+ * refcounted state below, protected by state->q.
+ */
+
+struct rdns_slot {
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    char ipbuf[NI_MAXHOST];
+    char hbuf[NI_MAXHOST];
+    int err;
+    int done;
+    int processed;
+};
+
+struct rdns_state {
+    dispatch_queue_t q;
+    dispatch_semaphore_t sema;
+    unsigned refs;
+    size_t len;
+    struct rdns_slot slots[1];
+};
+
+static void
+rdns_release(struct rdns_state *state)
+{
+    /* must be called on state->q */
+    if (--state->refs != 0)
+	return;
+    dispatch_release(state->sema);
+    dispatch_release(state->q);
+    free(state);
+}
+
+/*
+ * Returns 1 if all lookups completed (or a hint realm match was
+ * found), 0 if we gave up waiting on some of them.
+ */
+
+#define KRB_DEFAULT_REVERSE_LOOKUP_TIMEOUT	10.0
+
+static int
+reverse_lookup_addresses(KRBhelperContext *hCtx, const char *hintrealm, double timeout)
+{
+    struct rdns_state *state;
+    struct addrinfo *aip;
+    dispatch_time_t deadline;
+    size_t n, i, finished = 0;
+    int complete = 1;
+
+    for (n = 0, aip = hCtx->addr; aip != NULL; aip = aip->ai_next)
+	n++;
+    if (n == 0)
+	return 1;
+
+    state = calloc(1, sizeof(*state) + (n - 1) * sizeof(state->slots[0]));
+    if (state == NULL)
+	return 0;
+
+    state->q = dispatch_queue_create("com.apple.KerberosHelper.rdns", NULL);
+    state->sema = dispatch_semaphore_create(0);
+    if (state->q == NULL || state->sema == NULL) {
+	if (state->q)
+	    dispatch_release(state->q);
+	if (state->sema)
+	    dispatch_release(state->sema);
+	free(state);
+	return 0;
+    }
+    state->len = n;
+    state->refs = 1;
+
+    for (i = 0, aip = hCtx->addr; aip != NULL; aip = aip->ai_next) {
+	struct rdns_slot *slot = &state->slots[i];
+	int err;
+
+	if (aip->ai_addrlen > sizeof(slot->ss))
+	    continue;
+	memcpy(&slot->ss, aip->ai_addr, aip->ai_addrlen);
+	slot->sslen = aip->ai_addrlen;
+
+	/* pretty print name first for logging */
+	err = getnameinfo(aip->ai_addr, aip->ai_addrlen,
+			  slot->ipbuf, sizeof(slot->ipbuf),
+			  NULL, 0, NI_NUMERICHOST);
+	if (err)
+	    snprintf(slot->ipbuf, sizeof(slot->ipbuf), "getnameinfo-%d", (int)err);
+	i++;
+    }
+    state->len = n = i;
+    state->refs += n;
+
+    for (i = 0; i < n; i++) {
+	struct rdns_slot *slot = &state->slots[i];
+
+	dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+	    slot->err = getnameinfo((struct sockaddr *)&slot->ss, slot->sslen,
+				    slot->hbuf, sizeof(slot->hbuf), NULL, 0, NI_NAMEREQD);
+	    dispatch_async(state->q, ^{
+		slot->done = 1;
+		dispatch_semaphore_signal(state->sema);
+		rdns_release(state);
+	    });
+	});
+    }
+
+    deadline = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC));
+
+    while (finished < n) {
+	__block struct rdns_slot *slot = NULL;
+	dispatch_time_t wait = deadline;
+
+	/* wake up now and then to check if we are cancelled */
+	if (hCtx->cancel)
+	    wait = dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC);
+
+	if (dispatch_semaphore_wait(state->sema, wait) != 0) {
+	    if (IS_CANCELLED(hCtx)) {
+		complete = 0;
+		break;
+	    }
+	    if (wait != deadline && dispatch_time(DISPATCH_TIME_NOW, 0) < deadline)
+		continue;
+	    KHLog ("    %s: gave up waiting on %d reverse lookups", __func__, (int)(n - finished));
+	    complete = 0;
+	    break;
+	}
+
+	dispatch_sync(state->q, ^{
+	    size_t j;
+	    for (j = 0; j < state->len; j++) {
+		if (state->slots[j].done && !state->slots[j].processed) {
+		    state->slots[j].processed = 1;
+		    slot = &state->slots[j];
+		    break;
+		}
+	    }
+	});
+	if (slot == NULL)
+	    continue;
+	finished++;
+
+        KHLog("    %s: getnameinfo(%s) -> %s result %d %s",
+	      __func__, slot->ipbuf, slot->err ? "" : slot->hbuf, (int)slot->err,
+	      0 == slot->err ? "success" : gai_strerror (slot->err));
+	if (slot->err) {
+	    /* This is not a fatal error.  We'll keep looking for candidate host names. */
+	    continue;
+	}
+	find_mapping(hCtx, slot->hbuf, REALM_SOURCE_REVERSE_DNS);
+
+	if (hintrealm) {
+	    for (i = 0; i < hCtx->realms.len; i++)
+		if (strcmp(hintrealm, hCtx->realms.data[i].realm) == 0)
+		    break;
+	    if (i < hCtx->realms.len) {
+		KHLog ("    %s: found hint realm %s, skipping remaining lookups", __func__, hintrealm);
+		break;
+	    }
+	}
+    }
+
+    dispatch_sync(state->q, ^{
+	rdns_release(state);
+    });
+
+    return complete;
+}
+
 /*
  *
  */
@@ -316,43 +1731,165 @@ OSStatus
 KRBCreateSession(CFStringRef inHostName, CFStringRef inAdvertisedPrincipal,
                  void **outKerberosSession)
 {
-    KRBHelperContextRef session = NULL;
-    CFMutableDictionaryRef inInfo;
-    OSStatus error;
+    KRBHelperContextRef session = NULL;
+    CFMutableDictionaryRef inInfo;
+    OSStatus error;
+
+    *outKerberosSession = NULL;
+
+    inInfo = CFDictionaryCreateMutable (kCFAllocatorDefault, 2, &kCFCopyStringDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (inInfo == NULL)
+	return memFullErr;
+
+    if (inHostName)
+	CFDictionarySetValue (inInfo, kKRBHostnameKey, inHostName);
+    if (inAdvertisedPrincipal)
+	CFDictionarySetValue (inInfo, kKRBAdvertisedPrincipalKey, inAdvertisedPrincipal);
+
+    error = KRBCreateSessionInfo(inInfo, &session);
+    CFRelease(inInfo);
+    if (error == noErr)
+	*outKerberosSession = session;
+
+    return error;
+}
+
+
+/*
+ * Realm selection policy.  Every candidate mapping gets a score and
+ * the first mapping with the highest score wins.  The default weights
+ * give the same choice as the old ordered searches: for a local host
+ * name the hint realm (or any LKDC realm when there is no hint), then
+ * managed realms matching the hint, then any realm matching the hint,
+ * then the first mapping.  Source weights are zero by default so
+ * ties are broken by the order the mappings were found in.
+ *
+ * The weights can be overridden with the RealmSelectionPolicy
+ * dictionary in the com.apple.KerberosHelper preferences.
+ */
+
+struct realm_policy {
+    int local;			/* local host name: hint realm or LKDC realm */
+    int hint;			/* realm matches the hint realm, or no hint */
+    int managed;		/* not a LKDC realm, only when hint matches */
+    int source[REALM_SOURCE_MAX];
+};
+
+static const char *realm_source_names[REALM_SOURCE_MAX] = {
+    "KDC referral", "forward DNS", "reverse DNS", ".local"
+};
+
+static struct realm_policy realm_policy = {
+    .local = 1000,
+    .hint = 100,
+    .managed = 10,
+    .source = { 0, 0, 0, 0 }
+};
+
+static void
+realm_policy_weight(CFDictionaryRef dict, CFStringRef key, int *weight)
+{
+    CFNumberRef num = CFDictionaryGetValue(dict, key);
+    if (num && CFGetTypeID(num) == CFNumberGetTypeID())
+	CFNumberGetValue(num, kCFNumberIntType, weight);
+}
+
+static const struct realm_policy *
+get_realm_policy(void)
+{
+    static dispatch_once_t once;
+
+    dispatch_once(&once, ^{
+	CFPropertyListRef dict;
+
+	dict = CFPreferencesCopyAppValue(CFSTR("RealmSelectionPolicy"), CFSTR("com.apple.KerberosHelper"));
+	if (dict == NULL)
+	    return;
+	if (CFGetTypeID(dict) == CFDictionaryGetTypeID()) {
+	    realm_policy_weight(dict, CFSTR("Local"), &realm_policy.local);
+	    realm_policy_weight(dict, CFSTR("Hint"), &realm_policy.hint);
+	    realm_policy_weight(dict, CFSTR("Managed"), &realm_policy.managed);
+	    realm_policy_weight(dict, CFSTR("KDCReferral"), &realm_policy.source[REALM_SOURCE_KDC_REFERRAL]);
+	    realm_policy_weight(dict, CFSTR("ForwardDNS"), &realm_policy.source[REALM_SOURCE_FORWARD_DNS]);
+	    realm_policy_weight(dict, CFSTR("ReverseDNS"), &realm_policy.source[REALM_SOURCE_REVERSE_DNS]);
+	    realm_policy_weight(dict, CFSTR("LocalName"), &realm_policy.source[REALM_SOURCE_LOCAL_NAME]);
+	}
+	CFRelease(dict);
+    });
+    return &realm_policy;
+}
+
+/*
+ * Pick the best mapping in one pass over the candidates.
+ */
+
+static struct realm_mappings *
+select_mapping(KRBHelperContextRef hCtx, const char *hintrealm, int consider_local)
+{
+    const struct realm_policy *policy = get_realm_policy();
+    struct realm_mappings *m, *best = NULL;
+    unsigned long hinthash = hintrealm ? realm_hash(hintrealm) : 0;
+    int score, best_score = 0, hint_match, hint_ok;
+    size_t i;
 
-    *outKerberosSession = NULL;
+    /* The KDC told us the realm, no need to guess */
+    if (hCtx->noGuessing && hCtx->realms.len)
+	return &hCtx->realms.data[0];
 
-    inInfo = CFDictionaryCreateMutable (kCFAllocatorDefault, 2, &kCFCopyStringDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-    if (inInfo == NULL)
-	return memFullErr;
+    for (i = 0; i < hCtx->realms.len; i++) {
+	m = &hCtx->realms.data[i];
+
+	hint_match = hintrealm && m->realmhash == hinthash && strcasecmp(hintrealm, m->realm) == 0;
+	hint_ok = hintrealm == NULL || hint_match;
+
+	score = 0;
+	if (m->source >= 0 && m->source < REALM_SOURCE_MAX)
+	    score += policy->source[m->source];
+	if (consider_local && (hintrealm ? hint_match : m->lkdc))
+	    score += policy->local;
+	if (hint_ok) {
+	    score += policy->hint;
+	    if (!m->lkdc)
+		score += policy->managed;
+	}
 
-    if (inHostName)
-	CFDictionarySetValue (inInfo, kKRBHostnameKey, inHostName);
-    if (inAdvertisedPrincipal)
-	CFDictionarySetValue (inInfo, kKRBAdvertisedPrincipalKey, inAdvertisedPrincipal);
+	if (best == NULL || score > best_score) {
+	    best = m;
+	    best_score = score;
+	}
+    }
 
-    error = KRBCreateSessionInfo(inInfo, &session);
-    CFRelease(inInfo);
-    if (error == noErr)
-	*outKerberosSession = session;
+    if (best)
+	KHLog ("    %s: picked %s -> %s (%s, %s) score %d of %d candidates%s%s", __func__,
+	       best->hostname, best->realm,
+	       best->lkdc ? "LKDC" : "managed",
+	       (best->source >= 0 && best->source < REALM_SOURCE_MAX) ? realm_source_names[best->source] : "unknown",
+	       best_score, (int)hCtx->realms.len,
+	       consider_local ? ", local host name" : "",
+	       hintrealm ? ", hint realm given" : "");
 
-    return error;
+    return best;
 }
 
-
-OSStatus
-KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSession)
+static OSStatus
+create_session_info(CFDictionaryRef inDict, const volatile int *cancel, KRBHelperContextRef *outKerberosSession)
 {
     CFStringRef inHostName, inAdvertisedPrincipal, noLocalKDC;
-    char hbuf[NI_MAXHOST];
-    struct addrinfo hints, *aip = NULL;
+    CFNumberRef inTimeout;
+    struct addrinfo hints;
     KRBhelperContext *hCtx = NULL;
     char *tmp = NULL;
     char *hintname = NULL, *hinthost = NULL, *hintrealm = NULL;
-    char *localname = NULL, *hostname = NULL;
+    char *localname = NULL, *hostname = NULL, *cachename = NULL;
     struct realm_mappings *selected_mapping = NULL;
+    struct hostcache_flight *flight = NULL;
     OSStatus err = noErr;
+    struct krb_phase_timer phase;
+    Boolean deconstructed;
+    int found, ret;
     int avoidDNSCanonicalizationBug = 0;
+    int complete_lookup = 1;
+    double rdnsTimeout = KRB_DEFAULT_REVERSE_LOOKUP_TIMEOUT;
     size_t i;
 
     *outKerberosSession = NULL;
@@ -363,6 +1900,9 @@ KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSe
     inHostName = CFDictionaryGetValue(inDict, kKRBHostnameKey);
     inAdvertisedPrincipal = CFDictionaryGetValue(inDict, kKRBAdvertisedPrincipalKey);
     noLocalKDC = CFDictionaryGetValue(inDict, kKRBNoLKDCKey);
+    inTimeout = CFDictionaryGetValue(inDict, kKRBReverseLookupTimeoutKey);
+    if (inTimeout && CFGetTypeID(inTimeout) == CFNumberGetTypeID())
+	CFNumberGetValue(inTimeout, kCFNumberDoubleType, &rdnsTimeout);
 
     KHLog ("[[[ %s () - required parameters okay: %s %s %s", __func__,
 	   inHostName ? "iHN" : "-",
@@ -377,18 +1917,21 @@ KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSe
     if (NULL == (hCtx = calloc(1, sizeof(*hCtx))))
 	return memFullErr;
 
-    if (0 != k5_ok( krb5_init_context (&hCtx->krb5_ctx) )) {
+    hCtx->cancel = cancel;
+    arena_init(&hCtx->arena);
+
+    if (0 != k5_ok( KRBContextPoolGetKrb5 (&hCtx->krb5_ctx) )) {
 	err = memFullErr;
 	goto out;
     }
 
-    if (0 != hx509_context_init(&hCtx->hx_ctx)) {
+    if (0 != KRBContextPoolGetHx509(&hCtx->hx_ctx)) {
 	err = memFullErr;
 	goto out;
     }
 
     if (0 == k5_ok( krb5_get_default_realm (hCtx->krb5_ctx, &tmp) ) && NULL != tmp) {
-	if (NULL == (hCtx->defaultRealm = strdup (tmp))) {
+	if (NULL == (hCtx->defaultRealm = arena_strdup (&hCtx->arena, tmp))) {
 	    err = memFullErr;
 	    goto out;
 	}
@@ -410,22 +1953,37 @@ KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSe
      * available.
      */
     if (NULL != inAdvertisedPrincipal) {
-        char *s = NULL;
+        __KRBStringView view;
         hCtx->inAdvertisedPrincipal = CFRetain (inAdvertisedPrincipal);
-        if (0 != __KRBCreateUTF8StringFromCFString (inAdvertisedPrincipal, &s))
-            KHLog ("    %s: __KRBCreateUTF8StringFromCFString failed", __func__);
-        else {
-            (void)parse_principal_name (hCtx->krb5_ctx, s, &hintname, &hinthost, &hintrealm);
-            __KRBReleaseUTF8String (s);
-        }
+        if (NULL == __KRBStringViewInit (&view, inAdvertisedPrincipal))
+            KHLog ("    %s: __KRBStringViewInit failed", __func__);
+        else
+            (void)parse_principal_name (hCtx->krb5_ctx, &hCtx->arena, view.str, &hintname, &hinthost, &hintrealm);
+        __KRBStringViewRelease (&view);
     }
 
-    /* Decode the given host name with _CFNetServiceDeconstructServiceName before proceeding. */
-
-    if (! _CFNetServiceDeconstructServiceName (inHostName, &hostname))
-        __KRBCreateUTF8StringFromCFString (inHostName, &hostname);
-    else
+    /* Decode the given host name with _CFNetServiceDeconstructServiceName before proceeding,
+     * the working copies of the host name are kept in the session arena. */
+    tmp = NULL;
+    KRBPhaseBegin(&phase, KRB_PHASE_DECONSTRUCT);
+    deconstructed = _CFNetServiceDeconstructServiceName (inHostName, &tmp);
+    KRBPhaseEnd(&phase);
+    if (deconstructed) {
         avoidDNSCanonicalizationBug = 1;
+	if (tmp)
+	    hostname = arena_strdup(&hCtx->arena, tmp);
+	free(tmp);
+    } else {
+	__KRBStringView view;
+	if (__KRBStringViewInit (&view, inHostName) != NULL)
+	    hostname = arena_strdup(&hCtx->arena, view.str);
+	__KRBStringViewRelease (&view);
+    }
+    tmp = NULL;
+    if (hostname == NULL) {
+	err = memFullErr;
+	goto out;
+    }
 
     /* remove trailing dot */
     i = strlen(hostname);
@@ -444,34 +2002,72 @@ KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSe
 
     KHLog ("    %s: processed host name = %s", __func__, hostname);
 
+    /*
+     * Check if we already did all the lookups for this host recently
+     */
+
+    found = hostcache_lookup(hCtx, hostname, hintrealm, &tmp);
+    if (!found && !hostcache_flight_begin(hCtx, hostname, rdnsTimeout, &flight)) {
+	if (IS_CANCELLED(hCtx)) {
+	    err = userCanceledErr;
+	    goto out;
+	}
+	/* if the other lookup didn't give us anything, we do our own */
+	found = hostcache_lookup(hCtx, hostname, hintrealm, &tmp);
+    }
+    KRBStatsCacheRecord(KRB_CACHE_HOST, found);
+    if (found) {
+	KHLog ("    %s: using cached mappings for %s", __func__, hostname);
+	if (tmp)
+	    hostname = tmp;
+	goto done;
+    }
+
+    if ((cachename = arena_strdup(&hCtx->arena, hostname)) == NULL) {
+	err = memFullErr;
+	goto out;
+    }
+
     /* 
      * Try find name by asking the KDC first
      */
 
-    if (lookup_by_kdc(hCtx, hostname, &tmp) == 0) {
-	add_mapping(hCtx, hostname, tmp, 0);
+    KRBPhaseBegin(&phase, KRB_PHASE_KDC_LOOKUP);
+    ret = lookup_by_kdc(hCtx, hostname, &tmp);
+    KRBPhaseEnd(&phase);
+    if (ret == 0) {
+	add_mapping(hCtx, hostname, tmp, 0, REALM_SOURCE_KDC_REFERRAL);
 	free(tmp);
 	err = noErr;
 	hCtx->noGuessing = 1;
 	goto done;
     }
 
+    if (IS_CANCELLED(hCtx)) {
+	err = userCanceledErr;
+	goto out;
+    }
+
 
     /*
      * If the given name is a bare name (i.e. no dots), we may need
      * to attempt to look it up as `<name>.local' later.
      */
-    if (NULL == strchr(hostname, '.') &&
-	(0 > asprintf(&localname, "%s.local", hostname) || NULL == localname)) {
-	err = memFullErr;
-	goto out;
+    if (NULL == strchr(hostname, '.')) {
+	size_t len = strlen(hostname) + sizeof(".local");
+
+	if ((localname = arena_alloc(&hCtx->arena, len)) == NULL) {
+	    err = memFullErr;
+	    goto out;
+	}
+	snprintf(localname, len, "%s.local", hostname);
     }
 
     /*
      * Before we canonlize the hostname, lets find the realm.
      */
 
-    find_mapping(hCtx, hostname);
+    find_mapping(hCtx, hostname, REALM_SOURCE_FORWARD_DNS);
 
     /* Normalize the given host name using getaddrinfo AI_CANONNAME if
      * possible. Track the resulting host name (normalized or not) as
@@ -484,13 +2080,17 @@ KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSe
     {
         memset (&hints, 0, sizeof(hints));
         hints.ai_flags = AI_CANONNAME;
+        KRBPhaseBegin(&phase, KRB_PHASE_GETADDRINFO);
         err = getaddrinfo (hostname, NULL, &hints, &hCtx->addr);
+        KRBPhaseEnd(&phase);
         KHLog ("    %s: getaddrinfo = %s (%d)", __func__, 0 == err ? "success" : gai_strerror (err), (int)err);
+	if (IS_CANCELLED(hCtx)) {
+	    err = userCanceledErr;
+	    goto out;
+	}
         if (0 == err && avoidDNSCanonicalizationBug == 0 && hCtx->addr->ai_canonname) {
-	    if ((tmp = strdup(hCtx->addr->ai_canonname)) != NULL) {
-		free(hostname);
+	    if ((tmp = arena_strdup(&hCtx->arena, hCtx->addr->ai_canonname)) != NULL)
 		hostname = tmp;
-	    }
             KHLog ("    %s: canonical host name = %s", __func__, hostname);
         }
     }
@@ -499,7 +2099,7 @@ KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSe
      * Try adding the mapping for the canonlical name if we got one
      */
 
-    find_mapping(hCtx, hostname);
+    find_mapping(hCtx, hostname, REALM_SOURCE_FORWARD_DNS);
 
     /*
      * If we have a hintrealm and there our initial guessing is right,
@@ -509,8 +2109,10 @@ KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSe
 
     if (hintrealm) {
 	for (i = 0; i < hCtx->realms.len; i++)
-	    if (strcmp(hintrealm, hCtx->realms.data[i].realm) == 0)
+	    if (strcmp(hintrealm, hCtx->realms.data[i].realm) == 0) {
+		complete_lookup = 0;
 		goto done;
+	    }
     }
 
     /*
@@ -518,25 +2120,14 @@ KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSe
      * find a mapping.
      */
 
-    for (aip = hCtx->addr; NULL != aip; aip = aip->ai_next) {
-	char ipbuf[NI_MAXHOST];
-		
-	/* pretty print name first for logging */
-	err = getnameinfo(aip->ai_addr, aip->ai_addrlen,
-			  ipbuf, sizeof(ipbuf),
-			  NULL, 0, NI_NUMERICHOST);
-	if (err)
-	    snprintf(ipbuf, sizeof(ipbuf), "getnameinfo-%d", (int)err);
+    KRBPhaseBegin(&phase, KRB_PHASE_REVERSE_DNS);
+    if (!reverse_lookup_addresses(hCtx, hintrealm, rdnsTimeout))
+	complete_lookup = 0;
+    KRBPhaseEnd(&phase);
 
-        err = getnameinfo (aip->ai_addr, aip->ai_addr->sa_len, hbuf,
-			   sizeof(hbuf), NULL, 0, NI_NAMEREQD);
-        KHLog("    %s: getnameinfo(%s) -> %s result %d %s",
-	      __func__, ipbuf, hbuf, (int)err, 0 == err ? "success" : gai_strerror (err));
-        if (err) {
-	    /* This is not a fatal error.  We'll keep looking for candidate host names. */
-            continue;
-        }
-	find_mapping(hCtx, hbuf);
+    if (IS_CANCELLED(hCtx)) {
+	err = userCanceledErr;
+	goto out;
     }
 
     /* Reset err */
@@ -548,13 +2139,20 @@ KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSe
      */
 
     if (localname)
-	find_mapping(hCtx, localname);
+	find_mapping(hCtx, localname, REALM_SOURCE_LOCAL_NAME);
 
  done:
     /*
      * Done fetching all data, will no try to find a mapping
      */ 
 
+    if (cachename && !IS_CANCELLED(hCtx))
+	hostcache_store(hCtx, cachename, hostname, complete_lookup);
+    if (flight) {
+	hostcache_flight_end(flight);
+	flight = NULL;
+    }
+
     for (i = 0; i < hCtx->realms.len; i++) {
 	KHLog ("    %s: available mappings: %s -> %s (%s)", __func__,
 	       hCtx->realms.data[i].hostname,
@@ -562,58 +2160,7 @@ KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSe
 	       hCtx->realms.data[i].lkdc ? "LKDC" : "managed");
     }
 	
-    /*
-     * If we have noGuessing mapping, lets pick the first guess then.
-     */
-
-    if (!selected_mapping && hCtx->noGuessing && hCtx->realms.len)
-	selected_mapping = &hCtx->realms.data[0];
-
-    /*
-     * If we have "local" hostname, lets consider LKDC more aggressively.
-     */
-
-    if (noLocalKDC == 0 && is_local_hostname(hostname)) {
-
-	if (hintrealm) {
-	    /*
-	     * Search for localKDC mapping when we have a hint realm.
-	     */
-	    for (i = 0; i < hCtx->realms.len && !selected_mapping; i++)
-		if (strcasecmp(hintrealm, hCtx->realms.data[i].realm) == 0)
-		    selected_mapping = &hCtx->realms.data[i];
-	} else {				
-	    /*
-	     * If we are using have no hintrealm, just pick any LKDC realm.
-	     */
-	    for (i = 0; i < hCtx->realms.len && !selected_mapping; i++)
-		if (hCtx->realms.data[i].lkdc)
-		    selected_mapping = &hCtx->realms.data[i];
-	}
-    }
-    /*
-     * Search for managed realm, the make us prefer manged realms for
-     * no local hostnames.
-     */
-    for (i = 0; i < hCtx->realms.len && !selected_mapping; i++) {
-	if (hCtx->realms.data[i].lkdc)
-	    continue;
-	if (hintrealm == NULL || strcasecmp(hintrealm, hCtx->realms.data[i].realm) == 0)
-	    selected_mapping = &hCtx->realms.data[i];
-    }
-
-    /*
-     * Search for LKDC again if no managed realm was found 
-     */
-    for (i = 0; i < hCtx->realms.len && !selected_mapping; i++)
-	if (hintrealm == NULL || strcasecmp(hintrealm, hCtx->realms.data[i].realm) == 0)
-	    selected_mapping = &hCtx->realms.data[i];
-
-    /*
-     * If we still failed to find a mapping, just pick the first.
-     */
-    for (i = 0; i < hCtx->realms.len && !selected_mapping; i++)
-	selected_mapping = &hCtx->realms.data[i];
+    selected_mapping = select_mapping(hCtx, hintrealm, noLocalKDC == NULL && is_local_hostname(hostname));
 
     if (selected_mapping == NULL) {
 	KHLog ("    %s: No mapping for host name = %s found", __func__, hostname);
@@ -641,22 +2188,14 @@ KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSe
     }
 	
  out:
-    free (hintname);
-    free (hinthost);
-    free (hintrealm);
-    free (hostname);
-    free (localname);
+    if (flight)
+	hostcache_flight_end(flight);
 
     /* 
      * On error, free all members of the context and the context itself.
      */
     if (noErr != err) {
-	for (i = 0; i < hCtx->realms.len; i++) {
-	    free(hCtx->realms.data[i].hostname);
-	    free(hCtx->realms.data[i].realm);
-	}
-	free(hCtx->realms.data);
-	free (hCtx->defaultRealm);
+	arena_free(&hCtx->arena);
 	if (NULL != hCtx->realm)
 	    CFRelease (hCtx->realm);
 	if (NULL != hCtx->inAdvertisedPrincipal)
@@ -666,20 +2205,119 @@ KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSe
 	if (NULL != hCtx->inHostName)
 	    CFRelease (hCtx->inHostName);
 	if (NULL != hCtx->krb5_ctx)
-	    krb5_free_context (hCtx->krb5_ctx);
+	    KRBContextPoolPutKrb5 (hCtx->krb5_ctx);
 	if (NULL != hCtx->hx_ctx)
-	    hx509_context_free(&hCtx->hx_ctx);
+	    KRBContextPoolPutHx509(hCtx->hx_ctx);
 	if (NULL != hCtx->addr)
 	    freeaddrinfo(hCtx->addr);
 	
 	free (hCtx);
-    } else
+    } else {
+	hCtx->cancel = NULL;
         *outKerberosSession = hCtx;
+    }
 
     KHLog ("]]] %s () = %d", __func__, (int)err);
     return err;
 }
 
+OSStatus
+KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSession)
+{
+    return create_session_info(inDict, NULL, outKerberosSession);
+}
+
+/*
+ * Asynchronous version of KRBCreateSessionInfo, the work is done on
+ * the global queue and the result is delivered on `queue'.
+ */
+
+struct KRBSessionRequest {
+    _Atomic int refs;
+    volatile int cancelled;
+};
+
+static void
+session_request_release(struct KRBSessionRequest *req)
+{
+    if (atomic_fetch_sub(&req->refs, 1) == 1)
+	free(req);
+}
+
+KRBSessionRequestRef
+KRBCreateSessionInfoAsync(CFDictionaryRef inDict,
+			  dispatch_queue_t queue,
+			  void (^complete)(OSStatus err, KRBHelperContextRef session))
+{
+    void (^c)(OSStatus, KRBHelperContextRef);
+    struct KRBSessionRequest *req;
+    CFDictionaryRef info;
+
+    if (inDict == NULL || queue == NULL || complete == NULL)
+	return NULL;
+
+    info = CFDictionaryCreateCopy(NULL, inDict);
+    if (info == NULL)
+	return NULL;
+
+    req = calloc(1, sizeof(*req));
+    if (req == NULL) {
+	CFRelease(info);
+	return NULL;
+    }
+    /* one for the caller, one for the request in flight */
+    atomic_init(&req->refs, 2);
+
+    c = (void (^)(OSStatus, KRBHelperContextRef))Block_copy(complete);
+    dispatch_retain(queue);
+
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+	    KRBHelperContextRef session = NULL;
+	    OSStatus err;
+
+	    if (req->cancelled)
+		err = userCanceledErr;
+	    else
+		err = create_session_info(info, &req->cancelled, &session);
+	    CFRelease(info);
+
+	    dispatch_async(queue, ^{
+		    OSStatus e = err;
+		    KRBHelperContextRef s = session;
+
+		    if (req->cancelled) {
+			if (s)
+			    KRBCloseSession(s);
+			s = NULL;
+			e = userCanceledErr;
+		    }
+		    c(e, s);
+		    Block_release(c);
+		    dispatch_release(queue);
+		    session_request_release(req);
+		});
+	});
+
+    return req;
+}
+
+void
+KRBCancelSessionRequest(KRBSessionRequestRef req)
+{
+    if (req == NULL)
+	return;
+    KHLog ("    %s: cancelling session request", __func__);
+    req->cancelled = 1;
+}
+
+void
+KRBReleaseSessionRequest(KRBSessionRequestRef req)
+{
+    if (req == NULL)
+	return;
+    session_request_release(req);
+}
+
 /*
 
   KRBCopyREALM will return the REALM for the host that was passed to KRBCreateSession
@@ -843,12 +2481,7 @@ KRBCopyServicePrincipalInfo (KRBHelperContextRef inKerberosSession, CFStringRef
 	CFDictionarySetValue (outInfo, kKRBNoCanonKey, CFSTR("nodns"));
 	
 
-    {
-	char *spn;
-	__KRBCreateUTF8StringFromCFString (outString, &spn);
-	KHLog ("    KRBCopyServicePrincipalInfo: principal = \"%s\"", spn);
-	__KRBReleaseUTF8String (spn);
-    }
+    KHLog ("    KRBCopyServicePrincipalInfo: principal = \"%@\"", outString);
 
     *outServiceInfo = outInfo;
     
@@ -877,6 +2510,62 @@ search_array(CFArrayRef array, CFTypeRef key)
     return NULL;
 }
 
+/*
+ * Label for a certificate, the user@domain name of .Mac / MobileMe
+ * sharing certificates or whatever the Security framework infers.
+ */
+
+static OSStatus
+copy_inferred_label(SecCertificateRef certRef, CFStringRef *outLabel)
+{
+    const CFStringRef dotmac = CFSTR(".Mac Sharing Certificate");
+    const CFStringRef mobileMe = CFSTR("MobileMe Sharing Certificate");
+    CFStringRef inferredLabel = NULL;
+
+    *outLabel = NULL;
+
+    void *values[4] = { (void *)kSecOIDDescription, (void *)kSecOIDCommonName, (void *)kSecOIDOrganizationalUnitName, (void *)kSecOIDX509V1SubjectName };
+    CFArrayRef attrs = CFArrayCreate(NULL, (const void **)values, sizeof(values) / sizeof(values[0]), &kCFTypeArrayCallBacks);
+    if (NULL == attrs) { return memFullErr; }
+
+    CFDictionaryRef certval = SecCertificateCopyValues(certRef, attrs, NULL);
+    CFRelease(attrs);
+    if (NULL == certval) { return errSecDecode; }
+
+    CFDictionaryRef subject = CFDictionaryGetValue(certval, kSecOIDX509V1SubjectName);
+    if (NULL != subject) {
+
+	CFArrayRef val = CFDictionaryGetValue(subject, kSecPropertyKeyValue);
+
+	if (NULL != val) {
+
+	    CFStringRef description = search_array(val, kSecOIDDescription);
+
+	    if (NULL != description &&
+		(kCFCompareEqualTo == CFStringCompare(description, dotmac, 0) || kCFCompareEqualTo == CFStringCompare(description, mobileMe, 0)))
+	    {
+		CFStringRef commonName = search_array(val, kSecOIDCommonName);
+		CFStringRef organizationalUnit = search_array(val, kSecOIDOrganizationalUnitName);
+
+		if (NULL != commonName && NULL != organizationalUnit) {
+		    inferredLabel = CFStringCreateWithFormat (NULL, NULL, CFSTR("%@@%@"), commonName, organizationalUnit);
+		}
+	    }
+	}
+    }
+
+    CFRelease(certval);
+
+    if (NULL == inferredLabel) {
+	OSStatus err = SecCertificateInferLabel (certRef, &inferredLabel);
+	if (0 != err)
+	    return err;
+    }
+
+    *outLabel = inferredLabel;
+    return noErr;
+}
+
 /*
   KRBCopyClientPrincipalInfo will return a dictionary with the user principal and other information.
   inKerberosSession is the pointer returned by KRBCreateSession.
@@ -940,10 +2629,9 @@ OSStatus KRBCopyClientPrincipalInfo (KRBHelperContextRef inKerberosSession,  CFD
     }
     
     if (NULL != certRef && SecCertificateGetTypeID() == CFGetTypeID (certRef)) {
-	const CFStringRef dotmac = CFSTR(".Mac Sharing Certificate");
-	const CFStringRef mobileMe = CFSTR("MobileMe Sharing Certificate");
-        
-	useClientName = NAHCopyMMeUserNameFromCertificate(certRef);
+	__block OSStatus labelErr = noErr;
+
+	useClientName = NAHCertCacheCopyDigestName(certRef);
 	if (useClientName == NULL) { goto Error; }
 
         usingCertificate = 1;
@@ -951,43 +2639,18 @@ OSStatus KRBCopyClientPrincipalInfo (KRBHelperContextRef inKerberosSession,  CFD
         if (NULL != useClientName) {
             certificateHash = CFRetain (useClientName);
         }
-        
-	void *values[4] = { (void *)kSecOIDDescription, (void *)kSecOIDCommonName, (void *)kSecOIDOrganizationalUnitName, (void *)kSecOIDX509V1SubjectName };
-	CFArrayRef attrs = CFArrayCreate(NULL, (const void **)values, sizeof(values) / sizeof(values[0]), &kCFTypeArrayCallBacks);
-	if (NULL == attrs) { goto Error; }
-
-	CFDictionaryRef certval = SecCertificateCopyValues(certRef, attrs, NULL);
-	CFRelease(attrs);
-	if (NULL == certval) { goto Error; }
-
-	err = 0;
-
-	CFDictionaryRef subject = CFDictionaryGetValue(certval, kSecOIDX509V1SubjectName);
-	if (NULL != subject) {
 
-	    CFArrayRef val = CFDictionaryGetValue(subject, kSecPropertyKeyValue);
+	inferredLabel = NAHCertCacheCopyValue(certRef, CFSTR("inferred-label"), ^(CFDataRef digest) {
+		CFStringRef label = NULL;
 
-	    if (NULL != val) {
-
-		CFStringRef description = search_array(val, kSecOIDDescription);
-
-		if (NULL != description &&
-		    (kCFCompareEqualTo == CFStringCompare(description, dotmac, 0) || kCFCompareEqualTo == CFStringCompare(description, mobileMe, 0)))
-		{
-		    CFStringRef commonName = search_array(val, kSecOIDCommonName);
-		    CFStringRef organizationalUnit = search_array(val, kSecOIDOrganizationalUnitName);
-
-		    if (NULL != commonName && NULL != organizationalUnit) {
-			inferredLabel = CFStringCreateWithFormat (NULL, NULL, CFSTR("%@@%@"), commonName, organizationalUnit);
-		    }
-		}
-	    }
-	}
-    
-	CFRelease(certval);
+		struct krb_phase_timer phase;
 
-	if (NULL == inferredLabel)
-	    err = SecCertificateInferLabel (certRef, &inferredLabel);
+		KRBPhaseBegin(&phase, KRB_PHASE_CERTIFICATE);
+		labelErr = copy_inferred_label(certRef, &label);
+		KRBPhaseEnd(&phase);
+		return (CFTypeRef)label;
+	    });
+	err = labelErr;
 
         if (0 != err) { goto Error; }            
 
@@ -1265,53 +2928,62 @@ OSStatus KRBTestForExistingTicket (KRBHelperContextRef inKerberosSession, CFDict
 }
 
 /*
-  KRBAcquireTicket will acquire a ticket for the user.
-  inKerberosSession is the pointer returned by KRBCreateSession.
-  inClientPrincipalInfo is the outClientPrincipalInfo dictionary from KRBCopyClientPrincipalInfo.
-*/
-OSStatus KRBAcquireTicket(KRBHelperContextRef inKerberosSession, CFDictionaryRef inClientPrincipalInfo)
+ * Acquire a ticket for one principal info dictionary.  The batch
+ * mode passes its own contexts, the options shared by the password
+ * entries, and the realm all principals have to be in.
+ */
+
+static OSStatus
+acquire_ticket(KRBhelperContext *hCtx, krb5_context context, hx509_context hxctx,
+	       krb5_get_init_creds_opt *shared_opt, const char *batch_realm,
+	       CFDictionaryRef inClientPrincipalInfo)
 {
     OSStatus            err = noErr;
-    KRBhelperContext    *hCtx = (KRBhelperContext *)inKerberosSession;
     krb5_error_code            krb_err = 0;
     krb5_principal      clientPrincipal = NULL;
     CFStringRef         principal = NULL, password = NULL;
     char                *principalString = NULL, *passwordString = NULL;
     SecIdentityRef      usingCertificate = NULL;
     CFStringRef		    inferredLabel = NULL;
-    krb5_get_init_creds_opt *opt;
+    krb5_get_init_creds_opt *opt = NULL, *own_opt = NULL;
     krb5_ccache id = NULL;
     krb5_creds cred;
     int destroy_cache = 0;
     krb5_init_creds_context icc = NULL;
+    struct krb_phase_timer phase;
     
     memset(&cred, 0, sizeof(cred));
 
-    if (NULL == hCtx) {
-	KHLog ("%s", "[[[ KRBAcquireTicket () - no context will raise() in the future");
-	return paramErr;
-    }
-
     KHLog ("%s", "[[[ KRBAcquireTicket () - required parameters okay");
 
     principal = CFDictionaryGetValue (inClientPrincipalInfo, kKRBClientPrincipalKey);
     if (NULL == principal) { err = paramErr; goto Error; }
     __KRBCreateUTF8StringFromCFString (principal, &principalString);
     
-    krb_err = krb5_parse_name(hCtx->krb5_ctx, principalString, &clientPrincipal);
+    krb_err = krb5_parse_name(context, principalString, &clientPrincipal);
     if (krb_err) {
 	err = paramErr; goto Error;
     }
+
+    if (batch_realm && strcmp(batch_realm, krb5_principal_get_realm(context, clientPrincipal)) != 0) {
+	KHLog ("    KRBAcquireTicket: %s not in the batch realm %s", principalString, batch_realm);
+	err = paramErr; goto Error;
+    }
     
     CFDictionaryGetValueIfPresent (inClientPrincipalInfo, kKRBUsingCertificateKey, (const void **)&usingCertificate);
     
-    krb_err = k5_ok(krb5_get_init_creds_opt_alloc (hCtx->krb5_ctx, &opt));
-    if (krb_err) {
-	err = paramErr; goto Error;
+    if (shared_opt && NULL == usingCertificate) {
+	opt = shared_opt;
+    } else {
+	krb_err = k5_ok(krb5_get_init_creds_opt_alloc (context, &own_opt));
+	if (krb_err) {
+	    err = paramErr; goto Error;
+	}
+	opt = own_opt;
     }
 
     if (usingCertificate) {
-	krb_err = k5_ok(krb5_get_init_creds_opt_set_pkinit(hCtx->krb5_ctx, opt, clientPrincipal,
+	krb_err = k5_ok(krb5_get_init_creds_opt_set_pkinit(context, opt, clientPrincipal,
 							   NULL, "KEYCHAIN:", 
 							   NULL, NULL, 0,
 							   NULL, NULL, NULL));
@@ -1321,18 +2993,18 @@ OSStatus KRBAcquireTicket(KRBHelperContextRef inKerberosSession, CFDictionaryRef
 	}
     }
 
-    krb_err = krb5_init_creds_init(hCtx->krb5_ctx, clientPrincipal, NULL, NULL,
+    krb_err = krb5_init_creds_init(context, clientPrincipal, NULL, NULL,
 				   0, opt, &icc);
     if (krb_err) {
 	err = paramErr; goto Error;
     }
 
-    if (is_lkdc_realm(krb5_principal_get_realm(hCtx->krb5_ctx, clientPrincipal))) {
-	char *hostname;
+    if (is_lkdc_realm(krb5_principal_get_realm(context, clientPrincipal))) {
+	__KRBStringView hostname;
 
-	__KRBCreateUTF8StringFromCFString (hCtx->inHostName, &hostname);
-	krb5_init_creds_set_kdc_hostname(hCtx->krb5_ctx, icc, hostname);
-	free(hostname);
+	if (__KRBStringViewInit (&hostname, hCtx->inHostName) != NULL)
+	    krb5_init_creds_set_kdc_hostname(context, icc, hostname.str);
+	__KRBStringViewRelease (&hostname);
     }
 
 
@@ -1340,12 +3012,12 @@ OSStatus KRBAcquireTicket(KRBHelperContextRef inKerberosSession, CFDictionaryRef
 	CFStringRef certInferredLabel;
 	hx509_cert cert;
 
-	krb_err = hx509_cert_init_SecFramework(hCtx->hx_ctx, usingCertificate, &cert);
+	krb_err = hx509_cert_init_SecFramework(hxctx, usingCertificate, &cert);
 	if (krb_err) {
 	    err = paramErr; goto Error;
 	}
 
-	krb_err = krb5_init_creds_set_pkinit_client_cert(hCtx->krb5_ctx, icc, cert);
+	krb_err = krb5_init_creds_set_pkinit_client_cert(context, icc, cert);
 	if (krb_err) {
 	    err = paramErr; goto Error;
 	}
@@ -1374,44 +3046,46 @@ OSStatus KRBAcquireTicket(KRBHelperContextRef inKerberosSession, CFDictionaryRef
 
 	__KRBCreateUTF8StringFromCFString (password, &passwordString);
 
-	krb_err = krb5_init_creds_set_password(hCtx->krb5_ctx, icc, passwordString);
+	krb_err = krb5_init_creds_set_password(context, icc, passwordString);
 	if (krb_err) {
 	    err = paramErr; goto Error;
 	}
     }
 
-    krb_err = krb5_init_creds_get(hCtx->krb5_ctx, icc);
-    krb5_get_init_creds_opt_free(hCtx->krb5_ctx, opt);
+    KRBPhaseBegin(&phase, KRB_PHASE_AS_EXCHANGE);
+    krb_err = krb5_init_creds_get(context, icc);
+    KRBPhaseEnd(&phase);
     KHLog ("   %s: krb5_get_init_creds_password: %d", __func__, krb_err);
     if (krb_err != 0) {
 	err = paramErr; goto Error;
     }
 
-    krb_err = krb5_init_creds_get_creds(hCtx->krb5_ctx, icc, &cred);
+    krb_err = krb5_init_creds_get_creds(context, icc, &cred);
     if (krb_err != 0) {
 	err = paramErr; goto Error;
     }
 
-    krb_err = krb5_cc_cache_match(hCtx->krb5_ctx, clientPrincipal, &id);
+    krb_err = krb5_cc_cache_match(context, clientPrincipal, &id);
     if (krb_err) {
-	krb_err = krb5_cc_new_unique(hCtx->krb5_ctx, NULL, NULL, &id);
+	krb_err = krb5_cc_new_unique(context, NULL, NULL, &id);
 	if (krb_err) {
 	    err = paramErr; goto Error;
 	}
 	destroy_cache = 1;
     }
 
-    krb_err = krb5_cc_initialize(hCtx->krb5_ctx, id, clientPrincipal);
+    krb_err = krb5_cc_initialize(context, id, clientPrincipal);
     if (krb_err) {
 	err = paramErr; goto Error;
     }
 
-    krb_err = krb5_cc_store_cred(hCtx->krb5_ctx, id, &cred);
+    krb_err = krb5_cc_store_cred(context, id, &cred);
     if (krb_err) {
 	err = paramErr; goto Error;
     }
+    KRBInvalidateCacheSnapshot();
     
-    krb_err = krb5_init_creds_store_config(hCtx->krb5_ctx, icc, id);
+    krb_err = krb5_init_creds_store_config(context, icc, id);
     if (krb_err) {
 	err = paramErr; goto Error;
     }
@@ -1428,37 +3102,167 @@ OSStatus KRBAcquireTicket(KRBHelperContextRef inKerberosSession, CFDictionaryRef
 	    data.data = label;
 	    data.length = strlen(label) + 1;
 	    
-	    krb5_cc_set_config(hCtx->krb5_ctx, id, NULL, "FriendlyName", &data);
+	    krb5_cc_set_config(context, id, NULL, "FriendlyName", &data);
 	    free(label);
 	}
-    }
-    {
-	krb5_data data;
-	data.data = "1";
-	data.length = 1;
-	krb5_cc_set_config(hCtx->krb5_ctx, id, NULL, "nah-created", &data);
+    }
+    {
+	krb5_data data;
+	data.data = "1";
+	data.length = 1;
+	krb5_cc_set_config(context, id, NULL, "nah-created", &data);
+    }
+
+    err = noErr;
+
+ Error:
+    if (icc)
+	krb5_init_creds_free(context, icc);
+    if (own_opt)
+	krb5_get_init_creds_opt_free(context, own_opt);
+    if (id) {
+	if (err != noErr && destroy_cache)
+	    krb5_cc_close(context, id);
+	else
+	    krb5_cc_close(context, id);
+    }
+    krb5_free_cred_contents(context, &cred);
+    if (NULL != inferredLabel) { CFRelease(inferredLabel); }
+    if (NULL != principalString) { __KRBReleaseUTF8String (principalString); }
+    if (NULL != passwordString) {  __KRBReleaseUTF8String (passwordString); }
+    
+    if (NULL != clientPrincipal) { krb5_free_principal(context, clientPrincipal); }
+    
+    KHLog ("]]] KRBAcquireTicket () = %d", (int)err);
+    
+    return err;
+}
+
+/*
+  KRBAcquireTicket will acquire a ticket for the user.
+  inKerberosSession is the pointer returned by KRBCreateSession.
+  inClientPrincipalInfo is the outClientPrincipalInfo dictionary from KRBCopyClientPrincipalInfo.
+*/
+OSStatus KRBAcquireTicket(KRBHelperContextRef inKerberosSession, CFDictionaryRef inClientPrincipalInfo)
+{
+    KRBhelperContext    *hCtx = (KRBhelperContext *)inKerberosSession;
+
+    if (NULL == hCtx) {
+	KHLog ("%s", "[[[ KRBAcquireTicket () - no context will raise() in the future");
+	return paramErr;
+    }
+
+    return acquire_ticket(hCtx, hCtx->krb5_ctx, hCtx->hx_ctx, NULL, NULL, inClientPrincipalInfo);
+}
+
+/*
+ * Batch acquisition.  The password entries share one set of options,
+ * and the AS exchanges run ACQUIRE_BATCH_WIDTH at a time, each worker
+ * keeping its krb5 context, and with it the realm's KDC lookups, for
+ * all the entries it handles.
+ */
+
+#define ACQUIRE_BATCH_WIDTH	4
+
+OSStatus
+KRBAcquireTickets(KRBHelperContextRef inKerberosSession, CFArrayRef inClientPrincipalInfos, CFArrayRef *outResults)
+{
+    KRBhelperContext    *hCtx = (KRBhelperContext *)inKerberosSession;
+    krb5_get_init_creds_opt *opt = NULL;
+    krb5_principal      first = NULL;
+    OSStatus            err = noErr;
+    OSStatus            *results = NULL;
+    CFMutableArrayRef   outArray = NULL;
+    CFDictionaryRef     info;
+    CFStringRef         principal;
+    __KRBStringView     view;
+    char                *realm = NULL;
+    size_t              width;
+    CFIndex             count, n;
+    __block _Atomic CFIndex next = 0;
+
+    if (NULL == hCtx || NULL == inClientPrincipalInfos || NULL == outResults) { err = paramErr; goto Error; }
+    *outResults = NULL;
+
+    count = CFArrayGetCount (inClientPrincipalInfos);
+    KHLog ("[[[ KRBAcquireTickets () - %d entries", (int)count);
+
+    if ((results = calloc(count ? (size_t)count : 1, sizeof(results[0]))) == NULL) { err = memFullErr; goto Error; }
+
+    /* The realm of the batch is the realm of the first principal */
+    if (count) {
+	info = CFArrayGetValueAtIndex (inClientPrincipalInfos, 0);
+	if (CFGetTypeID (info) != CFDictionaryGetTypeID()) { err = paramErr; goto Error; }
+	principal = CFDictionaryGetValue (info, kKRBClientPrincipalKey);
+	if (NULL == principal || CFGetTypeID (principal) != CFStringGetTypeID()) { err = paramErr; goto Error; }
+
+	if (__KRBStringViewInit (&view, principal) == NULL) {
+	    __KRBStringViewRelease (&view);
+	    err = memFullErr; goto Error;
+	}
+	err = k5_ok(krb5_parse_name (hCtx->krb5_ctx, view.str, &first));
+	__KRBStringViewRelease (&view);
+	if (err) { err = paramErr; goto Error; }
+
+	realm = strdup (krb5_principal_get_realm (hCtx->krb5_ctx, first));
+	if (NULL == realm) { err = memFullErr; goto Error; }
+
+	if (k5_ok(krb5_get_init_creds_opt_alloc (hCtx->krb5_ctx, &opt))) { err = memFullErr; goto Error; }
+    }
+
+    width = count < ACQUIRE_BATCH_WIDTH ? (size_t)count : ACQUIRE_BATCH_WIDTH;
+
+    dispatch_apply(width, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t worker) {
+	krb5_context context = NULL;
+	hx509_context hxctx = NULL;
+	CFIndex i;
+
+	if (KRBContextPoolGetKrb5 (&context) != 0 || KRBContextPoolGetHx509 (&hxctx) != 0) {
+	    while ((i = atomic_fetch_add (&next, 1)) < count)
+		results[i] = memFullErr;
+	    goto out;
+	}
+
+	while ((i = atomic_fetch_add (&next, 1)) < count) {
+	    CFDictionaryRef entry = CFArrayGetValueAtIndex (inClientPrincipalInfos, i);
+
+	    if (CFGetTypeID (entry) != CFDictionaryGetTypeID()) {
+		results[i] = paramErr;
+		continue;
+	    }
+	    results[i] = acquire_ticket (hCtx, context, hxctx, opt, realm, entry);
+	}
+
+    out:
+	if (context)
+	    KRBContextPoolPutKrb5 (context);
+	if (hxctx)
+	    KRBContextPoolPutHx509 (hxctx);
+    });
+
+    outArray = CFArrayCreateMutable (NULL, count, &kCFTypeArrayCallBacks);
+    if (NULL == outArray) { err = memFullErr; goto Error; }
+
+    for (n = 0; n < count; n++) {
+	SInt32 value = results[n];
+	CFNumberRef num = CFNumberCreate (NULL, kCFNumberSInt32Type, &value);
+	if (NULL == num) { err = memFullErr; goto Error; }
+	CFArrayAppendValue (outArray, num);
+	CFRelease (num);
     }
 
-    err = noErr;
+    *outResults = outArray;
+    outArray = NULL;
 
  Error:
-    if (icc)
-	krb5_init_creds_free(hCtx->krb5_ctx, icc);
-    if (id) {
-	if (err != noErr && destroy_cache)
-	    krb5_cc_close(hCtx->krb5_ctx, id);
-	else
-	    krb5_cc_close(hCtx->krb5_ctx, id);
-    }
-    krb5_free_cred_contents(hCtx->krb5_ctx, &cred);
-    if (NULL != inferredLabel) { CFRelease(inferredLabel); }
-    if (NULL != principalString) { __KRBReleaseUTF8String (principalString); }
-    if (NULL != passwordString) {  __KRBReleaseUTF8String (passwordString); }
-    
-    if (NULL != clientPrincipal) { krb5_free_principal(hCtx->krb5_ctx, clientPrincipal); }
-    
-    KHLog ("]]] KRBAcquireTicket () = %d", (int)err);
-    
+    if (NULL != outArray) { CFRelease (outArray); }
+    if (NULL != opt)      { krb5_get_init_creds_opt_free (hCtx->krb5_ctx, opt); }
+    if (NULL != first)    { krb5_free_principal (hCtx->krb5_ctx, first); }
+    if (NULL != realm)    { free (realm); }
+    if (NULL != results)  { free (results); }
+
+    KHLog ("]]] KRBAcquireTickets () = %d", (int)err);
+
     return err;
 }
 
@@ -1471,26 +3275,20 @@ OSStatus KRBCloseSession(KRBHelperContextRef inKerberosSession)
 {
     OSStatus            err = noErr;
     KRBhelperContext    *hCtx = (KRBhelperContext *)inKerberosSession;
-    size_t i;
     
     if (NULL == hCtx) { err = paramErr; goto Error; }
 
     KHLog ("%s", "[[[ KRBCloseSession () - required parameters okay");
 
-    for (i = 0; i < hCtx->realms.len; i++) {
-	free(hCtx->realms.data[i].hostname);
-	free(hCtx->realms.data[i].realm);
-    }
-    free(hCtx->realms.data);
-   
+    arena_free(&hCtx->arena);
+
     if (NULL != hCtx->inAdvertisedPrincipal) { CFRelease (hCtx->inAdvertisedPrincipal); }
     if (NULL != hCtx->hostname)              { CFRelease(hCtx->hostname); }
     if (NULL != hCtx->inHostName)            { CFRelease(hCtx->inHostName); }
     if (NULL != hCtx->realm)                 { CFRelease (hCtx->realm); }
 
-    if (NULL != hCtx->defaultRealm) { free(hCtx->defaultRealm); }
-    if (NULL != hCtx->krb5_ctx)     { krb5_free_context (hCtx->krb5_ctx); }
-    if (NULL != hCtx->hx_ctx)	    { hx509_context_free(&hCtx->hx_ctx); }
+    if (NULL != hCtx->krb5_ctx)     { KRBContextPoolPutKrb5 (hCtx->krb5_ctx); }
+    if (NULL != hCtx->hx_ctx)	    { KRBContextPoolPutHx509 (hCtx->hx_ctx); }
     if (NULL != hCtx->addr)         { freeaddrinfo(hCtx->addr); }
     
     free(hCtx);
@@ -1505,13 +3303,15 @@ findCred(CFStringRef clientPrincipal, krb5_context context, krb5_ccache *id)
 {
     krb5_principal client;
     krb5_error_code kret;
-    char *str;
+    __KRBStringView view;
 
-    if (__KRBCreateUTF8StringFromCFString (clientPrincipal, &str) != noErr)
+    if (__KRBStringViewInit (&view, clientPrincipal) == NULL) {
+	__KRBStringViewRelease (&view);
 	return memFullErr;
+    }
 
-    kret = k5_ok(krb5_parse_name(context, str, &client));
-    free(str);
+    kret = k5_ok(krb5_parse_name(context, view.str, &client));
+    __KRBStringViewRelease (&view);
     if (0 != kret)
 	return memFullErr;
 
@@ -1523,6 +3323,321 @@ findCred(CFStringRef clientPrincipal, krb5_context context, krb5_ccache *id)
     return noErr;
 }
 
+/*
+ * Background renewal of held nah-created credentials.  When the
+ * RenewCredentials preference in com.apple.KerberosHelper is set,
+ * every credential with references taken through this process is
+ * tracked, and its TGT is renewed RENEW_MARGIN seconds before it
+ * expires so reconnecting doesn't have to pay for a new AS exchange.
+ *
+ * The entries live on a timer wheel of RENEW_WHEEL_SLOTS slots, each
+ * RENEW_TICK seconds wide.  Entries due after the wheel's horizon are
+ * put back when their slot comes around.  Credentials that are not
+ * renewable can't be re-acquired without the secret, so they are
+ * dropped from the wheel.
+ *
+ * The preference is read again when RENEW_PREFS_NOTIFICATION is
+ * posted, and after RENEW_PREFS_TTL seconds in case nobody posted it.
+ * While it is off no new credentials are tracked and nothing is
+ * renewed, tracked entries are kept so renewal resumes when it is
+ * turned back on.
+ */
+
+#define RENEW_PREFS_NOTIFICATION "com.apple.KerberosHelper.preferences"
+#define RENEW_PREFS_TTL		60
+
+#define RENEW_WHEEL_SLOTS	64
+#define RENEW_TICK		60
+#define RENEW_MARGIN		(15 * 60)
+
+struct renew_entry {
+    struct renew_entry *next;
+    CFStringRef clientPrincipal;
+    time_t when;
+    int refs;			/* 0 once untracked, freed when it fires */
+};
+
+static struct {
+    dispatch_queue_t q;
+    dispatch_source_t timer;
+    struct renew_entry *slots[RENEW_WHEEL_SLOTS];
+    size_t cursor;
+    time_t cursor_time;		/* start of the slot at cursor */
+    CFMutableDictionaryRef entries; /* clientPrincipal -> renew_entry */
+} renewal;
+
+static struct {
+    dispatch_queue_t q;
+    int notify_token;
+    int loaded;
+    time_t expire;
+    bool enabled;
+} renewprefs;
+
+static bool
+renewal_enabled(void)
+{
+    static dispatch_once_t once;
+    __block bool enabled = false;
+
+    dispatch_once(&once, ^{
+	renewprefs.q = dispatch_queue_create("com.apple.KerberosHelper.renewal-prefs", NULL);
+	if (renewprefs.q)
+	    (void)notify_register_dispatch(RENEW_PREFS_NOTIFICATION, &renewprefs.notify_token, renewprefs.q, ^(int token) {
+		    renewprefs.loaded = 0;
+		});
+    });
+    if (renewprefs.q == NULL)
+	return false;
+
+    dispatch_sync(renewprefs.q, ^{
+	time_t now = time(NULL);
+
+	if (!renewprefs.loaded || now >= renewprefs.expire) {
+	    CFPreferencesAppSynchronize(CFSTR("com.apple.KerberosHelper"));
+	    renewprefs.enabled = CFPreferencesGetAppBooleanValue(CFSTR("RenewCredentials"), CFSTR("com.apple.KerberosHelper"), NULL);
+	    renewprefs.loaded = 1;
+	    renewprefs.expire = now + RENEW_PREFS_TTL;
+	}
+	enabled = renewprefs.enabled;
+    });
+    return enabled;
+}
+
+static void renewal_tick(void);
+
+/* must be called on renewal.q */
+static void
+renewal_schedule(struct renew_entry *e, time_t when)
+{
+    time_t delta;
+    size_t slot;
+
+    e->when = when;
+    delta = when - renewal.cursor_time;
+    if (delta < RENEW_TICK)
+	delta = RENEW_TICK;
+    if (delta >= RENEW_WHEEL_SLOTS * RENEW_TICK)
+	delta = (RENEW_WHEEL_SLOTS - 1) * RENEW_TICK;
+    slot = (renewal.cursor + delta / RENEW_TICK) % RENEW_WHEEL_SLOTS;
+
+    e->next = renewal.slots[slot];
+    renewal.slots[slot] = e;
+
+    if (renewal.timer == NULL) {
+	renewal.timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, renewal.q);
+	if (renewal.timer == NULL)
+	    return;
+	dispatch_source_set_event_handler(renewal.timer, ^{ renewal_tick(); });
+	dispatch_source_set_timer(renewal.timer,
+				  dispatch_time(DISPATCH_TIME_NOW, RENEW_TICK * NSEC_PER_SEC),
+				  RENEW_TICK * NSEC_PER_SEC, 5 * NSEC_PER_SEC);
+	dispatch_resume(renewal.timer);
+    }
+}
+
+static void
+renewal_free(struct renew_entry *e)
+{
+    CFRelease(e->clientPrincipal);
+    free(e);
+}
+
+/*
+ * Renew the TGT in the cache of the entry if it is close to expiry,
+ * returns when to look again or 0 if the entry should be dropped.
+ */
+
+static time_t
+renewal_check(krb5_context context, CFStringRef clientPrincipal, time_t now)
+{
+    krb5_creds mcreds, creds, ncreds;
+    krb5_principal client = NULL;
+    krb5_ccache id = NULL;
+    krb5_error_code kret;
+    krb5_data data;
+    time_t next = 0;
+
+    memset(&mcreds, 0, sizeof(mcreds));
+    memset(&creds, 0, sizeof(creds));
+    memset(&ncreds, 0, sizeof(ncreds));
+
+    if (findCred(clientPrincipal, context, &id) != noErr)
+	goto out;
+
+    /* only nah-created caches, not the users SSO credentials */
+    if (krb5_cc_get_config(context, id, NULL, "nah-created", &data))
+	goto out;
+    krb5_data_free(&data);
+
+    if (krb5_cc_get_principal(context, id, &client))
+	goto out;
+
+    mcreds.client = client;
+    kret = krb5_make_principal(context, &mcreds.server,
+			       krb5_principal_get_realm(context, client),
+			       KRB5_TGS_NAME, krb5_principal_get_realm(context, client), NULL);
+    if (kret)
+	goto out;
+
+    kret = krb5_cc_retrieve_cred(context, id, 0, &mcreds, &creds);
+    if (kret)
+	goto out;
+
+    if (creds.times.endtime - now > RENEW_MARGIN) {
+	next = creds.times.endtime - RENEW_MARGIN;
+	goto out;
+    }
+
+    if (!creds.flags.b.renewable || creds.times.renew_till <= now) {
+	KHLog ("    %s: credential not renewable, dropping", __func__);
+	goto out;
+    }
+
+    kret = k5_ok(krb5_get_renewed_creds(context, &ncreds, client, id, NULL));
+    if (kret) {
+	/* try again next tick, unless it expired already */
+	if (creds.times.endtime > now)
+	    next = now + RENEW_TICK;
+	goto out;
+    }
+
+    kret = k5_ok(krb5_cc_store_cred(context, id, &ncreds));
+    if (kret == 0) {
+	KRBInvalidateCacheSnapshot();
+	KHLog ("    %s: renewed credential", __func__);
+	next = ncreds.times.endtime - RENEW_MARGIN;
+	if (next <= now)
+	    next = now + RENEW_TICK;
+    }
+
+ out:
+    krb5_free_cred_contents(context, &ncreds);
+    krb5_free_cred_contents(context, &creds);
+    if (mcreds.server)
+	krb5_free_principal(context, mcreds.server);
+    if (client)
+	krb5_free_principal(context, client);
+    if (id)
+	krb5_cc_close(context, id);
+
+    return next;
+}
+
+static void
+renewal_tick(void)
+{
+    struct renew_entry *e, *list;
+    krb5_context context = NULL;
+    time_t now = time(NULL);
+    bool enabled = renewal_enabled();
+
+    while (renewal.cursor_time + RENEW_TICK <= now) {
+	renewal.cursor = (renewal.cursor + 1) % RENEW_WHEEL_SLOTS;
+	renewal.cursor_time += RENEW_TICK;
+
+	list = renewal.slots[renewal.cursor];
+	renewal.slots[renewal.cursor] = NULL;
+
+	while ((e = list) != NULL) {
+	    list = e->next;
+
+	    if (e->refs == 0) {
+		renewal_free(e);
+		continue;
+	    }
+	    /* further out than the wheel reaches, go around again */
+	    if (e->when > renewal.cursor_time + RENEW_TICK) {
+		renewal_schedule(e, e->when);
+		continue;
+	    }
+	    /* turned off, look again next tick */
+	    if (!enabled) {
+		renewal_schedule(e, now + RENEW_TICK);
+		continue;
+	    }
+	    if (context == NULL && k5_ok(KRBContextPoolGetKrb5(&context)) != 0) {
+		renewal_schedule(e, now + RENEW_TICK);
+		continue;
+	    }
+
+	    time_t next = renewal_check(context, e->clientPrincipal, now);
+	    if (next == 0) {
+		CFDictionaryRemoveValue(renewal.entries, e->clientPrincipal);
+		renewal_free(e);
+		continue;
+	    }
+	    renewal_schedule(e, next);
+	}
+    }
+
+    if (context)
+	KRBContextPoolPutKrb5(context);
+
+    if (CFDictionaryGetCount(renewal.entries) == 0 && renewal.timer) {
+	size_t i;
+
+	for (i = 0; i < RENEW_WHEEL_SLOTS; i++) {
+	    while ((e = renewal.slots[i]) != NULL) {
+		renewal.slots[i] = e->next;
+		renewal_free(e);
+	    }
+	}
+	dispatch_source_cancel(renewal.timer);
+	dispatch_release(renewal.timer);
+	renewal.timer = NULL;
+    }
+}
+
+void
+KRBRenewalTrack(CFStringRef clientPrincipal, int change)
+{
+    static dispatch_once_t once;
+
+    /* references are always dropped so the counts stay right */
+    if (clientPrincipal == NULL || change == 0 || (change > 0 && !renewal_enabled()))
+	return;
+
+    dispatch_once(&once, ^{
+	renewal.q = dispatch_queue_create("com.apple.KerberosHelper.renewal", NULL);
+	renewal.entries = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+    });
+    if (renewal.q == NULL || renewal.entries == NULL)
+	return;
+
+    clientPrincipal = CFStringCreateCopy(NULL, clientPrincipal);
+    if (clientPrincipal == NULL)
+	return;
+
+    dispatch_async(renewal.q, ^{
+	struct renew_entry *e;
+
+	e = (struct renew_entry *)CFDictionaryGetValue(renewal.entries, clientPrincipal);
+	if (e == NULL && change > 0) {
+	    e = calloc(1, sizeof(*e));
+	    if (e == NULL)
+		goto out;
+	    e->clientPrincipal = CFRetain(clientPrincipal);
+	    CFDictionarySetValue(renewal.entries, e->clientPrincipal, e);
+	    if (renewal.timer == NULL)
+		renewal.cursor_time = time(NULL);
+	    /* look at it on the next tick, that finds the expiry time */
+	    renewal_schedule(e, renewal.cursor_time + RENEW_TICK);
+	}
+	if (e == NULL)
+	    goto out;
+
+	e->refs += change;
+	if (e->refs <= 0) {
+	    /* freed when its slot comes around */
+	    e->refs = 0;
+	    CFDictionaryRemoveValue(renewal.entries, clientPrincipal);
+	}
+    out:
+	CFRelease(clientPrincipal);
+    });
+}
+
 OSStatus
 KRBCredChangeReferenceCount(CFStringRef clientPrincipal, int change, int excl)
 {
@@ -1534,7 +3649,7 @@ KRBCredChangeReferenceCount(CFStringRef clientPrincipal, int change, int excl)
 
     KHLog ("[[[ KRBCredChangeReferenceCount: %d", change);
 
-    kret = k5_ok(krb5_init_context(&kcontext));
+    kret = k5_ok(KRBContextPoolGetKrb5(&kcontext));
     if (0 != kret) {
 	ret = memFullErr;
 	goto out;
@@ -1556,6 +3671,8 @@ KRBCredChangeReferenceCount(CFStringRef clientPrincipal, int change, int excl)
 	ret = krb5_cc_hold(kcontext, id);
     else
 	ret = krb5_cc_unhold(kcontext, id);
+    if (ret == 0)
+	KRBRenewalTrack(clientPrincipal, change > 0 ? 1 : -1);
 
  out:
     if (id)
@@ -1564,11 +3681,147 @@ KRBCredChangeReferenceCount(CFStringRef clientPrincipal, int change, int excl)
     KHLog ("]]] KRBCredChangeReferenceCount: %d", (int)ret);
 
     if (kcontext)
-	krb5_free_context(kcontext);
+	KRBContextPoolPutKrb5(kcontext);
+
+    return ret;
+}
+
+/*
+ * Credential handles resolve the cache for a principal once, so
+ * repeated reference count changes skip the collection scan and the
+ * nah-created check.  If the cache went away underneath the handle
+ * it is looked up again once.
+ */
+
+struct KRBCredHandle {
+    dispatch_queue_t q;
+    CFStringRef clientPrincipal;
+    krb5_context context;
+    krb5_ccache id;
+    int refcounted;		/* nah-created, not a SSO cache */
+};
+
+static OSStatus
+cred_handle_resolve(KRBCredHandleRef handle)
+{
+    krb5_data data;
+    OSStatus ret;
+
+    if (handle->id) {
+	krb5_cc_close(handle->context, handle->id);
+	handle->id = NULL;
+    }
+    handle->refcounted = 0;
+
+    ret = findCred(handle->clientPrincipal, handle->context, &handle->id);
+    if (ret != noErr)
+	return ret;
+
+    /* Skip SSO cred-caches */
+    if (k5_ok(krb5_cc_get_config(handle->context, handle->id, NULL, "nah-created", &data)) == 0) {
+	krb5_data_free(&data);
+	handle->refcounted = 1;
+    }
+
+    return noErr;
+}
+
+OSStatus
+KRBCredCreateHandle(CFStringRef clientPrincipal, KRBCredHandleRef *outHandle)
+{
+    KRBCredHandleRef handle;
+    OSStatus ret;
+
+    if (NULL == clientPrincipal || NULL == outHandle)
+	return paramErr;
+
+    *outHandle = NULL;
+
+    if ((handle = calloc(1, sizeof(*handle))) == NULL)
+	return memFullErr;
+
+    if (k5_ok(KRBContextPoolGetKrb5(&handle->context)) != 0) {
+	free(handle);
+	return memFullErr;
+    }
+    handle->clientPrincipal = CFRetain(clientPrincipal);
+
+    ret = cred_handle_resolve(handle);
+    if (ret != noErr) {
+	KRBCredReleaseHandle(handle);
+	return ret;
+    }
+    handle->q = dispatch_queue_create("com.apple.KerberosHelper.credhandle", NULL);
+
+    *outHandle = handle;
+    return noErr;
+}
+
+static OSStatus
+cred_handle_change(KRBCredHandleRef handle, int change)
+{
+    __block OSStatus ret = noErr;
+
+    if (NULL == handle)
+	return paramErr;
+
+    dispatch_sync(handle->q, ^{
+	int retry;
+
+	for (retry = 0; retry < 2; retry++) {
+	    if (retry && cred_handle_resolve(handle) != noErr) {
+		ret = memFullErr;
+		break;
+	    }
+	    if (!handle->refcounted) {
+		ret = noErr;
+		break;
+	    }
+	    if (change > 0)
+		ret = krb5_cc_hold(handle->context, handle->id);
+	    else
+		ret = krb5_cc_unhold(handle->context, handle->id);
+	    if (ret == 0) {
+		KRBRenewalTrack(handle->clientPrincipal, change);
+		break;
+	    }
+	}
+    });
+
+    KHLog ("    %s: %d = %d", __func__, change, (int)ret);
 
     return ret;
 }
 
+OSStatus
+KRBCredHandleAddReference(KRBCredHandleRef handle)
+{
+    return cred_handle_change(handle, 1);
+}
+
+OSStatus
+KRBCredHandleRemoveReference(KRBCredHandleRef handle)
+{
+    return cred_handle_change(handle, -1);
+}
+
+void
+KRBCredReleaseHandle(KRBCredHandleRef handle)
+{
+    if (NULL == handle)
+	return;
+
+    if (handle->id)
+	krb5_cc_close(handle->context, handle->id);
+    if (handle->context)
+	KRBContextPoolPutKrb5(handle->context);
+    if (handle->clientPrincipal)
+	CFRelease(handle->clientPrincipal);
+    if (handle->q)
+	dispatch_release(handle->q);
+    free(handle);
+}
+
 OSStatus KRBCredAddReference(CFStringRef clientPrincipal)
 {
     return KRBCredChangeReferenceCount(clientPrincipal, 1, 0);
@@ -1598,7 +3851,7 @@ OSStatus KRBCredAddReferenceAndLabel(CFStringRef clientPrincipal,
 
     KHLog ("%s", "[[[ KRBCredAddReferenceAndLabel");
 
-    kret = k5_ok(krb5_init_context(&kcontext));
+    kret = k5_ok(KRBContextPoolGetKrb5(&kcontext));
     if (0 != kret) {
 	ret = memFullErr;
 	goto out;
@@ -1628,13 +3881,22 @@ OSStatus KRBCredAddReferenceAndLabel(CFStringRef clientPrincipal,
     ret = krb5_cc_hold(kcontext, id);
     if (ret)
 	goto out;
+    KRBRenewalTrack(clientPrincipal, 1);
+
+    {
+	CFStringRef ref = CFStringCreateWithFormat(NULL, NULL, CFSTR("krb5:%@"), clientPrincipal);
+	if (ref) {
+	    NAHLabelIndexAdd(identifier, ref);
+	    CFRelease(ref);
+	}
+    }
 
  out:
     KHLog ("]]] KRBCredAddReferenceAndLabel () = %d (label %s)", (int)ret, label);
     if (id)
 	krb5_cc_close(kcontext, id);
     if (kcontext)
-	krb5_free_context(kcontext);
+	KRBContextPoolPutKrb5(kcontext);
     if (label)
 	free(label);
 
@@ -1648,6 +3910,116 @@ KRBCredFindByLabelAndRelease(CFStringRef identifier)
     return noErr;
 }
 
+/*
+ * Mechanisms we know about, so decoding a NegTokenInit doesn't have
+ * to format every OID as a string.
+ */
+
+#define OID_ENTRY(c, s) { { sizeof(c)/sizeof(c[0]), (unsigned *)c }, s }
+
+static const unsigned oid_krb5[] = { 1, 2, 840, 113554, 1, 2, 2 };
+static const unsigned oid_krb5_u2u[] = { 1, 2, 840, 113554, 1, 2, 2, 3 };
+static const unsigned oid_krb5_ms[] = { 1, 2, 840, 48018, 1, 2, 2 };
+static const unsigned oid_ntlm[] = { 1, 3, 6, 1, 4, 1, 311, 2, 2, 10 };
+static const unsigned oid_iakerb[] = { 1, 3, 6, 1, 5, 2, 5 };
+static const unsigned oid_pku2u[] = { 1, 3, 6, 1, 5, 2, 7 };
+static const unsigned oid_applelkdc[] = { 1, 2, 752, 43, 14, 3 };
+
+static const struct {
+    heim_oid oid;
+    CFStringRef name;
+} known_mechs[] = {
+    OID_ENTRY(oid_krb5, kGSSAPIMechKerberosOID),
+    OID_ENTRY(oid_krb5_ms, kGSSAPIMechKerberosMicrosoftOID),
+    OID_ENTRY(oid_ntlm, kGSSAPIMechNTLMOID),
+    OID_ENTRY(oid_iakerb, kGSSAPIMechIAKERB),
+    OID_ENTRY(oid_pku2u, kGSSAPIMechPKU2UOID),
+    OID_ENTRY(oid_applelkdc, kGSSAPIMechSupportsAppleLKDC),
+    OID_ENTRY(oid_krb5_u2u, kGSSAPIMechKerberosU2UOID)
+};
+
+static CFStringRef
+copy_mech_name(CFAllocatorRef alloc, const heim_oid *oid)
+{
+    CFStringRef s;
+    size_t i;
+    char *str;
+
+    for (i = 0; i < sizeof(known_mechs)/sizeof(known_mechs[0]); i++) {
+	if (known_mechs[i].oid.length == oid->length &&
+	    memcmp(known_mechs[i].oid.components, oid->components,
+		   oid->length * sizeof(oid->components[0])) == 0)
+	    return CFRetain(known_mechs[i].name);
+    }
+
+    if (der_print_heim_oid(oid, '.', &str))
+	return NULL;
+    s = CFStringCreateWithCString(alloc, str, kCFStringEncodingUTF8);
+    free(str);
+    return s;
+}
+
+/*
+ * Servers send the same NegTokenInit on every connection, so keep
+ * the last few decoded tokens around, keyed on a SHA-256 of the token.
+ */
+
+#define NEGTOKEN_CACHE_SIZE 16
+
+struct negtoken_entry {
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CFDictionaryRef dict;
+};
+
+static struct {
+    dispatch_queue_t q;
+    struct negtoken_entry entries[NEGTOKEN_CACHE_SIZE];
+    size_t next;
+} negtoken_cache;
+
+static dispatch_queue_t
+negtoken_cache_queue(void)
+{
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+	negtoken_cache.q = dispatch_queue_create("com.apple.KerberosHelper.negtoken", NULL);
+    });
+    return negtoken_cache.q;
+}
+
+static CFDictionaryRef decode_negtokeninit(CFAllocatorRef alloc, CFDataRef data);
+
+/*
+ * Cached dictionaries are handed to every caller, so they must not be
+ * mutable, neither the outer dictionary nor the mechs dictionary.
+ */
+
+static CFDictionaryRef
+copy_immutable_negtoken(CFDictionaryRef dict)
+{
+    CFMutableDictionaryRef outer;
+    CFDictionaryRef mechs, copy;
+
+    outer = CFDictionaryCreateMutableCopy(NULL, 0, dict);
+    if (outer == NULL)
+	return NULL;
+
+    mechs = CFDictionaryGetValue(dict, kSPNEGONegTokenInitMechs);
+    if (mechs) {
+	mechs = CFDictionaryCreateCopy(NULL, mechs);
+	if (mechs == NULL) {
+	    CFRelease(outer);
+	    return NULL;
+	}
+	CFDictionarySetValue(outer, kSPNEGONegTokenInitMechs, mechs);
+	CFRelease(mechs);
+    }
+
+    copy = CFDictionaryCreateCopy(NULL, outer);
+    CFRelease(outer);
+    return copy;
+}
+
 /*
  * Parses the initial request from a SMB server and constructs a
  * resulting CFDictionaryRef.
@@ -1657,6 +4029,55 @@ KRBCredFindByLabelAndRelease(CFStringRef identifier)
 
 CFDictionaryRef
 KRBDecodeNegTokenInit(CFAllocatorRef alloc, CFDataRef data)
+{
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    __block CFDictionaryRef dict = NULL;
+    CFDictionaryRef decoded;
+
+    /* Only cache dictionaries built with the default allocator */
+    if (alloc != NULL && alloc != kCFAllocatorDefault)
+	return decode_negtokeninit(alloc, data);
+
+    CC_SHA256(CFDataGetBytePtr(data), (CC_LONG)CFDataGetLength(data), digest);
+
+    dispatch_sync(negtoken_cache_queue(), ^{
+	size_t i;
+	for (i = 0; i < NEGTOKEN_CACHE_SIZE; i++) {
+	    struct negtoken_entry *e = &negtoken_cache.entries[i];
+	    if (e->dict && memcmp(e->digest, digest, sizeof(digest)) == 0) {
+		dict = CFRetain(e->dict);
+		break;
+	    }
+	}
+    });
+    KRBStatsCacheRecord(KRB_CACHE_NEGTOKEN, dict != NULL);
+    if (dict)
+	return dict;
+
+    decoded = decode_negtokeninit(alloc, data);
+    if (decoded == NULL)
+	return NULL;
+
+    dict = copy_immutable_negtoken(decoded);
+    CFRelease(decoded);
+    if (dict == NULL)
+	return NULL;
+
+    dispatch_sync(negtoken_cache_queue(), ^{
+	struct negtoken_entry *e = &negtoken_cache.entries[negtoken_cache.next];
+
+	negtoken_cache.next = (negtoken_cache.next + 1) % NEGTOKEN_CACHE_SIZE;
+	if (e->dict)
+	    CFRelease(e->dict);
+	memcpy(e->digest, digest, sizeof(digest));
+	e->dict = CFRetain(dict);
+    });
+
+    return dict;
+}
+
+static CFDictionaryRef
+decode_negtokeninit(CFAllocatorRef alloc, CFDataRef data)
 {
     CFMutableDictionaryRef dict = NULL, mechs = NULL;
     union {
@@ -1723,13 +4144,7 @@ KRBDecodeNegTokenInit(CFAllocatorRef alloc, CFDataRef data)
 	    goto out;
 
 	for (n = 0; n < mechtypes->len; n++) {
-	    char *str;
-	    ret = der_print_heim_oid(&mechtypes->val[n], '.', &str);
-	    if (ret)
-		continue;
-
-	    CFStringRef s = CFStringCreateWithCString(alloc, str, kCFStringEncodingUTF8);
-	    free(str);
+	    CFStringRef s = copy_mech_name(alloc, &mechtypes->val[n]);
 	    if (s) {
 		CFDictionaryAddValue(mechs, s, empty);
 		CFRelease(s);
@@ -30,6 +30,7 @@
 
 #include <CoreFoundation/CoreFoundation.h>
 #include <Security/Security.h>
+#include <dispatch/dispatch.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -60,6 +61,9 @@ OSStatus KRBCreateSession (CFStringRef inHostName, CFStringRef inAdvertisedPrinc
 					is a service principal guess (can be NULL), perhaps provided by the service. This is not secure 
 					and is given the least priorty when other information is available
 			kKRBNoLKDCKey	Don't try Local KDC if it will mean time penalties
+			kKRBReverseLookupTimeoutKey
+					CFNumber, the number of seconds to wait for the reverse lookups
+					of the addresses of the host, default is 10 seconds
 
 		outKerberosSession is a pointer that should be passed to the other KRB functions.
 */
@@ -67,9 +71,37 @@ OSStatus KRBCreateSession (CFStringRef inHostName, CFStringRef inAdvertisedPrinc
 
 OSStatus KRBCreateSessionInfo (CFDictionaryRef inDict, KRBHelperContextRef *outKerberosSession);
 
+/*
+	KRBCreateSessionInfoAsync is the asynchronous version of KRBCreateSessionInfo, the lookups are done
+	on a background queue and complete is called on queue with the result.
+		inDict is the same dictionary as for KRBCreateSessionInfo.
+		complete is always called once, with userCanceledErr if the request was cancelled.
+			The session must be released with KRBCloseSession.
+
+	The returned request must be released with KRBReleaseSessionRequest, and can be passed to
+	KRBCancelSessionRequest until then. Lookups that are already in progress run to completion
+	but their result is dropped.
+*/
+
+typedef struct KRBSessionRequest *KRBSessionRequestRef;
+
+KRBSessionRequestRef KRBCreateSessionInfoAsync (CFDictionaryRef inDict, dispatch_queue_t queue,
+						void (^complete)(OSStatus err, KRBHelperContextRef session));
+
+void KRBCancelSessionRequest (KRBSessionRequestRef inRequest);
+void KRBReleaseSessionRequest (KRBSessionRequestRef inRequest);
+
 #define	kKRBHostnameKey					CFSTR("Hostname")
 #define	kKRBAdvertisedPrincipalKey			CFSTR("AdvertisedPrincipal")
 #define	kKRBNoLKDCKey					CFSTR("NoLKDC")
+#define	kKRBReverseLookupTimeoutKey			CFSTR("ReverseLookupTimeout")
+
+/*
+	KRBFlushHostRealmCache will drop the cached host to realm mappings that KRBCreateSessionInfo
+	keeps for recently used hosts.
+		inHostName is the host name to forget about, if NULL all cached entries are dropped.
+*/
+void KRBFlushHostRealmCache (CFStringRef inHostName);
 
 /*
 	KRBCopyREALM will return the best-guess REALM for the host that was passed to KRBCreateSession
@@ -184,6 +216,32 @@ OSStatus KRBTestForExistingTicket (KRBHelperContextRef inKerberosSession, CFDict
 */
 OSStatus KRBAcquireTicket(KRBHelperContextRef inKerberosSession, CFDictionaryRef inClientPrincipalInfo);
 
+/*
+	KRBAcquireTickets will acquire tickets for several principals in the same realm,
+	sharing the option setup and running the AS exchanges concurrently.
+		inKerberosSession is the pointer returned by KRBCreateSession.
+		inClientPrincipalInfos is an array of dictionaries, each like the
+		inClientPrincipalInfo of KRBAcquireTicket.  All principals must be in
+		the realm of the first one.
+		outResults is an array with a CFNumber OSStatus for each entry.
+*/
+OSStatus KRBAcquireTickets(KRBHelperContextRef inKerberosSession, CFArrayRef inClientPrincipalInfos, CFArrayRef *outResults);
+
+
+/*
+	KRBCopyStatistics returns a dictionary with the statistics of this process:
+		kKRBStatisticsPhases, one dictionary per lookup phase with the Count,
+		TotalMicroseconds and a Histogram of log2 microsecond buckets.
+		kKRBStatisticsCaches, one dictionary per cache with Hits, Misses and HitRatio.
+		kKRBStatisticsLKDCPlugin, the LKDC locate plugin counters, only present
+		when Heimdal has loaded the plugin in this process.
+	Posting the com.apple.KerberosHelper.statistics notification logs a summary.
+*/
+#define kKRBStatisticsPhases                CFSTR("Phases")
+#define kKRBStatisticsCaches                CFSTR("Caches")
+#define kKRBStatisticsLKDCPlugin            CFSTR("LKDCPlugin")
+
+CFDictionaryRef KRBCopyStatistics (void);
 
 /*
 	KRBCloseSession will release the kerberos session
@@ -233,6 +291,21 @@ OSStatus KRBCredFindByLabelAndRelease(CFStringRef identifier);
 OSStatus KRBCredAddReference(CFStringRef clientPrincipal);
 OSStatus KRBCredRemoveReference(CFStringRef clientPrincipal);
 
+/*
+ * Handle based version of KRBCredAddReference/KRBCredRemoveReference
+ * for callers that change the reference count of the same credential
+ * many times.  The credential cache for clientPrincipal is looked up
+ * once when the handle is created.  As with the functions above,
+ * changes on SSO credentials are ignored.
+ */
+
+typedef struct KRBCredHandle *KRBCredHandleRef;
+
+OSStatus KRBCredCreateHandle(CFStringRef clientPrincipal, KRBCredHandleRef *outHandle);
+OSStatus KRBCredHandleAddReference(KRBCredHandleRef handle);
+OSStatus KRBCredHandleRemoveReference(KRBCredHandleRef handle);
+void KRBCredReleaseHandle(KRBCredHandleRef handle);
+
 
 #define kSPNEGONegTokenInitMechs		CFSTR("SPNEGONegTokenInitMechs")
 #define kSPNEGONegTokenInitHintsHostname	CFSTR("SPNEGONegTokenInitHintsHostname")
@@ -249,6 +322,12 @@ OSStatus KRBCredRemoveReference(CFStringRef clientPrincipal);
 #define kGSSAPIMechIAKERB			CFSTR("1.3.6.1.5.2.5")
 #define kGSSAPIMechPKU2UOID			CFSTR("1.3.6.1.5.2.7")
 
+/*
+ * Decodes a SPNEGO NegTokenInit.  Recently decoded tokens are cached,
+ * so the returned dictionary may be shared with other callers and
+ * must not be modified.
+ */
+
 CFDictionaryRef
 KRBDecodeNegTokenInit(CFAllocatorRef, CFDataRef)
     CF_RETURNS_RETAINED;
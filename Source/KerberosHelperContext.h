@@ -28,13 +28,42 @@
 
 #include <Heimdal/krb5.h>
 #include <Heimdal/hx509.h>
+#include <Security/Security.h>
+#include <stdatomic.h>
+
+/* where a realm mapping came from, used when scoring the candidates */
+enum realm_source {
+	REALM_SOURCE_KDC_REFERRAL = 0,
+	REALM_SOURCE_FORWARD_DNS,
+	REALM_SOURCE_REVERSE_DNS,
+	REALM_SOURCE_LOCAL_NAME,
+	REALM_SOURCE_MAX
+};
 
 struct realm_mappings {
 	int lkdc;
+	int source;
+	unsigned long realmhash; /* hash of the lowercased realm */
 	char *hostname;
 	char *realm;
 };
 
+/*
+ * Bump allocator for the strings and arrays that live as long as the
+ * session.  The first block is part of the context itself, nothing in
+ * it is freed until the whole arena is released with the context.
+ */
+
+#define KRB_ARENA_INITIAL	1024
+
+struct krb_arena_chunk;
+
+struct krb_arena {
+	struct krb_arena_chunk *chunks; /* overflow blocks */
+	char *ptr;
+	size_t avail;
+	char initial[KRB_ARENA_INITIAL] __attribute__((aligned(16)));
+};
 
 typedef struct KRBhelperContext {
 	CFStringRef     inHostName; /* User input string, still printable */
@@ -44,15 +73,142 @@ typedef struct KRBhelperContext {
         struct {
 	    struct realm_mappings *data;
 	    size_t len;
+	    size_t alloc;
 	} realms;
 	CFStringRef	inAdvertisedPrincipal;
 	char            *useName, *useInstance, *useRealm, *defaultRealm;
 	krb5_context	krb5_ctx;
 	hx509_context	hx_ctx;
+	const volatile int *cancel; /* set while KRBCreateSessionInfoAsync is running */
 	unsigned	noGuessing:1;
+	struct krb_arena arena; /* realms, defaultRealm */
 } KRBhelperContext;
 
 OSStatus
 KRBCredChangeReferenceCount(CFStringRef clientPrincipal, int change, int excl);
 
+/*
+ * Tell the renewal scheduler a reference to the credential for
+ * clientPrincipal was taken (change > 0) or dropped (change < 0).
+ * New references are ignored unless the RenewCredentials preference is set.
+ */
+void
+KRBRenewalTrack(CFStringRef clientPrincipal, int change);
+
+/*
+ * Process wide pool of initialised contexts, use these instead of
+ * krb5_init_context()/hx509_context_init() and give the context back
+ * with the matching Put function instead of freeing it.
+ */
+krb5_error_code
+KRBContextPoolGetKrb5(krb5_context *context);
+
+void
+KRBContextPoolPutKrb5(krb5_context context);
+
+int
+KRBContextPoolGetHx509(hx509_context *context);
+
+void
+KRBContextPoolPutHx509(hx509_context context);
+
+/*
+ * Non-LKDC realms the KRBCreateSessionInfo host cache has for
+ * hostname, returns 1 on a hit, free *realms with krb5_free_host_realm().
+ */
+int
+KRBHostCacheCopyRealms(const char *hostname, char ***realms);
+
+/*
+ * Snapshot of the credential cache collection, see
+ * KRBCopyCacheSnapshot().  Entries are plain strings so a snapshot can
+ * be shared between callers using different krb5 contexts.
+ */
+struct ccache_snapshot_entry {
+	char *name;		/* full cache name, for krb5_cc_resolve() */
+	char *client;		/* unparsed client principal */
+	char *realm;		/* client realm */
+	time_t expire;		/* 0 if expired or unknown */
+	int lkdc;
+	char *lkdc_hostname;	/* lkdc-hostname config, LKDC caches only */
+	char *friendly_name;	/* FriendlyName config */
+};
+
+typedef struct KRBCacheSnapshot {
+	_Atomic int refs;
+	size_t len;
+	struct ccache_snapshot_entry *val;
+} *KRBCacheSnapshotRef;
+
+KRBCacheSnapshotRef
+KRBCopyCacheSnapshot(krb5_context context);
+
+void
+KRBReleaseCacheSnapshot(KRBCacheSnapshotRef snap);
+
+void
+KRBInvalidateCacheSnapshot(void);
+
+/*
+ * Record that the credential for referenceKey got the reference
+ * label for identifier, see NAHFindByLabelAndRelease().
+ */
+void
+NAHLabelIndexAdd(CFStringRef identifier, CFStringRef referenceKey);
+
+/*
+ * Values derived from a certificate, cached by certificate digest.
+ * create is called on a miss and returns a retained value, kCFNull
+ * for a negative result or NULL to not cache anything.
+ */
+CFTypeRef
+NAHCertCacheCopyValue(SecCertificateRef cert, CFStringRef key, CFTypeRef (^create)(CFDataRef digest));
+
+/* same as NAHCopyMMeUserNameFromCertificate() but cached, cert is not released */
+CFStringRef
+NAHCertCacheCopyDigestName(SecCertificateRef cert);
+
+/*
+ * Phase timing and cache statistics, see KRBCopyStatistics().  Each
+ * phase is also an os_signpost interval.
+ */
+enum krb_phase {
+	KRB_PHASE_DECONSTRUCT = 0,	/* Bonjour service name */
+	KRB_PHASE_KDC_LOOKUP,		/* lookup_by_kdc */
+	KRB_PHASE_GETADDRINFO,
+	KRB_PHASE_REVERSE_DNS,
+	KRB_PHASE_FIND_MAPPING,
+	KRB_PHASE_CACHE_SCAN,		/* credential cache collection */
+	KRB_PHASE_CERTIFICATE,		/* deriving names from certificates */
+	KRB_PHASE_NTLM_ENUM,
+	KRB_PHASE_AS_EXCHANGE,
+	KRB_PHASE_MAX
+};
+
+enum krb_cache {
+	KRB_CACHE_HOST = 0,
+	KRB_CACHE_CCACHE_SNAPSHOT,
+	KRB_CACHE_CERTIFICATE,
+	KRB_CACHE_NEGTOKEN,
+	KRB_CACHE_SERVICE_NAME,
+	KRB_CACHE_MAX
+};
+
+#define KRB_STATS_BUCKETS	24	/* log2 microsecond buckets */
+
+struct krb_phase_timer {
+	uint64_t start;
+	uint64_t spid;		/* os_signpost_id_t */
+	enum krb_phase phase;
+};
+
+void
+KRBPhaseBegin(struct krb_phase_timer *timer, enum krb_phase phase);
+
+void
+KRBPhaseEnd(struct krb_phase_timer *timer);
+
+void
+KRBStatsCacheRecord(enum krb_cache cache, int hit);
+
 #define kGSSAPIMechSupportsAppleLKDC	    CFSTR("1.2.752.43.14.3")
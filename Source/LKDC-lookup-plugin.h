@@ -25,3 +25,23 @@
  *
  * @APPLE_LICENSE_HEADER_END@
  */
+
+#include <stdint.h>
+
+/*
+ * Counters kept by the LKDC locate plugin since it was loaded.
+ * Resolutions are LKDCFindKDCForRealm plus getaddrinfo and address
+ * ordering, done on cache misses only.
+ */
+struct LKDCPluginStatistics {
+	uint64_t lookups;		/* LKDC: realm KDC lookups */
+	uint64_t cacheHits;
+	uint64_t cacheNegativeHits;
+	uint64_t resolutions;
+	uint64_t resolutionFailures;
+	uint64_t resolutionTimeTotalUsec;
+	uint64_t resolutionTimeMaxUsec;
+	uint64_t callbackErrors;	/* Heimdal callback returned non-zero */
+};
+
+void LKDCPluginGetStatistics (struct LKDCPluginStatistics *stats);
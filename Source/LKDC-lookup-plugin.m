@@ -28,6 +28,10 @@
 
 #include "LKDC-lookup-plugin.h"
 #include <os/log.h>
+#include <os/signpost.h>
+#include <dispatch/dispatch.h>
+#include <notify.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -35,51 +39,425 @@
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 
 #include <Heimdal/krb5.h>
 #include <Heimdal/locate_plugin.h>
 
 #include "LKDCHelper.h"
 
+/*
+ * Answers are cached per plugin instance, keyed by (realm, family,
+ * socktype), since Heimdal asks for every AS and TGS request and
+ * resolving the Bonjour name of the peer each time is slow.  Failed
+ * lookups are cached for a shorter time.  The whole cache is thrown
+ * away when it gets older than LKDC_CACHE_MAX_AGE so a peer that
+ * moved is picked up again.
+ */
+
+#define LKDC_CACHE_TTL		60
+#define LKDC_CACHE_NEGATIVE_TTL	5
+#define LKDC_CACHE_MAX_AGE	600
+#define LKDC_CACHE_MAX_ENTRIES	32
+
+typedef struct _cached_addr {
+	int			socktype;
+	socklen_t		len;
+	int			rtt;	/* connect time in ms, -1 if unreachable */
+	struct sockaddr_storage	ss;
+} cached_addr;
+
+typedef struct _cache_entry {
+	struct _cache_entry	*next;
+	char			*realm;
+	int			family;
+	int			socktype;
+	time_t			expire;
+	size_t			naddrs;	/* 0 means negative entry */
+	cached_addr		*addrs;
+} cache_entry;
+
 typedef struct _state {
 	krb5_context krb_context;
 	time_t	cacheCreateTime;
+	pthread_mutex_t	lock;
+	cache_entry	*cache;
+	size_t		cacheLen;
 } state;
 
-#define LKDC_PLUGIN_DEBUG 1
-#if LKDC_PLUGIN_DEBUG
-#define debug(fmt, ...) do { debug_(__func__, fmt, ## __VA_ARGS__); } while(0)
-static inline void
-debug_(const char *func, const char *fmt, ...)
+/*
+ * Instrumentation.  debug() goes to os_log_debug, so the arguments
+ * are only formatted when debug logging is turned on for the
+ * subsystem, and resolutions are signposted.  The counters are
+ * always kept; KRBCopyStatistics() picks them up through
+ * LKDCPluginGetStatistics(), and posting the KerberosHelper
+ * statistics notification logs them.
+ */
+
+#define LKDC_STATS_NOTIFICATION	"com.apple.KerberosHelper.statistics"
+
+static void log_statistics (void);
+
+static os_log_t
+lkdc_log (void)
 {
-	static const char ellipsis[] = "[...]";
-	char buf[2048];
-	char *p = buf;
-	char *endp = &buf[sizeof(buf)];
-	ssize_t n = snprintf(p, endp-p, "%s: ", func);
-	
-	if ((size_t)n >= endp-p)
+	static os_log_t log;
+	static dispatch_once_t once;
+	static int token;
+
+	dispatch_once (&once, ^{
+		log = os_log_create ("com.apple.KerberosHelper", "LKDC-lookup-plugin");
+		(void) notify_register_dispatch (LKDC_STATS_NOTIFICATION, &token,
+						 dispatch_get_global_queue (DISPATCH_QUEUE_PRIORITY_LOW, 0),
+						 ^(int t) { log_statistics (); });
+	});
+	return log;
+}
+
+#define debug(fmt, ...) os_log_debug (lkdc_log (), "%s: " fmt, __func__, ## __VA_ARGS__)
+#define debug_enabled() os_log_debug_enabled (lkdc_log ())
+
+static struct {
+	_Atomic uint64_t lookups;
+	_Atomic uint64_t cacheHits;
+	_Atomic uint64_t cacheNegativeHits;
+	_Atomic uint64_t resolutions;
+	_Atomic uint64_t resolutionFailures;
+	_Atomic uint64_t resolutionTimeTotalUsec;
+	_Atomic uint64_t resolutionTimeMaxUsec;
+	_Atomic uint64_t callbackErrors;
+} counters;
+
+void
+LKDCPluginGetStatistics (struct LKDCPluginStatistics *stats)
+{
+	stats->lookups = atomic_load (&counters.lookups);
+	stats->cacheHits = atomic_load (&counters.cacheHits);
+	stats->cacheNegativeHits = atomic_load (&counters.cacheNegativeHits);
+	stats->resolutions = atomic_load (&counters.resolutions);
+	stats->resolutionFailures = atomic_load (&counters.resolutionFailures);
+	stats->resolutionTimeTotalUsec = atomic_load (&counters.resolutionTimeTotalUsec);
+	stats->resolutionTimeMaxUsec = atomic_load (&counters.resolutionTimeMaxUsec);
+	stats->callbackErrors = atomic_load (&counters.callbackErrors);
+}
+
+static void
+log_statistics (void)
+{
+	struct LKDCPluginStatistics s;
+
+	LKDCPluginGetStatistics (&s);
+	os_log (lkdc_log (), "lookups %llu cache hits %llu negative hits %llu resolutions %llu failures %llu "
+		"total %llu us max %llu us callback errors %llu",
+		(unsigned long long)s.lookups, (unsigned long long)s.cacheHits,
+		(unsigned long long)s.cacheNegativeHits, (unsigned long long)s.resolutions,
+		(unsigned long long)s.resolutionFailures, (unsigned long long)s.resolutionTimeTotalUsec,
+		(unsigned long long)s.resolutionTimeMaxUsec, (unsigned long long)s.callbackErrors);
+}
+
+static void
+count_resolution (const struct timespec *start, int failed)
+{
+	struct timespec now;
+	uint64_t usec, max;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	usec = (uint64_t)(now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+
+	atomic_fetch_add (&counters.resolutions, 1);
+	if (failed)
+		atomic_fetch_add (&counters.resolutionFailures, 1);
+	atomic_fetch_add (&counters.resolutionTimeTotalUsec, usec);
+	max = atomic_load (&counters.resolutionTimeMaxUsec);
+	while (usec > max && !atomic_compare_exchange_weak (&counters.resolutionTimeMaxUsec, &max, usec))
+		;
+}
+
+static void
+cache_free_entry (cache_entry *e)
+{
+	free (e->realm);
+	free (e->addrs);
+	free (e);
+}
+
+static void
+cache_flush (state *st)
+{
+	cache_entry *e;
+
+	while ((e = st->cache) != NULL) {
+		st->cache = e->next;
+		cache_free_entry (e);
+	}
+	st->cacheLen = 0;
+	st->cacheCreateTime = time (NULL);
+}
+
+/* Called with st->lock held, returns a copy of the addresses */
+static cache_entry *
+cache_lookup (state *st, const char *realm, int family, int socktype, time_t now)
+{
+	cache_entry **e, *found = NULL;
+
+	if (now - st->cacheCreateTime > LKDC_CACHE_MAX_AGE)
+		cache_flush (st);
+
+	for (e = &st->cache; *e != NULL; ) {
+		cache_entry *c = *e;
+
+		if (c->expire <= now) {
+			*e = c->next;
+			st->cacheLen--;
+			cache_free_entry (c);
+			continue;
+		}
+		if (c->family == family && c->socktype == socktype && strcmp (c->realm, realm) == 0) {
+			found = c;
+			break;
+		}
+		e = &c->next;
+	}
+	if (found == NULL)
+		return NULL;
+
+	cache_entry *copy = calloc (1, sizeof (*copy));
+	if (copy == NULL)
+		return NULL;
+	copy->naddrs = found->naddrs;
+	if (found->naddrs) {
+		copy->addrs = malloc (found->naddrs * sizeof (copy->addrs[0]));
+		if (copy->addrs == NULL) {
+			free (copy);
+			return NULL;
+		}
+		memcpy (copy->addrs, found->addrs, found->naddrs * sizeof (copy->addrs[0]));
+	}
+	return copy;
+}
+
+/* Takes ownership of addrs */
+static void
+cache_store (state *st, const char *realm, int family, int socktype, cached_addr *addrs, size_t naddrs)
+{
+	cache_entry *e, **p;
+
+	if ((e = calloc (1, sizeof (*e))) == NULL || (e->realm = strdup (realm)) == NULL) {
+		free (e);
+		free (addrs);
 		return;
-	p += n;
-	va_list ap;
-	va_start(ap, fmt);
-	n = vsnprintf(p, endp-p, fmt, ap);
-	va_end(ap);
-	if ((size_t)n >= endp-p)
-		snprintf(endp-sizeof(ellipsis), sizeof(ellipsis), ellipsis);
-	os_log(OS_LOG_DEFAULT, "%s", buf);
+	}
+	e->family = family;
+	e->socktype = socktype;
+	e->addrs = addrs;
+	e->naddrs = naddrs;
+	e->expire = time (NULL) + (naddrs ? LKDC_CACHE_TTL : LKDC_CACHE_NEGATIVE_TTL);
+
+	pthread_mutex_lock (&st->lock);
+	/* drop an older answer for the same key, and the oldest entry if full */
+	for (p = &st->cache; *p != NULL; ) {
+		cache_entry *c = *p;
+		if ((c->family == family && c->socktype == socktype && strcmp (c->realm, realm) == 0) ||
+		    (st->cacheLen >= LKDC_CACHE_MAX_ENTRIES && c->next == NULL)) {
+			*p = c->next;
+			st->cacheLen--;
+			cache_free_entry (c);
+			continue;
+		}
+		p = &c->next;
+	}
+	e->next = st->cache;
+	st->cache = e;
+	st->cacheLen++;
+	pthread_mutex_unlock (&st->lock);
 }
-#else
-#define debug(...)
-#endif
 
 static krb5_error_code LKDCInit (krb5_context c, void **ptr)
 {
+	state *st;
+
+	*ptr = NULL;
+
+	(void) lkdc_log ();	/* registers for the statistics notification */
+
+	if ((st = calloc (1, sizeof (*st))) == NULL)
+		return ENOMEM;
+	if (pthread_mutex_init (&st->lock, NULL) != 0) {
+		free (st);
+		return ENOMEM;
+	}
+	st->krb_context = c;
+	st->cacheCreateTime = time (NULL);
+
+	*ptr = st;
 	return 0;
 }
 
 static void LKDCFinish (void *ptr) {
-	return;
+	state *st = ptr;
+
+	if (NULL == st)
+		return;
+
+	cache_flush (st);
+	pthread_mutex_destroy (&st->lock);
+	free (st);
+}
+
+/*
+ * A peer often has an IPv6 link-local address that doesn't work as
+ * well as an IPv4 one, and Heimdal waits out a full KDC timeout on a
+ * dead address before it tries the next.  So before handing out a
+ * fresh answer, race a TCP connect to every address (the same port
+ * the KDC listens on) and put the ones that answered first, fastest
+ * first.  The rest follow with the address families interleaved.
+ * The measured RTT is kept with the cached answer.
+ */
+
+#define LKDC_PROBE_TIMEOUT_MS	250
+
+static int
+elapsed_ms (const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (int)((now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000);
+}
+
+static void
+probe_addresses (cached_addr *addrs, size_t naddrs)
+{
+	struct pollfd *fds;
+	struct timespec start;
+	size_t i, pending = 0;
+
+	if ((fds = calloc (naddrs, sizeof (fds[0]))) == NULL)
+		return;
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < naddrs; i++) {
+		int fd = socket (addrs[i].ss.ss_family, SOCK_STREAM, 0);
+
+		fds[i].fd = -1;
+		if (fd < 0)
+			continue;
+		if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+			close (fd);
+			continue;
+		}
+		if (connect (fd, (struct sockaddr *)&addrs[i].ss, addrs[i].len) == 0) {
+			addrs[i].rtt = elapsed_ms (&start);
+			close (fd);
+			continue;
+		}
+		if (EINPROGRESS != errno) {
+			close (fd);
+			continue;
+		}
+		fds[i].fd = fd;
+		fds[i].events = POLLOUT;
+		pending++;
+	}
+
+	while (pending > 0) {
+		int left = LKDC_PROBE_TIMEOUT_MS - elapsed_ms (&start);
+
+		if (left <= 0 || poll (fds, (nfds_t)naddrs, left) <= 0)
+			break;
+
+		for (i = 0; i < naddrs; i++) {
+			int soerr = 0;
+			socklen_t len = sizeof (soerr);
+
+			if (fds[i].fd < 0 || 0 == fds[i].revents)
+				continue;
+			if (getsockopt (fds[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len) == 0 && 0 == soerr)
+				addrs[i].rtt = elapsed_ms (&start);
+			close (fds[i].fd);
+			fds[i].fd = -1;
+			pending--;
+		}
+	}
+
+	for (i = 0; i < naddrs; i++)
+		if (fds[i].fd >= 0)
+			close (fds[i].fd);
+	free (fds);
+}
+
+static void
+order_addresses (cached_addr *addrs, size_t naddrs)
+{
+	cached_addr *sorted;
+	size_t i, j, n = 0;
+	int next_family;
+
+	if (naddrs < 2)
+		return;
+
+	probe_addresses (addrs, naddrs);
+
+	if ((sorted = malloc (naddrs * sizeof (sorted[0]))) == NULL)
+		return;
+
+	/* reachable addresses, by RTT */
+	for (i = 0; i < naddrs; i++) {
+		if (addrs[i].rtt < 0)
+			continue;
+		for (j = n; j > 0 && sorted[j - 1].rtt > addrs[i].rtt; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = addrs[i];
+		n++;
+	}
+
+	/* then the rest, alternating families, starting with the other family than the best one */
+	next_family = (n > 0 && AF_INET6 == sorted[0].ss.ss_family) ? AF_INET : AF_INET6;
+	while (n < naddrs) {
+		for (i = 0; i < naddrs; i++)
+			if (addrs[i].rtt < 0 && addrs[i].len != 0 && addrs[i].ss.ss_family == next_family)
+				break;
+		if (i == naddrs) {
+			/* none left of that family, take any */
+			for (i = 0; i < naddrs; i++)
+				if (addrs[i].rtt < 0 && addrs[i].len != 0)
+					break;
+		}
+		sorted[n++] = addrs[i];
+		addrs[i].len = 0;	/* taken */
+		next_family = (AF_INET6 == sorted[n - 1].ss.ss_family) ? AF_INET : AF_INET6;
+	}
+
+	memcpy (addrs, sorted, naddrs * sizeof (addrs[0]));
+	free (sorted);
+
+	if (debug_enabled ())
+		for (i = 0; i < naddrs; i++)
+			debug("order %zu: family %d rtt %d", i, addrs[i].ss.ss_family, addrs[i].rtt);
+}
+
+/* Hand the addresses to Heimdal, copies so the callback can't touch the cache */
+static void
+run_callbacks (const cached_addr *addrs, size_t naddrs,
+			   int (*cbfunc)(void *, int, struct sockaddr *), void *cbdata)
+{
+	size_t i;
+
+	for (i = 0; i < naddrs; i++) {
+		struct sockaddr_storage ss;
+		int err;
+
+		memcpy (&ss, &addrs[i].ss, addrs[i].len);
+		err = cbfunc (cbdata, addrs[i].socktype, (struct sockaddr *)&ss);
+		if (err)
+			atomic_fetch_add (&counters.callbackErrors, 1);
+		debug("Callback done %zu, err=%d", i, err);
+	}
 }
 
 static krb5_error_code LKDCLookup (void *ptr,
@@ -97,6 +475,11 @@ static krb5_error_code LKDCLookup (void *ptr,
 	struct addrinfo *res = NULL;
 	uint16_t		port;
 	int				err = 0;
+	state			*st = ptr;
+	struct timespec		start;
+	os_signpost_id_t	signpost;
+	cached_addr		*addrs = NULL;
+	size_t			naddrs = 0;
 
 	switch (family) {
 	case 0:
@@ -125,9 +508,38 @@ static krb5_error_code LKDCLookup (void *ptr,
 	if (strncmp ("LKDC:", realm, 5) != 0) {
 		return error;
 	}
-		
+
+	atomic_fetch_add (&counters.lookups, 1);
+
+	if (NULL != st) {
+		cache_entry *cached;
+
+		pthread_mutex_lock (&st->lock);
+		cached = cache_lookup (st, realm, family, socktype, time (NULL));
+		pthread_mutex_unlock (&st->lock);
+
+		if (NULL != cached) {
+			size_t naddrs = cached->naddrs;
+
+			atomic_fetch_add (naddrs ? &counters.cacheHits : &counters.cacheNegativeHits, 1);
+			debug("cached answer, %zu addresses", naddrs);
+			run_callbacks (cached->addrs, naddrs, cbfunc, cbdata);
+			free (cached->addrs);
+			free (cached);
+			return naddrs ? 0 : error;
+		}
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	signpost = os_signpost_id_generate (lkdc_log ());
+	os_signpost_interval_begin (lkdc_log (), signpost, "Resolve", "family %d socktype %d", family, socktype);
+
 	err = LKDCFindKDCForRealm (realm, &hostname, &port);
 	if (0 != err || NULL == hostname) {
+		os_signpost_interval_end (lkdc_log (), signpost, "Resolve", "no KDC");
+		count_resolution (&start, 1);
+		if (NULL != st)
+			cache_store (st, realm, family, socktype, NULL, 0);
 		return error;
 	}
 	
@@ -147,8 +559,7 @@ static krb5_error_code LKDCLookup (void *ptr,
 			void *in_addr = NULL;
 			uint16_t in_port = 0;
 			
-			debug("0x%08p: family = %d, socktype = %d, protocol = %d", res, res->ai_family, res->ai_socktype, res->ai_protocol);
-			debug("Running callback 0x%08p", res);
+			debug("%p: family = %d, socktype = %d, protocol = %d", res, res->ai_family, res->ai_socktype, res->ai_protocol);
 			switch (res->ai_family) {
 			case AF_INET:
 				in_addr = &(((struct sockaddr_in *)res->ai_addr)->sin_addr);
@@ -163,11 +574,17 @@ static krb5_error_code LKDCLookup (void *ptr,
 				debug("Unexpected address family %d", res->ai_family);
 				break;
 			}
-			if (NULL != in_addr) {
-				err = cbfunc (cbdata, res->ai_socktype, res->ai_addr);
-				debug("Callback done 0x%08p, err=%d", res, err);
-#if LKDC_PLUGIN_DEBUG
-				{
+			if (NULL != in_addr && res->ai_addrlen <= sizeof (struct sockaddr_storage)) {
+				cached_addr *a = realloc (addrs, (naddrs + 1) * sizeof (addrs[0]));
+				if (NULL != a) {
+					addrs = a;
+					addrs[naddrs].socktype = res->ai_socktype;
+					addrs[naddrs].len = res->ai_addrlen;
+					addrs[naddrs].rtt = -1;
+					memcpy (&addrs[naddrs].ss, res->ai_addr, res->ai_addrlen);
+					naddrs++;
+				}
+				if (debug_enabled ()) {
 					char ipString[1024];
 					ipString[0] = '\0';
 					if (NULL == inet_ntop(res->ai_family, in_addr, ipString, sizeof(ipString)))
@@ -175,14 +592,27 @@ static krb5_error_code LKDCLookup (void *ptr,
 					else
 						debug("addr = %s, port = %d", ipString, (int)in_port);
 				}
-#endif
 			}
 
 		}
 		freeaddrinfo (aiResult);
 		aiResult = NULL;
+
+		order_addresses (addrs, naddrs);
+		os_signpost_interval_end (lkdc_log (), signpost, "Resolve", "%zu addresses", naddrs);
+		count_resolution (&start, naddrs == 0);
+		run_callbacks (addrs, naddrs, cbfunc, cbdata);
+
+		if (NULL != st && naddrs > 0)
+			cache_store (st, realm, family, socktype, addrs, naddrs);
+		else
+			free (addrs);
 	} else {
-		debug("failed %d", error);
+		os_signpost_interval_end (lkdc_log (), signpost, "Resolve", "getaddrinfo failed %d", err);
+		count_resolution (&start, 1);
+		debug("failed %d", err);
+		if (NULL != st && EAI_NONAME == err)
+			cache_store (st, realm, family, socktype, NULL, 0);
 		return error;
 	}
 
@@ -62,6 +62,16 @@ extern const CFStringRef kNAHUserName; /* CFStringRef */
 extern const CFStringRef kNAHCertificates; /* SecIdentityRef/CFArrayRef */
 extern const CFStringRef kNAHPassword;
 
+/*
+ * If set to kCFBooleanTrue, NAHCreate doesn't compute the selections
+ * up front.  They are computed in priority order by
+ * NAHGetSelectionAtIndex() as they are asked for, so a caller that
+ * succeeds with the first selection doesn't pay for the rest.
+ * NAHGetSelections() still works and computes all of them.
+ */
+
+extern const CFStringRef kNAHLazySelections; /* CFBooleanRef */
+
 NAHRef
 NAHCreate(CFAllocatorRef alloc,
 	 CFStringRef hostname,
@@ -75,6 +85,15 @@ NAHCreate(CFAllocatorRef alloc,
 CFArrayRef
 NAHGetSelections(NAHRef);
 
+/*
+ * Return selection number idx, computing more selections if needed,
+ * or NULL when there are no more selections.  The selection is owned
+ * by the NAHRef.
+ */
+
+NAHSelectionRef
+NAHGetSelectionAtIndex(NAHRef, CFIndex idx);
+
 extern const CFStringRef kNAHForceRefreshCredential;
 
 Boolean
@@ -88,9 +107,40 @@ NAHSelectionAcquireCredentialAsync(NAHSelectionRef selection,
 				  dispatch_queue_t q,
 				  void (^result)(CFErrorRef error));
 
+/*
+ * Acquire credentials for the selections of na in priority order,
+ * running a few acquisitions concurrently.  result is called on q
+ * once with the highest priority selection that got a credential,
+ * or with NULL and an error when none did.  Use NAHCancel() to stop
+ * it early.
+ */
+
+Boolean
+NAHAcquireFirstCredentialAsync(NAHRef na,
+			       CFDictionaryRef info,
+			       dispatch_queue_t q,
+			       void (^result)(NAHSelectionRef selection, CFErrorRef error));
+
 void
 NAHCancel(NAHRef na);
 
+/*
+ * Warm the shared caches (DNS canonicalization, KDC referrals, host
+ * realm mappings and the credential cache snapshot) for hosts that
+ * will be connected to soon, so that the later NAHCreate or
+ * KRBCreateSessionInfo are answered from memory.  The lookups run in
+ * the background, a few hosts at the time, and are given up on when
+ * kNAHPrefetchTimeout seconds (default 10) have passed.  NAHCreate
+ * uses the prefetched host realm mappings for its classic Kerberos
+ * selections.  The caches are keyed by host name only, so service
+ * doesn't change what is looked up, it is only logged.
+ */
+
+extern const CFStringRef kNAHPrefetchTimeout; /* CFNumberRef */
+
+void
+NAHPrefetch(CFArrayRef hostnames, CFStringRef service, CFDictionaryRef info);
+
 /*
  * Status of selection
  */
@@ -138,12 +188,38 @@ NAHAddReferenceAndLabel(NAHSelectionRef client, CFStringRef identifier);
 void
 NAHFindByLabelAndRelease(CFStringRef identifier);
 
+/*
+ * Same as NAHFindByLabelAndRelease for an array of identifiers, the
+ * credentials are only walked once for the whole array.
+ */
+
+void
+NAHFindByLabelsAndRelease(CFArrayRef identifiers);
+
 Boolean
 NAHCredAddReference(CFStringRef referenceKey);
 
 Boolean
 NAHCredRemoveReference(CFStringRef referenceKey);
 
+/*
+ * Apply many reference count changes at once.  Changes for the same
+ * referenceKey are merged, each credential is looked up once and
+ * gets the sum of the deltas and all the labels (label is an
+ * identifier as passed to NAHAddReferenceAndLabel, or NULL).
+ * result is set for every entry.
+ */
+
+typedef struct NAHCredReferenceChange {
+    CFStringRef referenceKey;
+    int delta;
+    CFStringRef label;
+    Boolean result;
+} NAHCredReferenceChange;
+
+void
+NAHCredChangeReferences(NAHCredReferenceChange *changes, CFIndex count);
+
 char *
 NAHCreateRefLabelFromIdentifier(CFStringRef identifier);
 
@@ -37,8 +37,12 @@
 #include <Carbon/Carbon.h>
 #include <OpenDirectory/OpenDirectory.h>
 #include <DirectoryService/DirectoryService.h>
+#include <dispatch/dispatch.h>
+#include <notify.h>
+#include <time.h>
 
-OSStatus DSCopyLocalKDC (CFStringRef *realm) 
+static OSStatus
+copy_local_kdc (CFStringRef *realm) 
 {
 	OSStatus err = 0;
 	ODNodeRef cfNodeRef = NULL;
@@ -81,6 +85,63 @@ Error:
 	return err;
 }
 
+/*
+ * The Local KDC realm only changes when configureLocalKDC or
+ * migrateLocalKDC run, so the realm is kept until they post
+ * kLocalKDCChangedNotification.  Failed lookups, for example when
+ * opendirectoryd isn't up yet, are only remembered for
+ * LOCALKDC_NEGATIVE_TTL seconds.
+ */
+
+#define LOCALKDC_NEGATIVE_TTL	5
+
+static struct {
+	dispatch_queue_t q;
+	int token;
+	int valid;
+	time_t expire;		/* for failed lookups */
+	OSStatus err;
+	CFStringRef realm;
+} localkdc;
+
+static dispatch_queue_t
+localkdc_queue (void)
+{
+	static dispatch_once_t once;
+	dispatch_once (&once, ^{
+		localkdc.q = dispatch_queue_create ("com.apple.KerberosHelper.localkdc", NULL);
+		(void)notify_register_dispatch (kLocalKDCChangedNotification, &localkdc.token, localkdc.q, ^(int t) {
+			localkdc.valid = 0;
+			if (localkdc.realm) { CFRelease (localkdc.realm); }
+			localkdc.realm = NULL;
+		});
+	});
+	return localkdc.q;
+}
+
+OSStatus DSCopyLocalKDC (CFStringRef *realm) 
+{
+	__block OSStatus err = 0;
+
+	if (NULL == realm) { return paramErr; }
+
+	*realm = NULL;
+
+	dispatch_sync (localkdc_queue (), ^{
+		if (localkdc.valid && localkdc.err != noErr && time (NULL) >= localkdc.expire)
+			localkdc.valid = 0;
+		if (!localkdc.valid) {
+			localkdc.err = copy_local_kdc (&localkdc.realm);
+			localkdc.expire = time (NULL) + LOCALKDC_NEGATIVE_TTL;
+			localkdc.valid = 1;
+		}
+		err = localkdc.err;
+		if (localkdc.realm) { *realm = CFRetain (localkdc.realm); }
+	});
+
+	return err;
+}
+
 #else
 
 #warning On Mac OS X 10.4
@@ -30,4 +30,7 @@
 #define kKDCRecordName          "KerberosKDC"
 #define kRealmNameKey           "realname"
 
+/* Posted by configureLocalKDC and migrateLocalKDC when the realm may have changed */
+#define kLocalKDCChangedNotification	"com.apple.KerberosHelper.LocalKDCChanged"
+
 OSStatus DSCopyLocalKDC (CFStringRef *realm);
@@ -45,11 +45,15 @@
 #include <CoreServices/CoreServicesPriv.h>
 
 #include <os/log.h>
+#include <notify.h>
 
 #include "DeconstructServiceName.h"
 #include "utils.h"
 
 static void add_user_selections(NAHRef na);
+struct nah_ntlm_iter;
+static void ntlm_iter_release(struct nah_ntlm_iter *iter);
+static void nah_prefs_copy(NAHRef na);
 
 
 const CFStringRef kNAHServiceAFPServer = CFSTR("afpserver");
@@ -59,9 +63,6 @@ const CFStringRef kNAHServiceVNCServer = CFSTR("vnc");
 
 static const char *nah_created = "nah-created";
 
-static bool nah_use_gss_uam = true;
-static bool nah_vnc_support_iakerb = true;
-static dispatch_once_t init_globals;
 
 enum NAHMechType {
     NO_MECH = 0,
@@ -90,6 +91,7 @@ struct NAHSelectionData {
     CFStringRef inferredLabel;
 
     krb5_ccache ccache;
+    char *acquired_ccname;	/* cache acquire_kerberos created */
 };
 
 struct NAHData {
@@ -104,9 +106,15 @@ struct NAHData {
     CFStringRef username;
     CFStringRef specificname; 
     CFDictionaryRef servermechs;
+    unsigned int servermechbits; /* see parseServerMechs() */
 
     CFStringRef spnegoServerName;
 
+    /* preferences, see nah_prefs_copy() */
+    CFDictionaryRef userSelections;
+    bool use_gss_uam;
+    bool vnc_support_iakerb;
+
     /* credentials */
     CFArrayRef x509identities;
     CFStringRef password;
@@ -122,6 +130,20 @@ struct NAHData {
     /* final result */
 
     CFMutableArrayRef selections;
+    CFMutableDictionaryRef selectionIndex;
+
+    volatile int cancelled;
+
+    /* selection generation state, see next_stage() */
+    int stage;
+    KRBCacheSnapshotRef ccsnap;
+    struct nah_ntlm_iter *ntlm;
+    struct {
+	unsigned long flags;
+	unsigned int enabled:1;
+	unsigned int try_wlkdc:1;
+	unsigned int try_iakerb_with_lkdc:1;
+    } krb;
 };
 
 #define CFRELEASE(x) do { if ((x)) { CFRelease((x)); (x) = NULL; } } while(0)
@@ -130,61 +152,195 @@ struct NAHData {
  *
  */
 
-CFStringRef
-NAHCopyMMeUserNameFromCertificate(SecCertificateRef cert)
+static CFDataRef
+cert_digest(SecCertificateRef cert)
 {
     unsigned char digest[CC_SHA1_DIGEST_LENGTH];
-    char str[CC_SHA1_DIGEST_LENGTH * 2 + 1];
     CFDataRef certData;
-    CC_SHA1_CTX ctx;
-    char *cpOut;
-    unsigned dex;
 
     certData = SecCertificateCopyData(cert);
-    CFRelease(cert);
     if (NULL == certData)
         return NULL;
 
-    CC_SHA1_Init(&ctx);
-    CC_SHA1_Update(&ctx, CFDataGetBytePtr(certData), (CC_LONG)CFDataGetLength(certData));
-    CC_SHA1_Final(digest, &ctx);
-
+    CC_SHA1(CFDataGetBytePtr(certData), (CC_LONG)CFDataGetLength(certData), digest);
     CFRelease(certData);
 
+    return CFDataCreate(NULL, digest, sizeof(digest));
+}
+
+static CFStringRef
+digest_name(CFDataRef digest)
+{
+    char str[CC_SHA1_DIGEST_LENGTH * 2 + 1];
+    const UInt8 *p = CFDataGetBytePtr(digest);
+    char *cpOut;
+    CFIndex dex;
+
     cpOut = str;
 
-    for(dex = 0; dex < CC_SHA1_DIGEST_LENGTH; dex++) {
-	snprintf(cpOut, 3, "%02X", (unsigned)(digest[dex]));
+    for(dex = 0; dex < CFDataGetLength(digest) && dex < CC_SHA1_DIGEST_LENGTH; dex++) {
+	snprintf(cpOut, 3, "%02X", (unsigned)(p[dex]));
 	cpOut += 2;
     }
+    *cpOut = '\0';
 
     return CFStringCreateWithCString(NULL, str, kCFStringEncodingASCII);
 }
 
+CFStringRef
+NAHCopyMMeUserNameFromCertificate(SecCertificateRef cert)
+{
+    CFStringRef name;
+    CFDataRef digest;
+
+    digest = cert_digest(cert);
+    CFRelease(cert);
+    if (NULL == digest)
+        return NULL;
+
+    name = digest_name(digest);
+    CFRelease(digest);
+
+    return name;
+}
+
 /*
- *
+ * Certificate metadata cache.  The same few identities are used all
+ * day, so what is derived from a certificate is kept by certificate
+ * digest instead of parsing the certificate on every connection.
+ * Values are created outside the queue.  kCFNull from the create
+ * block records a negative result, NULL is not cached.  When the
+ * cache is full the least recently used certificate is dropped.
  */
 
-static char *
-cf2cstring(CFStringRef inString)
+#define NAH_CERTCACHE_MAX	32
+
+static struct {
+    dispatch_queue_t q;
+    CFMutableDictionaryRef entries; /* digest -> CFMutableDictionary */
+    CFMutableArrayRef lru;	    /* digests, most recently used last */
+} nahcertcache;
+
+/* must be called on nahcertcache.q */
+static void
+nah_certcache_touch(CFDataRef digest)
+{
+    CFIndex n = CFArrayGetFirstIndexOfValue(nahcertcache.lru, CFRangeMake(0, CFArrayGetCount(nahcertcache.lru)), digest);
+
+    if (n != kCFNotFound)
+	CFArrayRemoveValueAtIndex(nahcertcache.lru, n);
+    CFArrayAppendValue(nahcertcache.lru, digest);
+}
+
+static dispatch_queue_t
+nah_certcache_queue(void)
 {
-    char *string = NULL;
-    CFIndex length;
-    
-    string = (char *) CFStringGetCStringPtr(inString, kCFStringEncodingUTF8);
-    if (string)
-	return strdup(string);
-
-    length = CFStringGetMaximumSizeForEncoding(CFStringGetLength(inString), 
-					       kCFStringEncodingUTF8) + 1;
-    string = malloc (length);
-    if (string == NULL)
-	return NULL;
-    if (!CFStringGetCString(inString, string, length, kCFStringEncodingUTF8)) {
-	free (string);
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+	nahcertcache.q = dispatch_queue_create("com.apple.KerberosHelper.nah-certcache", NULL);
+	nahcertcache.entries = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	nahcertcache.lru = CFArrayCreateMutable(NULL, NAH_CERTCACHE_MAX, &kCFTypeArrayCallBacks);
+	if (nahcertcache.lru == NULL)
+	    CFRELEASE(nahcertcache.entries);
+    });
+    return nahcertcache.q;
+}
+
+CFTypeRef
+NAHCertCacheCopyValue(SecCertificateRef cert, CFStringRef key, CFTypeRef (^create)(CFDataRef digest))
+{
+    dispatch_queue_t q = nah_certcache_queue();
+    __block CFTypeRef value = NULL;
+    CFDataRef digest;
+
+    digest = cert_digest(cert);
+    if (digest == NULL)
 	return NULL;
+
+    dispatch_sync(q, ^{
+	    CFDictionaryRef entry;
+
+	    if (nahcertcache.entries == NULL)
+		return;
+	    entry = CFDictionaryGetValue(nahcertcache.entries, digest);
+	    if (entry) {
+		nah_certcache_touch(digest);
+		value = CFDictionaryGetValue(entry, key);
+	    }
+	    if (value)
+		CFRetain(value);
+	});
+
+    KRBStatsCacheRecord(KRB_CACHE_CERTIFICATE, value != NULL);
+    if (value == NULL) {
+	value = create(digest);
+	if (value) {
+	    dispatch_sync(q, ^{
+		    CFMutableDictionaryRef entry;
+
+		    if (nahcertcache.entries == NULL)
+			return;
+		    entry = (CFMutableDictionaryRef)CFDictionaryGetValue(nahcertcache.entries, digest);
+		    if (entry == NULL) {
+			if (CFArrayGetCount(nahcertcache.lru) >= NAH_CERTCACHE_MAX) {
+			    CFDictionaryRemoveValue(nahcertcache.entries, CFArrayGetValueAtIndex(nahcertcache.lru, 0));
+			    CFArrayRemoveValueAtIndex(nahcertcache.lru, 0);
+			}
+			entry = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+			if (entry == NULL)
+			    return;
+			CFDictionarySetValue(nahcertcache.entries, digest, entry);
+			CFRelease(entry);
+		    }
+		    nah_certcache_touch(digest);
+		    CFDictionarySetValue(entry, key, value);
+		});
+	}
+    }
+    CFRelease(digest);
+
+    if (value == kCFNull)
+	CFRELEASE(value);
+
+    return value;
+}
+
+CFStringRef
+NAHCertCacheCopyDigestName(SecCertificateRef cert)
+{
+    return NAHCertCacheCopyValue(cert, CFSTR("digest-name"), ^(CFDataRef digest) {
+	    return (CFTypeRef)digest_name(digest);
+	});
+}
+
+/*
+ *
+ */
+
+/*
+ * Import a CFString name without copying it to the heap if possible
+ */
+
+static OM_uint32
+import_cfname(OM_uint32 *minor, CFStringRef str, gss_OID nt, gss_name_t *name)
+{
+    __KRBStringView view;
+    gss_buffer_desc buffer;
+    OM_uint32 major;
+
+    *name = GSS_C_NO_NAME;
+
+    buffer.value = (void *)__KRBStringViewInit(&view, str);
+    if (buffer.value == NULL) {
+	__KRBStringViewRelease(&view);
+	*minor = ENOMEM;
+	return GSS_S_FAILURE;
     }
-    return string;
+    buffer.length = view.len;
+
+    major = gss_import_name(minor, &buffer, nt, name);
+    __KRBStringViewRelease(&view);
+    return major;
 }
 
 /*
@@ -213,6 +369,7 @@ naselrelease(NAHSelectionRef nasel)
         krb5_cc_close(nasel->na->context, nasel->ccache);
     CFRELEASE(nasel->certificate);
     CFRELEASE(nasel->inferredLabel);
+    free(nasel->acquired_ccname);
 }
 
 static CFStringRef naseldebug(NAHSelectionRef nasel) CF_RETURNS_RETAINED;
@@ -394,6 +551,7 @@ nahrelease(NAHRef na)
     CFRELEASE(na->specificname);
     CFRELEASE(na->servermechs);
     CFRELEASE(na->spnegoServerName);
+    CFRELEASE(na->userSelections);
 
     CFRELEASE(na->x509identities);
     CFRELEASE(na->password);
@@ -412,13 +570,17 @@ nahrelease(NAHRef na)
     }
 
     CFRELEASE(na->selections);
+    CFRELEASE(na->selectionIndex);
+    KRBReleaseCacheSnapshot(na->ccsnap);
+    if (na->ntlm)
+	ntlm_iter_release(na->ntlm);
 
     if (na->q)
 	dispatch_release(na->q);
     if (na->context)
-	krb5_free_context(na->context);
+	KRBContextPoolPutKrb5(na->context);
     if (na->hxctx)
-	hx509_context_free(&na->hxctx);
+	KRBContextPoolPutHx509(na->hxctx);
 }
 
 static CFTypeID
@@ -470,14 +632,56 @@ NAAlloc(CFAllocatorRef alloc)
     return na;
 }
 
+/*
+ * The mechs the server announced in its NegTokenInit, as a bitmask
+ * computed once in NAHCreate.  Mechanisms in enum NAHMechType use
+ * their enum value as bit number, the rest use the flags below.
+ */
+
+#define MECHBIT(m)		(1U << (m))
+#define MECHBIT_KRB5_MS		(1U << 16)	/* Microsoft Kerberos OID */
+#define MECHBIT_APPLE_LKDC	(1U << 17)	/* AppleLKDC hint */
+#define MECHBIT_NTLM_RAW	(1U << 18)	/* NTLM without SPNEGO */
+
+static const struct {
+    CFStringRef oid;
+    unsigned int bit;
+} mechbits[] = {
+    { kGSSAPIMechKerberosOID, MECHBIT(GSS_KERBEROS) },
+    { kGSSAPIMechKerberosU2UOID, MECHBIT(GSS_KERBEROS_U2U) },
+    { kGSSAPIMechIAKERB, MECHBIT(GSS_KERBEROS_IAKERB) },
+    { kGSSAPIMechPKU2UOID, MECHBIT(GSS_KERBEROS_PKU2U) },
+    { kGSSAPIMechNTLMOID, MECHBIT(GSS_NTLM) },
+    { kGSSAPIMechKerberosMicrosoftOID, MECHBIT_KRB5_MS },
+    { kGSSAPIMechSupportsAppleLKDC, MECHBIT_APPLE_LKDC }
+};
+
+static unsigned int
+parseServerMechs(CFDictionaryRef servermechs)
+{
+    unsigned int bits = 0;
+    CFDataRef data;
+    size_t n;
+
+    if (servermechs == NULL)
+	return 0;
+
+    for (n = 0; n < sizeof(mechbits)/sizeof(mechbits[0]); n++)
+	if (CFDictionaryGetValue(servermechs, mechbits[n].oid) != NULL)
+	    bits |= mechbits[n].bit;
+
+    data = CFDictionaryGetValue(servermechs, kGSSAPIMechNTLMOID);
+    if (data && CFGetTypeID(data) == CFDataGetTypeID() &&
+	CFDataGetLength(data) == 3 && memcmp(CFDataGetBytePtr(data), "raw", 3) == 0)
+	bits |= MECHBIT_NTLM_RAW;
+
+    return bits;
+}
+
 static bool
-haveMech(NAHRef na, CFStringRef mech)
+haveMech(NAHRef na, unsigned int mechbit)
 {
-    if (na->servermechs == NULL)
-	return false;
-    if (CFDictionaryGetValue(na->servermechs, mech) != NULL)
-	return true;
-    return false;
+    return (na->servermechbits & mechbit) != 0;
 }
 
 /*
@@ -518,6 +722,124 @@ enum {
     FORCE_ADD = 2
 };
 
+/*
+ * Index of the selections for duplicate detection.  A selection
+ * without a server matches any server, so every selection is entered
+ * twice: once under its (mech, client, servertype, server) and once
+ * under (mech, client, servertype) alone.  Only the first selection
+ * for a key is kept, the same one the old linear walk found.
+ */
+
+struct selection_key {
+    int any_server;
+    enum NAHMechType mech;
+    CFStringRef client;
+    CFStringRef server;
+    CFStringRef servertype;
+};
+
+static const void *
+selection_key_retain(CFAllocatorRef alloc, const void *value)
+{
+    const struct selection_key *k = value;
+    struct selection_key *c;
+
+    c = CFAllocatorAllocate(alloc, sizeof(*c), 0);
+    if (c == NULL)
+	return NULL;
+    *c = *k;
+    CFRetain(c->client);
+    if (c->server) CFRetain(c->server);
+    CFRetain(c->servertype);
+    return c;
+}
+
+static void
+selection_key_release(CFAllocatorRef alloc, const void *value)
+{
+    struct selection_key *k = (struct selection_key *)value;
+
+    CFRelease(k->client);
+    if (k->server) CFRelease(k->server);
+    CFRelease(k->servertype);
+    CFAllocatorDeallocate(alloc, k);
+}
+
+static Boolean
+selection_key_equal(const void *value1, const void *value2)
+{
+    const struct selection_key *a = value1, *b = value2;
+
+    if (a->any_server != b->any_server || a->mech != b->mech)
+	return false;
+    if (!CFEqual(a->client, b->client) || !CFEqual(a->servertype, b->servertype))
+	return false;
+    if (a->any_server)
+	return true;
+    if (a->server == NULL || b->server == NULL)
+	return a->server == b->server;
+    return CFEqual(a->server, b->server);
+}
+
+static CFHashCode
+selection_key_hash(const void *value)
+{
+    const struct selection_key *k = value;
+    CFHashCode h;
+
+    h = ((CFHashCode)k->mech << 1) ^ (CFHashCode)k->any_server;
+    h = h * 31 + CFHash(k->client);
+    h = h * 31 + CFHash(k->servertype);
+    if (!k->any_server && k->server)
+	h = h * 31 + CFHash(k->server);
+    return h;
+}
+
+static const CFDictionaryKeyCallBacks selection_key_callbacks = {
+    0,
+    selection_key_retain,
+    selection_key_release,
+    NULL,
+    selection_key_equal,
+    selection_key_hash
+};
+
+static void
+indexSelection(NAHRef na, NAHSelectionRef nasel)
+{
+    struct selection_key key = { 0, nasel->mech, nasel->client, nasel->server, nasel->servertype };
+
+    CFDictionaryAddValue(na->selectionIndex, &key, nasel);
+    key.any_server = 1;
+    CFDictionaryAddValue(na->selectionIndex, &key, nasel);
+}
+
+static NAHSelectionRef
+findSelection(NAHRef na, enum NAHMechType mech, CFStringRef client, CFStringRef server, CFStringRef servertype)
+{
+    struct selection_key key = { 1, mech, client, NULL, servertype };
+    NAHSelectionRef exact, wildcard;
+    CFIndex e, w, count;
+
+    if (server == NULL)
+	return (NAHSelectionRef)CFDictionaryGetValue(na->selectionIndex, &key);
+
+    key.any_server = 0;
+    key.server = server;
+    exact = (NAHSelectionRef)CFDictionaryGetValue(na->selectionIndex, &key);
+    key.server = NULL;
+    wildcard = (NAHSelectionRef)CFDictionaryGetValue(na->selectionIndex, &key);
+
+    if (exact == NULL || wildcard == NULL)
+	return exact ? exact : wildcard;
+
+    /* both match, return the one that was added first */
+    count = CFArrayGetCount(na->selections);
+    e = CFArrayGetFirstIndexOfValue(na->selections, CFRangeMake(0, count), exact);
+    w = CFArrayGetFirstIndexOfValue(na->selections, CFRangeMake(0, count), wildcard);
+    return e < w ? exact : wildcard;
+}
+
 static NAHSelectionRef
 addSelection(NAHRef na,
 	     CFStringRef client,
@@ -530,7 +852,6 @@ addSelection(NAHRef na,
 {
     NAHSelectionRef nasel;
     int matching;
-    CFIndex n;
     
     if (clienttype == NULL)
 	clienttype = kNAHNTUsername;
@@ -549,16 +870,8 @@ addSelection(NAHRef na,
 	return NULL;
 
     /* check for dups */
-    for (n = 0; n < CFArrayGetCount(na->selections); n++) {
-	nasel = (NAHSelectionRef)CFArrayGetValueAtIndex(na->selections, n);
-	if (nasel->mech != mech)
-	    continue;
-	if (CFStringCompare(nasel->client, client, 0) != kCFCompareEqualTo)
-	    continue;
-	if (nasel->server && server && CFStringCompare(nasel->server, server, 0) != kCFCompareEqualTo)
-	    continue;
-	if (CFStringCompare(nasel->servertype, servertype, 0) != kCFCompareEqualTo)
-	    continue;
+    nasel = findSelection(na, mech, client, server, servertype);
+    if (nasel) {
 	if (duplicate)
 	    *duplicate = 1;
 	return nasel;
@@ -582,6 +895,7 @@ addSelection(NAHRef na,
     nasel->spnego = (flags & USE_SPNEGO) ? true : false;
 
     CFArrayAppendValue(na->selections, nasel);
+    indexSelection(na, nasel);
 
     CFRelease(nasel); /* referenced by array */
 
@@ -680,15 +994,17 @@ static void
 use_classic_kerberos(NAHRef na, unsigned long flags)
 {
     CFRange range, dr, ur;
-    char **realms, *str;
+    __KRBStringView hostname;
+    char **realms;
     int ret;
 
     if (have_lkdcish_hostname(na, false))
 	return;
 
-    ret = __KRBCreateUTF8StringFromCFString(na->hostname, &str);
-    if (ret)
+    if (__KRBStringViewInit(&hostname, na->hostname) == NULL) {
+	__KRBStringViewRelease(&hostname);
 	return;
+    }
 
     /*
      * If user have @REALM, lets try that out
@@ -759,8 +1075,12 @@ use_classic_kerberos(NAHRef na, unsigned long flags)
      * Try the host realm
      */
 
-    ret = krb5_get_host_realm(na->context, str, &realms);
-    __KRBReleaseUTF8String(str);
+    /* NAHPrefetch and KRBCreateSessionInfo may have done this already */
+    if (KRBHostCacheCopyRealms(hostname.str, &realms))
+	ret = 0;
+    else
+	ret = krb5_get_host_realm(na->context, hostname.str, &realms);
+    __KRBStringViewRelease(&hostname);
     if (ret == 0) {
 	add_realms(na, realms, flags);
 	krb5_free_host_realm(na->context, realms);
@@ -782,115 +1102,73 @@ use_classic_kerberos(NAHRef na, unsigned long flags)
  */
 
 static void
-use_existing_principals(NAHRef na, int only_lkdc, unsigned long flags)
+use_existing_principals(NAHRef na, KRBCacheSnapshotRef snap, int only_lkdc, unsigned long flags)
 {
-    krb5_cccol_cursor cursor;
-    krb5_principal client;
     krb5_error_code ret;
     CFStringRef server;
     krb5_ccache id;
     CFStringRef u;
-    char *c;
+    time_t now = time(NULL);
+    size_t i;
 
-    ret = krb5_cccol_cursor_new(na->context, &cursor);
-    if (ret)
+    if (snap == NULL)
 	return;
 
-    while ((ret = krb5_cccol_cursor_next(na->context, cursor, &id)) == 0 && id != NULL) {
+    for (i = 0; i < snap->len; i++) {
+	const struct ccache_snapshot_entry *e = &snap->val[i];
 	NAHSelectionRef nasel;
-	int is_lkdc;
-	time_t t;
-
-	ret = krb5_cc_get_principal(na->context, id, &client);
-	if (ret) {
-	    krb5_cc_close(na->context, id);
-	    continue;
-	}
-
-	ret = krb5_cc_get_lifetime(na->context, id, &t);
-	if (ret || t <= 0) {
-	    krb5_cc_close(na->context, id);
-	    continue;
-	}
 
-	is_lkdc = krb5_principal_is_lkdc(na->context, client);
-
-	if ((only_lkdc && !is_lkdc) || (!only_lkdc && is_lkdc)) {
-	    krb5_free_principal(na->context, client);
-	    krb5_cc_close(na->context, id);
+	if (e->expire <= now)
 	    continue;
-	}
 
-	ret = krb5_unparse_name(na->context, client, &c);
-	if (ret) {
-	    krb5_free_principal(na->context, client);
-	    krb5_cc_close(na->context, id);
+	if ((only_lkdc && !e->lkdc) || (!only_lkdc && e->lkdc))
 	    continue;
-	}
 
-	u = CFStringCreateWithCString(na->alloc, c, kCFStringEncodingUTF8);
-	free(c);
-	if (u == NULL) {
-	    krb5_free_principal(na->context, client);
-	    krb5_cc_close(na->context, id);
+	u = CFStringCreateWithCString(na->alloc, e->client, kCFStringEncodingUTF8);
+	if (u == NULL)
 	    continue;
-	}
 
-	if (is_lkdc) {
+	if (e->lkdc) {
 	    CFStringRef cr = NULL;
-	    krb5_data data;
 
-	    ret = krb5_cc_get_config(na->context, id, NULL, "lkdc-hostname", &data);
-	    if (ret == 0) {
-		cr = CFStringCreateWithBytes(na->alloc, data.data, data.length, kCFStringEncodingUTF8, false);
-		krb5_data_free(&data);
-	    }
+	    if (e->lkdc_hostname)
+		cr = CFStringCreateWithCString(na->alloc, e->lkdc_hostname, kCFStringEncodingUTF8);
 
 	    if (cr == NULL || CFStringCompare(na->hostname, cr, 0) != kCFCompareEqualTo) {
-            krb5_free_principal(na->context, client);
-            krb5_cc_close(na->context, id);
-            CFRELEASE(cr);
-            CFRELEASE(u);
-            continue;
+		CFRELEASE(cr);
+		CFRELEASE(u);
+		continue;
 	    }
-        CFRELEASE(cr);
+	    CFRELEASE(cr);
 
 	    /* Create server principal */
 	    server = CFStringCreateWithFormat(na->alloc, NULL, CFSTR("%@/%s@%s"),
-					      na->service, client->realm, client->realm);
+					      na->service, e->realm, e->realm);
 
 	    os_log(na_get_oslog(), "Adding existing LKDC cache: %@ -> %@", u, server);
 
 	} else {
 	    server = CFStringCreateWithFormat(na->alloc, NULL, CFSTR("%@/%@@%s"), na->service, na->hostname,
-					      krb5_principal_get_realm(na->context, client));
+					      e->realm);
 	    os_log(na_get_oslog(), "Adding existing cache: %@ -> %@", u, server);
 	}
-	krb5_free_principal(na->context, client);
 
 	nasel = addSelection(na, u, kNAHNTKRB5Principal,
 			     server, kNAHNTKRB5PrincipalReferral, GSS_KERBEROS, NULL, flags);
 	CFRELEASE(u);
 	CFRELEASE(server);
 	if (nasel != NULL && nasel->ccache == NULL) {
-	    krb5_data data;
+	    ret = krb5_cc_resolve(na->context, e->name, &id);
+	    if (ret)
+		continue;
+
 	    nasel->ccache = id;
 	    nasel->have_cred = 1;
 
-	    if (nasel->inferredLabel == NULL) {
-		ret = krb5_cc_get_config(na->context, id, NULL, "FriendlyName", &data);
-		if (ret == 0) {
-		    nasel->inferredLabel = CFStringCreateWithBytes(na->alloc, data.data, data.length, kCFStringEncodingUTF8, false);
-		    krb5_data_free(&data);
-		}
-	    }
-
-	} else
-	    krb5_cc_close(na->context, id);
-
+	    if (nasel->inferredLabel == NULL && e->friendly_name)
+		nasel->inferredLabel = CFStringCreateWithCString(na->alloc, e->friendly_name, kCFStringEncodingUTF8);
+	}
     }
-
-    krb5_cccol_cursor_free(na->context, &cursor);
 }
 
 static CFStringRef kWELLKNOWN_LKDC = CFSTR("WELLKNOWN:COM.APPLE.LKDC");
@@ -928,34 +1206,45 @@ wellknown_lkdc(NAHRef na, enum NAHMechType mechtype, unsigned long flags)
 	if (SecIdentityCopyCertificate(identity, &cert))
 	    continue;
 
-	csstr = _CSCopyKerberosPrincipalForCertificate(cert);
-	CFRelease(cert);
-	if (csstr == NULL) {
-	    hx509_cert hxcert;
-	    char *str;
-	    int ret;
+	csstr = NAHCertCacheCopyValue(cert, CFSTR("wellknown-name"), ^(CFDataRef digest) {
+		struct krb_phase_timer phase;
+		CFStringRef name;
+		hx509_cert hxcert;
+		char *str;
+		int ret;
+
+		KRBPhaseBegin(&phase, KRB_PHASE_CERTIFICATE);
+		name = _CSCopyKerberosPrincipalForCertificate(cert);
+		if (name) {
+		    KRBPhaseEnd(&phase);
+		    return (CFTypeRef)name;
+		}
 
-	    ret = hx509_cert_init_SecFramework(na->hxctx, identity, &hxcert);
-	    if (ret)
-		continue;
+		ret = hx509_cert_init_SecFramework(na->hxctx, identity, &hxcert);
+		if (ret) {
+		    KRBPhaseEnd(&phase);
+		    return (CFTypeRef)NULL;
+		}
 
-	    ret = hx509_cert_get_appleid(na->hxctx, hxcert, &str);
-	    hx509_cert_free(hxcert);
-	    if (ret)
-		continue;
+		ret = hx509_cert_get_appleid(na->hxctx, hxcert, &str);
+		hx509_cert_free(hxcert);
+		KRBPhaseEnd(&phase);
+		if (ret)
+		    return CFRetain(kCFNull);
 
-	    u = CFStringCreateWithFormat(na->alloc, NULL, CFSTR("%s@%@"), 
-					 str, kWELLKNOWN_LKDC);
-	    krb5_xfree(str);
-	    if (u == NULL)
-		continue;
-	} else {
-	    u = CFStringCreateWithFormat(na->alloc, NULL, CFSTR("%@@%@"),
-					 csstr, kWELLKNOWN_LKDC);
-	    CFRelease(csstr);
-	    if (u == NULL)
-		continue;
-	}
+		name = CFStringCreateWithCString(NULL, str, kCFStringEncodingUTF8);
+		krb5_xfree(str);
+		return (CFTypeRef)name;
+	    });
+	CFRelease(cert);
+	if (csstr == NULL)
+	    continue;
+
+	u = CFStringCreateWithFormat(na->alloc, NULL, CFSTR("%@@%@"),
+				     csstr, kWELLKNOWN_LKDC);
+	CFRelease(csstr);
+	if (u == NULL)
+	    continue;
 
 	NAHSelectionRef nasel = addSelection(na, u, kNAHNTKRB5Principal, s, kNAHNTKRB5PrincipalReferral, mechtype, NULL, flags);
 	CFRELEASE(u);
@@ -977,6 +1266,12 @@ is_smb(NAHRef na)
     return false;
 }
 
+
+/*
+ * Work out which Kerberos selections to try and set up the contexts,
+ * the selections themselves are added by the stages in next_stage().
+ */
+
 static void
 guess_kerberos(NAHRef na)
 {
@@ -986,18 +1281,18 @@ guess_kerberos(NAHRef na)
     krb5_error_code ret;
     unsigned long flags = USE_SPNEGO;
 
-    if (nah_use_gss_uam
+    if (na->use_gss_uam
 	&& (na->password || na->x509identities)
-	&& haveMech(na, kGSSAPIMechIAKERB)
-	&& haveMech(na, kGSSAPIMechSupportsAppleLKDC))
+	&& haveMech(na, MECHBIT(GSS_KERBEROS_IAKERB))
+	&& haveMech(na, MECHBIT_APPLE_LKDC))
     {
 	/* if we support IAKERB and AppleLDKC and is not SMB (client can't handle it, rdar://problem/8437184), let go for iakerb with */
 	try_iakerb_with_lkdc = true;
-    } else if (haveMech(na, kGSSAPIMechPKU2UOID) || haveMech(na, kGSSAPIMechSupportsAppleLKDC)) {
+    } else if (haveMech(na, MECHBIT(GSS_KERBEROS_PKU2U)) || haveMech(na, MECHBIT_APPLE_LKDC)) {
 	try_wlkdc = true;
     } else if (CFStringCompare(na->service, kNAHServiceVNCServer, 0) == kCFCompareEqualTo) {
 	try_wlkdc = true;
-	if (nah_vnc_support_iakerb && (na->password || na->x509identities))
+	if (na->vnc_support_iakerb && (na->password || na->x509identities))
 	    try_iakerb_with_lkdc = true;
     }
 
@@ -1005,17 +1300,17 @@ guess_kerberos(NAHRef na)
      * If we are using an old AFP server, disable SPNEGO
      */
     if (CFStringCompare(na->service, kNAHServiceAFPServer, 0) == kCFCompareEqualTo &&
-	!haveMech(na, kGSSAPIMechSupportsAppleLKDC))
+	!haveMech(na, MECHBIT_APPLE_LKDC))
     {
 	flags &= (~USE_SPNEGO);
     }
 
     
     have_kerberos = (na->servermechs == NULL) ||
-	haveMech(na, kGSSAPIMechIAKERB) ||
-	haveMech(na, kGSSAPIMechKerberosOID) ||
-	haveMech(na, kGSSAPIMechKerberosMicrosoftOID) ||
-	haveMech(na, kGSSAPIMechPKU2UOID);
+	haveMech(na, MECHBIT(GSS_KERBEROS_IAKERB)) ||
+	haveMech(na, MECHBIT(GSS_KERBEROS)) ||
+	haveMech(na, MECHBIT_KRB5_MS) ||
+	haveMech(na, MECHBIT(GSS_KERBEROS_PKU2U));
 
     os_log(na_get_oslog(), "NAHCreate-krb: have_kerberos=%s try_iakerb_with_lkdc=%s try-wkdc=%s use-spnego=%s",
 	  have_kerberos ? "yes" : "no",
@@ -1030,66 +1325,140 @@ guess_kerberos(NAHRef na)
      *
      */
 
-    ret = krb5_init_context(&na->context);
+    ret = KRBContextPoolGetKrb5(&na->context);
     if (ret)
 	return;
 
-    ret = hx509_context_init(&na->hxctx);
+    ret = KRBContextPoolGetHx509(&na->hxctx);
     if (ret)
 	return;
 
-    /*
-     * We'll use matching LKDC credentials to this host since they are
-     * faster then public key operations.
-     */
+    na->ccsnap = KRBCopyCacheSnapshot(na->context);
 
-    use_existing_principals(na, 1, flags);
+    na->krb.flags = flags;
+    na->krb.try_wlkdc = try_wlkdc;
+    na->krb.try_iakerb_with_lkdc = try_iakerb_with_lkdc;
+    na->krb.enabled = 1;
+}
 
-    /*
-     * IAKERB with LKDC
-     */
-    
-    if (try_iakerb_with_lkdc) {
-	wellknown_lkdc(na, GSS_KERBEROS_IAKERB, flags);
+/*
+ * NTLM credentials are enumerated with gss_iter_creds() in the
+ * background while the Kerberos stages run, guess_ntlm() picks up
+ * whatever was found, waiting at most NAH_NTLM_ITER_TIMEOUT seconds
+ * from the start of the enumeration so a wedged credential store
+ * can't hang NAHCreate.
+ */
+
+#define NAH_NTLM_ITER_TIMEOUT	5
+
+struct nah_ntlm_iter {
+    _Atomic int refs;
+    dispatch_queue_t q;		/* protects names */
+    dispatch_semaphore_t done;
+    dispatch_time_t deadline;
+    CFMutableArrayRef names;
+    struct krb_phase_timer phase;
+};
+
+static void
+ntlm_iter_release(struct nah_ntlm_iter *iter)
+{
+    if (atomic_fetch_sub(&iter->refs, 1) != 1)
+	return;
+    CFRELEASE(iter->names);
+    dispatch_release(iter->done);
+    dispatch_release(iter->q);
+    free(iter);
+}
+
+static void
+ntlm_iter_start(NAHRef na)
+{
+    struct nah_ntlm_iter *iter;
+    OM_uint32 junk;
+
+    if (na->ntlm || na->x509identities || !is_smb(na) || !haveMech(na, MECHBIT(GSS_NTLM)))
+	return;
+
+    iter = calloc(1, sizeof(*iter));
+    if (iter == NULL)
+	return;
+
+    iter->q = dispatch_queue_create("com.apple.KerberosHelper.nah-ntlm", NULL);
+    iter->done = dispatch_semaphore_create(0);
+    iter->names = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    if (iter->q == NULL || iter->done == NULL || iter->names == NULL) {
+	if (iter->q)
+	    dispatch_release(iter->q);
+	if (iter->done)
+	    dispatch_release(iter->done);
+	CFRELEASE(iter->names);
+	free(iter);
+	return;
     }
-    
-    /*
-     * Wellknown:LKDC
-     */
+    iter->deadline = dispatch_time(DISPATCH_TIME_NOW, NAH_NTLM_ITER_TIMEOUT * NSEC_PER_SEC);
+    /* one for na, one for the iterator */
+    atomic_init(&iter->refs, 2);
+    na->ntlm = iter;
 
-    if (try_wlkdc)
-	wellknown_lkdc(na, GSS_KERBEROS, flags);
+    KRBPhaseBegin(&iter->phase, KRB_PHASE_NTLM_ENUM);
 
-    /*
-     * Do classic Kerberos too
-     */
+    (void)gss_iter_creds(&junk, 0, GSS_NTLM_MECHANISM, ^(gss_OID oid, gss_cred_id_t cred) {
+	    OM_uint32 min_stat;
+	    gss_name_t name = GSS_C_NO_NAME;
+	    gss_buffer_desc buffer = { 0, NULL };
 
-    if (na->password)
-	use_classic_kerberos(na, flags);
+	    if (cred == NULL) {
+		KRBPhaseEnd(&iter->phase);
+		dispatch_semaphore_signal(iter->done);
+		ntlm_iter_release(iter);
+		return;
+	    }
+
+	    gss_inquire_cred(&min_stat, cred, &name, NULL, NULL, NULL);
+	    gss_display_name(&min_stat, name, &buffer, NULL);
+	    gss_release_name(&min_stat, &name);
+
+	    CFStringRef u = CFStringCreateWithFormat(NULL, NULL, CFSTR("%.*s"),
+						     (int)buffer.length, buffer.value);
 
+	    gss_release_buffer(&min_stat, &buffer);
 
-    /*
-     * We'll use existing credentials if we have them
-     */
+	    if (u == NULL)
+		return;
+
+	    dispatch_sync(iter->q, ^{
+		    CFArrayAppendValue(iter->names, u);
+		});
+	    CFRelease(u);
+	});
+}
+
+static CFArrayRef
+ntlm_iter_copy_names(struct nah_ntlm_iter *iter)
+{
+    __block CFArrayRef names = NULL;
 
-    use_existing_principals(na, 0, flags);
+    if (dispatch_semaphore_wait(iter->done, iter->deadline) != 0)
+	os_log(na_get_oslog(), "NTLM credential enumeration timed out, using the credentials found so far");
+
+    dispatch_sync(iter->q, ^{
+	    names = CFArrayCreateCopy(NULL, iter->names);
+	});
+    return names;
 }
 
 static void
 guess_ntlm(NAHRef na)
 {
-    OM_uint32 junk;
     CFStringRef s;
     unsigned long flags = USE_SPNEGO;
 
-    if (!haveMech(na, kGSSAPIMechNTLMOID))
+    if (!haveMech(na, MECHBIT(GSS_NTLM)))
 	return;
 
-    if (na->servermechs) {
-	CFDataRef data = CFDictionaryGetValue(na->servermechs, kGSSAPIMechNTLMOID);
-	if (data && CFDataGetLength(data) == 3 && memcmp(CFDataGetBytePtr(data), "raw", 3) == 0)
-	    flags &= (~USE_SPNEGO);
-    }
+    if (haveMech(na, MECHBIT_NTLM_RAW))
+	flags &= (~USE_SPNEGO);
 
     s = CFStringCreateWithFormat(na->alloc, 0, CFSTR("%@@%@"), na->service, na->hostname);
     if (s == NULL)
@@ -1139,47 +1508,26 @@ guess_ntlm(NAHRef na)
 	}
     }
 
-    /* pick up ntlm credentials in caches */
+    /* pick up ntlm credentials in caches, enumerated by ntlm_iter_start() */
 
-    dispatch_semaphore_t sema = dispatch_semaphore_create(0);
-    if (sema == NULL)
-	goto out;
+    if (na->ntlm) {
+	CFArrayRef names = ntlm_iter_copy_names(na->ntlm);
+	CFIndex n;
 
-    (void)gss_iter_creds(&junk, 0, GSS_NTLM_MECHANISM, ^(gss_OID oid, gss_cred_id_t cred) {
-	    OM_uint32 min_stat;
-	    gss_name_t name = GSS_C_NO_NAME;
-	    gss_buffer_desc buffer = { 0, NULL };
+	ntlm_iter_release(na->ntlm);
+	na->ntlm = NULL;
 
-	    if (cred == NULL) {
-		dispatch_semaphore_signal(sema);
-		return;
-	    }
-
-	    gss_inquire_cred(&min_stat, cred, &name, NULL, NULL, NULL);
-	    gss_display_name(&min_stat, name, &buffer, NULL);
-	    gss_release_name(&min_stat, &name);
-
-	    CFStringRef u = CFStringCreateWithFormat(na->alloc, NULL, CFSTR("%.*s"),
-						     (int)buffer.length, buffer.value);
-
-	    gss_release_buffer(&min_stat, &buffer);
-	    
-	    if (u == NULL)
-		return;
-
-	    /* if we where given a name, and it matches, add it */
+	for (n = 0; names && n < CFArrayGetCount(names); n++) {
+	    CFStringRef u = CFArrayGetValueAtIndex(names, n);
 
 	    NAHSelectionRef nasel = addSelection(na, u, kNAHNTUsername, s, NULL, GSS_NTLM, NULL, flags);
-	    CFRELEASE(u);
 	    if (nasel) {
 		nasel->have_cred = 1;
 	    }
-	});
-
-    dispatch_semaphore_wait(sema, DISPATCH_TIME_FOREVER);
-    dispatch_release(sema);
+	}
+	CFRELEASE(names);
+    }
 
- out:
     CFRELEASE(s);
 }
 
@@ -1220,8 +1568,338 @@ addSecItem(CFMutableArrayRef certs, CFTypeRef item)
 
 const CFStringRef kNAHNegTokenInit = CFSTR("kNAHNegTokenInit");
 const CFStringRef kNAHUserName = CFSTR("kNAHUserName");
+/*
+ * Selections are generated in stages, in the order they end up in
+ * the selection list.  NAHCreate normally runs all of them, with
+ * kNAHLazySelections they are run by NAHGetSelectionAtIndex() only
+ * until the requested selection exists.
+ */
+
+enum {
+    STAGE_USER_SELECTIONS = 0,
+    STAGE_EXISTING_LKDC,
+    STAGE_IAKERB_LKDC,
+    STAGE_WELLKNOWN_LKDC,
+    STAGE_CLASSIC_KERBEROS,
+    STAGE_EXISTING_CACHES,
+    STAGE_NTLM,
+    STAGE_DONE
+};
+
+static bool
+next_stage(NAHRef na)
+{
+    switch (na->stage) {
+    case STAGE_USER_SELECTIONS:
+	/* runs concurrently with the Kerberos stages, see guess_ntlm() */
+	ntlm_iter_start(na);
+	add_user_selections(na);
+	break;
+    case STAGE_EXISTING_LKDC:
+	guess_kerberos(na);
+	/*
+	 * We'll use matching LKDC credentials to this host since they are
+	 * faster then public key operations.
+	 */
+	if (na->krb.enabled)
+	    use_existing_principals(na, na->ccsnap, 1, na->krb.flags);
+	break;
+    case STAGE_IAKERB_LKDC:
+	/*
+	 * IAKERB with LKDC
+	 */
+	if (na->krb.enabled && na->krb.try_iakerb_with_lkdc)
+	    wellknown_lkdc(na, GSS_KERBEROS_IAKERB, na->krb.flags);
+	break;
+    case STAGE_WELLKNOWN_LKDC:
+	/*
+	 * Wellknown:LKDC
+	 */
+	if (na->krb.enabled && na->krb.try_wlkdc)
+	    wellknown_lkdc(na, GSS_KERBEROS, na->krb.flags);
+	break;
+    case STAGE_CLASSIC_KERBEROS:
+	/*
+	 * Do classic Kerberos too
+	 */
+	if (na->krb.enabled && na->password)
+	    use_classic_kerberos(na, na->krb.flags);
+	break;
+    case STAGE_EXISTING_CACHES:
+	/*
+	 * We'll use existing credentials if we have them
+	 */
+	if (na->krb.enabled)
+	    use_existing_principals(na, na->ccsnap, 0, na->krb.flags);
+	KRBReleaseCacheSnapshot(na->ccsnap);
+	na->ccsnap = NULL;
+	break;
+    case STAGE_NTLM:
+	/* only do NTLM for SMB */
+	if (na->x509identities == NULL && is_smb(na))
+	    guess_ntlm(na);
+	break;
+    default:
+	return false;
+    }
+    na->stage++;
+    return true;
+}
+
+/*
+ * Concurrent NAHCreate calls with the same input are coalesced, the
+ * first one works out the selections and the others wait for it and
+ * get their own copies of the resulting selections.  Only eager
+ * NAHCreate calls without certificates take part.
+ */
+
+struct nah_template {
+    enum NAHMechType mech;
+    int have_cred;
+    bool spnego;
+    CFStringRef client, clienttype, server, servertype, inferredLabel;
+    SecIdentityRef certificate;
+    char *ccname;
+};
+
+/* how long a waiter trusts the leader before doing the work itself */
+#define NAH_FLIGHT_TIMEOUT 5
+
+struct nah_flight {
+    struct nah_flight *next;
+    CFStringRef key;
+    dispatch_group_t group;
+    int refs;
+    /* result, set when the group is left */
+    int ok;
+    int krb_enabled;
+    size_t len;
+    struct nah_template *val;
+};
+
+static struct {
+    dispatch_queue_t q;
+    struct nah_flight *flights;
+} nahflights;
+
+static dispatch_queue_t
+nah_flight_queue(void)
+{
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+	nahflights.q = dispatch_queue_create("com.apple.KerberosHelper.nah-flight", NULL);
+    });
+    return nahflights.q;
+}
+
+/* must be called on nahflights.q */
+static void
+nah_flight_release(struct nah_flight *f)
+{
+    size_t i;
+
+    if (--f->refs)
+	return;
+    for (i = 0; i < f->len; i++) {
+	struct nah_template *t = &f->val[i];
+	CFRELEASE(t->client);
+	CFRELEASE(t->clienttype);
+	CFRELEASE(t->server);
+	CFRELEASE(t->servertype);
+	CFRELEASE(t->inferredLabel);
+	CFRELEASE(t->certificate);
+	free(t->ccname);
+    }
+    free(f->val);
+    CFRelease(f->key);
+    dispatch_release(f->group);
+    free(f);
+}
+
+static CFStringRef
+nah_flight_key(NAHRef na)
+{
+    return CFStringCreateWithFormat(NULL, NULL, CFSTR("%@|%@|%@|%@|%s|%@|%x|%s"),
+				    na->hostname, na->service, na->username,
+				    na->specificname ? na->specificname : CFSTR(""),
+				    na->password ? "pw" : "",
+				    na->spnegoServerName ? na->spnegoServerName : CFSTR(""),
+				    na->servermechbits, na->servermechs ? "nti" : "");
+}
+
+static void
+nah_flight_copy_result(NAHRef na, struct nah_flight *f)
+{
+    NAHSelectionRef nasel;
+    krb5_ccache id;
+    size_t i;
+
+    if (f->krb_enabled) {
+	if (KRBContextPoolGetKrb5(&na->context) || KRBContextPoolGetHx509(&na->hxctx))
+	    return;
+	na->krb.enabled = 1;
+    }
+
+    for (i = 0; i < f->len; i++) {
+	struct nah_template *t = &f->val[i];
+
+	id = NULL;
+	if (t->ccname && (na->context == NULL || krb5_cc_resolve(na->context, t->ccname, &id) != 0))
+	    continue;
+
+	nasel = NAHSelectionAlloc(na);
+	if (nasel == NULL) {
+	    if (id)
+		krb5_cc_close(na->context, id);
+	    continue;
+	}
+	nasel->mech = t->mech;
+	nasel->have_cred = t->have_cred;
+	nasel->spnego = t->spnego;
+	nasel->client = CFRetain(t->client);
+	nasel->clienttype = CFRetain(t->clienttype);
+	if (t->server)
+	    nasel->server = CFRetain(t->server);
+	nasel->servertype = CFRetain(t->servertype);
+	if (t->inferredLabel)
+	    nasel->inferredLabel = CFRetain(t->inferredLabel);
+	if (t->certificate)
+	    nasel->certificate = (SecIdentityRef)CFRetain(t->certificate);
+	nasel->ccache = id;
+
+	CFArrayAppendValue(na->selections, nasel);
+	indexSelection(na, nasel);
+	CFRelease(nasel);
+    }
+}
+
+/*
+ * Returns true if na got its selections from a concurrent NAHCreate,
+ * otherwise *flight is set (or NULL if coalescing isn't possible) and
+ * must be passed to nah_flight_end() when the selections are done.
+ */
+
+static bool
+nah_flight_begin(NAHRef na, struct nah_flight **flight)
+{
+    __block struct nah_flight *f = NULL, *wait = NULL;
+    CFStringRef key;
+    bool shared = false;
+
+    *flight = NULL;
+
+    if (na->x509identities)
+	return false;
+
+    key = nah_flight_key(na);
+    if (key == NULL)
+	return false;
+
+    dispatch_sync(nah_flight_queue(), ^{
+	for (f = nahflights.flights; f != NULL; f = f->next) {
+	    if (CFEqual(f->key, key)) {
+		f->refs++;
+		wait = f;
+		f = NULL;
+		return;
+	    }
+	}
+	if ((f = calloc(1, sizeof(*f))) == NULL)
+	    return;
+	if ((f->group = dispatch_group_create()) == NULL) {
+	    free(f);
+	    f = NULL;
+	    return;
+	}
+	f->key = CFRetain(key);
+	f->refs = 1;
+	dispatch_group_enter(f->group);
+	f->next = nahflights.flights;
+	nahflights.flights = f;
+    });
+    CFRelease(key);
+
+    if (wait == NULL) {
+	*flight = f;
+	return false;
+    }
+
+    os_log(na_get_oslog(), "NAHCreate: waiting for concurrent NAHCreate of %@ %@", na->hostname, na->service);
+    if (dispatch_group_wait(wait->group, dispatch_time(DISPATCH_TIME_NOW, NAH_FLIGHT_TIMEOUT * NSEC_PER_SEC)) != 0) {
+	/* the leader is stuck, do the discovery ourself */
+	os_log(na_get_oslog(), "NAHCreate: concurrent NAHCreate of %@ %@ timed out", na->hostname, na->service);
+    } else if (wait->ok) {
+	nah_flight_copy_result(na, wait);
+	na->stage = STAGE_DONE;
+	shared = true;
+	os_log(na_get_oslog(), "NAHCreate: using %d shared selections", (int)CFArrayGetCount(na->selections));
+    }
+
+    dispatch_sync(nah_flight_queue(), ^{
+	nah_flight_release(wait);
+    });
+    return shared;
+}
+
+static void
+nah_flight_end(NAHRef na, struct nah_flight *f)
+{
+    CFIndex n, count = CFArrayGetCount(na->selections);
+    struct nah_template *val;
+    NAHSelectionRef nasel;
+    char *ccname;
+
+    val = calloc(count ? count : 1, sizeof(val[0]));
+    if (val) {
+	for (n = 0; n < count; n++) {
+	    struct nah_template *t = &val[f->len];
+
+	    nasel = (NAHSelectionRef)CFArrayGetValueAtIndex(na->selections, n);
+	    if (nasel->ccache) {
+		ccname = NULL;
+		if (krb5_cc_get_full_name(na->context, nasel->ccache, &ccname) || ccname == NULL)
+		    continue;
+		t->ccname = strdup(ccname);
+		krb5_xfree(ccname);
+		if (t->ccname == NULL)
+		    continue;
+	    }
+	    t->mech = nasel->mech;
+	    t->have_cred = nasel->have_cred;
+	    t->spnego = nasel->spnego;
+	    t->client = CFRetain(nasel->client);
+	    t->clienttype = CFRetain(nasel->clienttype);
+	    if (nasel->server)
+		t->server = CFRetain(nasel->server);
+	    t->servertype = CFRetain(nasel->servertype);
+	    if (nasel->inferredLabel)
+		t->inferredLabel = CFRetain(nasel->inferredLabel);
+	    if (nasel->certificate)
+		t->certificate = (SecIdentityRef)CFRetain(nasel->certificate);
+	    f->len++;
+	}
+	f->val = val;
+	f->krb_enabled = na->krb.enabled;
+	f->ok = 1;
+    }
+
+    dispatch_sync(nah_flight_queue(), ^{
+	struct nah_flight **prev;
+
+	for (prev = &nahflights.flights; *prev != NULL; prev = &(*prev)->next) {
+	    if (*prev == f) {
+		*prev = f->next;
+		break;
+	    }
+	}
+	dispatch_group_leave(f->group);
+	nah_flight_release(f);
+    });
+}
+
 const CFStringRef kNAHCertificates = CFSTR("kNAHCertificates");
 const CFStringRef kNAHPassword = CFSTR("kNAHPassword");
+const CFStringRef kNAHLazySelections = CFSTR("kNAHLazySelections");
 
 NAHRef
 NAHCreate(CFAllocatorRef alloc,
@@ -1230,22 +1908,25 @@ NAHCreate(CFAllocatorRef alloc,
 	  CFDictionaryRef info)
 {
     NAHRef na = NAAlloc(alloc);
+    struct nah_flight *flight = NULL;
+    struct krb_phase_timer phase;
     CFStringRef canonname = NULL;
     char *hostnamestr = NULL;
+    Boolean deconstructed;
     
-    dispatch_once(&init_globals, ^{
-	Boolean have_key = false;
-	nah_use_gss_uam = CFPreferencesGetAppBooleanValue(CFSTR("GSSEnable"), CFSTR("com.apple.NetworkAuthenticationHelper"), &have_key);
-	if (!have_key)
-	    nah_use_gss_uam = true;
-	nah_vnc_support_iakerb = CFPreferencesGetAppBooleanValue(CFSTR("VNCSupportIAKerb"), CFSTR("com.apple.NetworkAuthenticationHelper"), &have_key);
-    });
+    if (na == NULL)
+	return NULL;
+
+    nah_prefs_copy(na);
 
     os_log(na_get_oslog(), "NAHCreate: hostname=%@ service=%@", hostname, service);
     
     /* first undo the damage BrowserServices have done to the hostname */
 
-    if (_CFNetServiceDeconstructServiceName(hostname, &hostnamestr)) {
+    KRBPhaseBegin(&phase, KRB_PHASE_DECONSTRUCT);
+    deconstructed = _CFNetServiceDeconstructServiceName(hostname, &hostnamestr);
+    KRBPhaseEnd(&phase);
+    if (deconstructed) {
         canonname = CFStringCreateWithCString(na->alloc, hostnamestr, kCFStringEncodingUTF8);
         free(hostnamestr);
         if (canonname == NULL) {
@@ -1290,7 +1971,8 @@ NAHCreate(CFAllocatorRef alloc,
     }
 
     na->selections = CFArrayCreateMutable(na->alloc, 0, &kCFTypeArrayCallBacks);
-    if (na->selections == NULL) {
+    na->selectionIndex = CFDictionaryCreateMutable(na->alloc, 0, &selection_key_callbacks, NULL);
+    if (na->selections == NULL || na->selectionIndex == NULL) {
 	CFRELEASE(na);
 	return NULL;
     }
@@ -1302,8 +1984,10 @@ NAHCreate(CFAllocatorRef alloc,
 	nti = CFDictionaryGetValue(info, kNAHNegTokenInit);
 	if (nti) {
 	    na->servermechs = CFDictionaryGetValue(nti, kSPNEGONegTokenInitMechs);
-	    if (na->servermechs)
+	    if (na->servermechs) {
 		CFRetain(na->servermechs);
+		na->servermechbits = parseServerMechs(na->servermechs);
+	    }
 	    na->spnegoServerName = CFDictionaryGetValue(nti, kSPNEGONegTokenInitHintsHostname);
 	    if (na->spnegoServerName) {
 		os_log(na_get_oslog(), "NAHCreate: SPNEGO hints name %@", na->spnegoServerName);
@@ -1330,13 +2014,20 @@ NAHCreate(CFAllocatorRef alloc,
 
     /* here starts the guessing game */
 
-    add_user_selections(na);
+    if (info) {
+	CFBooleanRef lazy = CFDictionaryGetValue(info, kNAHLazySelections);
+	if (lazy && CFGetTypeID(lazy) == CFBooleanGetTypeID() && CFBooleanGetValue(lazy))
+	    return na;
+    }
+
+    if (nah_flight_begin(na, &flight))
+	return na;
 
-    guess_kerberos(na);
+    while (next_stage(na))
+	;
 
-    /* only do NTLM for SMB */
-    if (na->x509identities == NULL && is_smb(na))
-	guess_ntlm(na);
+    if (flight)
+	nah_flight_end(na, flight);
 
     return na;
 }
@@ -1344,11 +2035,34 @@ NAHCreate(CFAllocatorRef alloc,
 CFArrayRef
 NAHGetSelections(NAHRef na)
 {
+    dispatch_sync(na->q, ^{
+	    while (next_stage(na))
+		;
+	});
     return na->selections;
 }
 
+NAHSelectionRef
+NAHGetSelectionAtIndex(NAHRef na, CFIndex idx)
+{
+    __block NAHSelectionRef nasel = NULL;
+
+    if (idx < 0)
+	return NULL;
+
+    dispatch_sync(na->q, ^{
+	    while (CFArrayGetCount(na->selections) <= idx && next_stage(na))
+		;
+	    if (idx < CFArrayGetCount(na->selections))
+		nasel = (NAHSelectionRef)CFArrayGetValueAtIndex(na->selections, idx);
+	});
+
+    return nasel;
+}
+
 static void
 setFriendlyName(NAHRef na,
+		krb5_context context,
 		NAHSelectionRef selection,
 		krb5_ccache id,
 		int is_lkdc)
@@ -1372,15 +2086,22 @@ setFriendlyName(NAHRef na,
 	    data.data = label;
 	    data.length = strlen(label) + 1;
 
-	    krb5_cc_set_config(na->context, id, NULL, "FriendlyName", &data);
+	    krb5_cc_set_config(context, id, NULL, "FriendlyName", &data);
 	    free(label);
 	}
 	selection->inferredLabel = inferredLabel;
     }
 }
 
+/*
+ * context and hxctx are the caller's own, not na's, since several
+ * selections of one NAH may be acquired at the same time.
+ */
+
 static int
 acquire_kerberos(NAHRef na,
+		 krb5_context context,
+		 hx509_context hxctx,
 		 NAHSelectionRef selection,
 		 CFStringRef password,
 		 SecIdentityRef cert,
@@ -1393,6 +2114,8 @@ acquire_kerberos(NAHRef na,
     krb5_ccache id = NULL;
     krb5_error_code ret;
     krb5_creds cred;
+    __KRBStringView view;
+    struct krb_phase_timer phase;
     char *str = NULL;
     int parseflags = 0;
     int is_lkdc = 0;
@@ -1404,37 +2127,39 @@ acquire_kerberos(NAHRef na,
 	  password ? "yes" : "no",
 	  cert ? "yes" : "no");
 
-    ret = __KRBCreateUTF8StringFromCFString(selection->client, &str);
-    if (ret)
+    if (__KRBStringViewInit(&view, selection->client) == NULL) {
+	__KRBStringViewRelease(&view);
+	ret = ENOMEM;
 	goto out;
+    }
 
     /*
      * Check if this is an enterprise name
      * XXX horrible, caller should tell us
      */
     {
-	char *p = strchr(str, '@');
+	const char *p = strchr(view.str, '@');
 	if (p && (p = strchr(p + 1, '@')) != NULL)
 	    parseflags |= KRB5_PRINCIPAL_PARSE_ENTERPRISE;
     }
 
-    ret = krb5_parse_name_flags(na->context, str, parseflags, &client);
-    __KRBReleaseUTF8String(str);
+    ret = krb5_parse_name_flags(context, view.str, parseflags, &client);
+    __KRBStringViewRelease(&view);
     if (ret)
 	goto out;
 
-    ret = krb5_unparse_name(na->context, client, &str);
+    ret = krb5_unparse_name(context, client, &str);
     if (ret == 0) {
 	os_log(na_get_oslog(), "acquire_kerberos: trying with %s as client principal", str);
 	free(str);
     }
 
-    ret = krb5_get_init_creds_opt_alloc(na->context, &opt);
+    ret = krb5_get_init_creds_opt_alloc(context, &opt);
     if (ret)
 	goto out;
 
     if (cert) {
-	ret = krb5_get_init_creds_opt_set_pkinit(na->context, opt, client,
+	ret = krb5_get_init_creds_opt_set_pkinit(context, opt, client,
 						 NULL, "KEYCHAIN:",
 						 NULL, NULL, 0,
 						 NULL, NULL, NULL);
@@ -1442,79 +2167,86 @@ acquire_kerberos(NAHRef na,
 	    goto out;
     }
 
-    krb5_get_init_creds_opt_set_canonicalize(na->context, opt, TRUE);
-    krb5_get_init_creds_opt_set_win2k(na->context, opt, TRUE);
+    krb5_get_init_creds_opt_set_canonicalize(context, opt, TRUE);
+    krb5_get_init_creds_opt_set_win2k(context, opt, TRUE);
 
-    ret = krb5_init_creds_init(na->context, client, NULL, NULL,
+    ret = krb5_init_creds_init(context, client, NULL, NULL,
 			       0, opt, &icc);
     if (ret)
 	goto out;
 
-    if (krb5_principal_is_lkdc(na->context, client)) {
+    if (krb5_principal_is_lkdc(context, client)) {
         char *tcphostname = NULL;
 
-	ret = __KRBCreateUTF8StringFromCFString(na->hostname, &str);
-	if (ret)
+	if (__KRBStringViewInit(&view, na->hostname) == NULL) {
+	    __KRBStringViewRelease(&view);
+	    ret = ENOMEM;
 	    goto out;
-	asprintf(&tcphostname, "tcp/%s", str);
-	__KRBReleaseUTF8String(str);
+	}
+	asprintf(&tcphostname, "tcp/%s", view.str);
+	__KRBStringViewRelease(&view);
 	if (tcphostname == NULL) {
 	    ret = ENOMEM;
 	    goto out;
 	}
-	krb5_init_creds_set_kdc_hostname(na->context, icc, tcphostname);
+	krb5_init_creds_set_kdc_hostname(context, icc, tcphostname);
 	free(tcphostname);
     }
 
     if (cert) {
 	hx509_cert hxcert;
 
-	ret = hx509_cert_init_SecFramework(na->hxctx, cert, &hxcert);
+	ret = hx509_cert_init_SecFramework(hxctx, cert, &hxcert);
 	if (ret)
 	    goto out;
 
-	ret = krb5_init_creds_set_pkinit_client_cert(na->context, icc, hxcert);
+	ret = krb5_init_creds_set_pkinit_client_cert(context, icc, hxcert);
 	hx509_cert_free(hxcert);
 	if (ret)
 	    goto out;
 
     } else if (password) {
-	ret = __KRBCreateUTF8StringFromCFString(password, &str);
-	if (ret)
+	if (__KRBStringViewInit(&view, password) == NULL) {
+	    __KRBStringViewRelease(&view);
+	    ret = ENOMEM;
 	    goto out;
-	ret = krb5_init_creds_set_password(na->context, icc, str);
-	__KRBReleaseUTF8String(str);
+	}
+	ret = krb5_init_creds_set_password(context, icc, view.str);
+	__KRBStringViewRelease(&view);
 	if (ret)
 	    goto out;
     } else {
 	abort();
     }
 
-    ret = krb5_init_creds_get(na->context, icc);
+    KRBPhaseBegin(&phase, KRB_PHASE_AS_EXCHANGE);
+    ret = krb5_init_creds_get(context, icc);
+    KRBPhaseEnd(&phase);
     if (ret)
 	goto out;
 
-    ret = krb5_init_creds_get_creds(na->context, icc, &cred);
+    ret = krb5_init_creds_get_creds(context, icc, &cred);
     if (ret)
 	goto out;
 
-    ret = krb5_cc_cache_match(na->context, cred.client, &id);
+    ret = krb5_cc_cache_match(context, cred.client, &id);
     if (ret) {
-	ret = krb5_cc_new_unique(na->context, NULL, NULL, &id);
+	ret = krb5_cc_new_unique(context, NULL, NULL, &id);
 	if (ret)
 	    goto out;
 	destroy_cache = 1;
     }
 
-    ret = krb5_cc_initialize(na->context, id, cred.client);
+    ret = krb5_cc_initialize(context, id, cred.client);
     if (ret)
 	goto out;
 
-    ret = krb5_cc_store_cred(na->context, id, &cred);
+    ret = krb5_cc_store_cred(context, id, &cred);
     if (ret)
 	goto out;
+    KRBInvalidateCacheSnapshot();
 
-    ret = krb5_init_creds_store_config(na->context, icc, id);
+    ret = krb5_init_creds_store_config(context, icc, id);
     if (ret)
 	goto out;
 
@@ -1522,11 +2254,11 @@ acquire_kerberos(NAHRef na,
 
     {
 	CFStringRef newclient, newserver;
-	const char *realm = krb5_principal_get_realm(na->context, cred.client);
+	const char *realm = krb5_principal_get_realm(context, cred.client);
 
 	is_lkdc = krb5_realm_is_lkdc(realm);
 
-	ret = krb5_unparse_name(na->context, cred.client, &str);
+	ret = krb5_unparse_name(context, cred.client, &str);
 	if (ret)
 	    goto out;
 
@@ -1560,41 +2292,52 @@ acquire_kerberos(NAHRef na,
 	}
     }
 
-    setFriendlyName(na, selection, id, is_lkdc);
+    setFriendlyName(na, context, selection, id, is_lkdc);
     {
 	krb5_data data;
 	data.data = "1";
 	data.length = 1;
-	krb5_cc_set_config(na->context, id, NULL, nah_created, &data);
+	krb5_cc_set_config(context, id, NULL, nah_created, &data);
     }
 
+    /* remember caches we made so a losing NAHAcquireFirstCredentialAsync can remove them */
+    if (destroy_cache) {
+	char *fullname = NULL;
+
+	free(selection->acquired_ccname);
+	selection->acquired_ccname = NULL;
+	if (krb5_cc_get_full_name(context, id, &fullname) == 0 && fullname) {
+	    selection->acquired_ccname = strdup(fullname);
+	    krb5_xfree(fullname);
+	}
+    }
 
  out:
     if (ret) {
-	const char *e = krb5_get_error_message(na->context, ret);
+	const char *e = krb5_get_error_message(context, ret);
 	updateError(NULL, error, ret, CFSTR("acquire_kerberos failed %@: %d - %s"),
 	      selection->client, ret, e);
-	krb5_free_error_message(na->context, e);
+	krb5_free_error_message(context, e);
     } else {
 	os_log(na_get_oslog(), "acquire_kerberos successful");
     }
 
     if (opt)
-	krb5_get_init_creds_opt_free(na->context, opt);
+	krb5_get_init_creds_opt_free(context, opt);
 
     if (icc)
-	krb5_init_creds_free(na->context, icc);
+	krb5_init_creds_free(context, icc);
 
     if (id) {
 	if (ret != 0 && destroy_cache)
-	    krb5_cc_destroy(na->context, id);
+	    krb5_cc_destroy(context, id);
 	else
-	    krb5_cc_close(na->context, id);
+	    krb5_cc_close(context, id);
     }
-    krb5_free_cred_contents(na->context, &cred);
+    krb5_free_cred_contents(context, &cred);
 
     if (client)
-	krb5_free_principal(na->context, client);
+	krb5_free_principal(context, client);
 
     return ret;
 }
@@ -1640,16 +2383,16 @@ NAHSelectionAcquireCredentialAsync(NAHSelectionRef selection,
 static void
 setGSSLabel(gss_cred_id_t cred, const char *label, CFStringRef value)
 {
+    __KRBStringView view;
     gss_buffer_desc buf;
     OM_uint32 junk;
 
-    buf.value = cf2cstring(value);
-    if (buf.value == NULL)
-	return;
-    buf.length = strlen((char *)buf.value);
-
-    gss_cred_label_set(&junk, cred, label, &buf);
-    free(buf.value);
+    buf.value = (void *)__KRBStringViewInit(&view, value);
+    if (buf.value != NULL) {
+	buf.length = view.len;
+	gss_cred_label_set(&junk, cred, label, &buf);
+    }
+    __KRBStringViewRelease(&view);
 }
 
 
@@ -1663,6 +2406,11 @@ NAHSelectionAcquireCredential(NAHSelectionRef selection,
     if (error)
 	*error = NULL;
 
+    if (selection->na == NULL || selection->na->cancelled) {
+	updateError(NULL, error, ECANCELED, CFSTR("canceled"));
+	return false;
+    }
+
     CFRetain(selection->na);
 
     if (selection->mech == GSS_KERBEROS) {
@@ -1684,13 +2432,25 @@ NAHSelectionAcquireCredential(NAHSelectionRef selection,
 	    return false;
 	}
 
+	krb5_context context = NULL;
+	hx509_context hxctx = NULL;
 	int ret;
 
-	ret = acquire_kerberos(selection->na,
-			       selection,
-			       selection->na->password,
-			       selection->certificate,
-			       error);
+	ret = KRBContextPoolGetKrb5(&context);
+	if (ret == 0)
+	    ret = KRBContextPoolGetHx509(&hxctx);
+	if (ret == 0)
+	    ret = acquire_kerberos(selection->na,
+				   context,
+				   hxctx,
+				   selection,
+				   selection->na->password,
+				   selection->certificate,
+				   error);
+	else
+	    updateError(NULL, error, ret, CFSTR("failed to get kerberos context"));
+	KRBContextPoolPutHx509(hxctx);
+	KRBContextPoolPutKrb5(context);
 
 	CFRelease(selection->na);
 	if (ret && error && *error)
@@ -1701,7 +2461,6 @@ NAHSelectionAcquireCredential(NAHSelectionRef selection,
     } else if (selection->mech == GSS_NTLM) {
 	gss_auth_identity_desc identity;
 	gss_name_t name = GSS_C_NO_NAME;
-	gss_buffer_desc gbuf;
 	char *password, *user;
 	OM_uint32 major, minor, junk;
 	dispatch_semaphore_t s;
@@ -1719,13 +2478,7 @@ NAHSelectionAcquireCredential(NAHSelectionRef selection,
 	    return false;
 	}
 
-	__KRBCreateUTF8StringFromCFString(selection->client, &user);
-
-	gbuf.value = user;
-	gbuf.length = strlen(user);
-
-	major = gss_import_name(&minor, &gbuf, GSS_C_NT_USER_NAME, &name);
-	__KRBReleaseUTF8String(user);
+	major = import_cfname(&minor, selection->client, GSS_C_NT_USER_NAME, &name);
 	if (major) {
 	    CFRelease(selection->na);
 	    return false;
@@ -1797,8 +2550,6 @@ NAHSelectionAcquireCredential(NAHSelectionRef selection,
 	return true;
     } else if (selection->mech == GSS_KERBEROS_IAKERB) {
 	gss_name_t name = GSS_C_NO_NAME;
-	gss_buffer_desc gbuf;
-	char *user;
 	OM_uint32 major, minor, junk;
 	gss_cred_id_t cred;
 
@@ -1817,13 +2568,7 @@ NAHSelectionAcquireCredential(NAHSelectionRef selection,
 	    return false;
 	}
 
-	__KRBCreateUTF8StringFromCFString(selection->client, &user);
-
-	gbuf.value = user;
-	gbuf.length = strlen(user);
-
-	major = gss_import_name(&minor, &gbuf, GSS_C_NT_USER_NAME, &name);
-	__KRBReleaseUTF8String(user);
+	major = import_cfname(&minor, selection->client, GSS_C_NT_USER_NAME, &name);
 	if (major) {
 	    CFRelease(selection->na);
 	    return false;
@@ -1858,6 +2603,7 @@ NAHSelectionAcquireCredential(NAHSelectionRef selection,
 
 	setGSSLabel(cred, "FriendlyName", selection->inferredLabel);
 	setGSSLabel(cred, "lkdc-hostname", selection->na->hostname);
+	KRBInvalidateCacheSnapshot();
 
 	{
 	    gss_buffer_set_t dataset = GSS_C_NO_BUFFER_SET;
@@ -2007,127 +2753,625 @@ NAHSelectionCopyAuthInfo(NAHSelectionRef selection)
  *
  */
 
-void
-NAHCancel(NAHRef na)
-{
-}
-
 /*
- * Reference counting
+ * Acquire credentials for several selections at once, the first
+ * selection (in selection order) that succeeds wins.  At most
+ * NAH_ACQUIRE_WIDTH acquisitions are in flight; when one fails the
+ * next selection is started.
  */
 
+#define NAH_ACQUIRE_WIDTH 3
 
-static Boolean
-CredChange(CFStringRef referenceKey, int count, const char *label)
-{
-    const char *mechname;
-    gss_OID nametype;
-    gss_OID oid;
+enum { RACE_PENDING = 0, RACE_RUNNING, RACE_OK, RACE_FAILED };
 
-    if (referenceKey == NULL)
-	return false;
+struct acquire_race {
+    NAHRef na;
+    CFDictionaryRef info;
+    dispatch_queue_t q;		/* protects the fields below */
+    dispatch_queue_t resultq;
+    void (^result)(NAHSelectionRef, CFErrorRef);
+    CFIndex next;		/* next selection to start */
+    CFIndex running;
+    bool done;
+    CFErrorRef error;		/* error from the first failed selection */
+    struct acquire_racer {
+	NAHSelectionRef selection;
+	int state;
+	bool had_ccache;
+    } *racers;
+    CFIndex len;
+};
 
-    os_log(na_get_oslog(), "NAHCredChange: %@ count: %d label: %s",
-	  referenceKey, count, label ? label : "<nolabel>");
+static void race_start_more(struct acquire_race *race);
 
-    if (CFStringHasPrefix(referenceKey, CFSTR("krb5:"))) {
-	oid = GSS_KRB5_MECHANISM;
-	nametype = GSS_C_NT_USER_NAME;
-	mechname = "kerberos";
-    } else if (CFStringHasPrefix(referenceKey, CFSTR("uuid:"))) {
-	oid = NULL;
-	nametype = GSS_C_NT_UUID;
-	mechname = "uuid";
-    } else if (CFStringHasPrefix(referenceKey, CFSTR("ntlm:"))) {
-	oid = GSS_NTLM_MECHANISM;
-	nametype = GSS_C_NT_USER_NAME;
-	mechname = "ntlm";
-    } else
-	return false;
+static void
+race_free(struct acquire_race *race)
+{
+    CFRELEASE(race->error);
+    CFRELEASE(race->info);
+    dispatch_release(race->q);
+    dispatch_release(race->resultq);
+    Block_release(race->result);
+    free(race->racers);
+    CFRelease(race->na);
+    free(race);
+}
 
-    {
-	gss_cred_id_t cred;
-	gss_buffer_desc gbuf;
-	OM_uint32 min_stat, maj_stat;
-	CFStringRef name;
-	gss_name_t gname;
-	OSStatus ret;
-	gss_OID_set_desc mechset;
-	char *n;
-
-	if (oid) {
-	    mechset.elements = oid;
-	    mechset.count = 1;
+/*
+ * Undo what a losing selection did: drop the reference it took on an
+ * existing cache, or destroy the cache it acquired.
+ */
+static void
+race_drop_loser(struct acquire_race *race, struct acquire_racer *r)
+{
+    NAHSelectionRef selection = r->selection;
+    krb5_context context;
+    krb5_ccache id;
+
+    if (r->had_ccache) {
+	KRBCredChangeReferenceCount(selection->client, -1, 1);
+    } else if (selection->mech == GSS_KERBEROS && selection->acquired_ccname) {
+	os_log(na_get_oslog(), "NAHAcquireFirstCredentialAsync: removing losing credential %@", selection->client);
+	/* other racers may still be using theirs, so borrow our own */
+	if (KRBContextPoolGetKrb5(&context) == 0) {
+	    if (krb5_cc_resolve(context, selection->acquired_ccname, &id) == 0) {
+		krb5_cc_destroy(context, id);
+		KRBInvalidateCacheSnapshot();
+	    }
+	    KRBContextPoolPutKrb5(context);
 	}
+	free(selection->acquired_ccname);
+	selection->acquired_ccname = NULL;
+    }
+}
 
-	name = CFStringCreateWithSubstring(NULL, referenceKey, CFRangeMake(5, CFStringGetLength(referenceKey) - 5));
-	if (name == NULL)
-	    return false;
+static void
+race_report(struct acquire_race *race, NAHSelectionRef selection)
+{
+    CFErrorRef error = NULL;
+
+    race->done = true;
+
+    if (selection == NULL) {
+	error = race->error;
+	race->error = NULL;
+	if (race->na->cancelled)
+	    CFRELEASE(error);
+	if (error == NULL && race->na->cancelled)
+	    updateError(NULL, &error, ECANCELED, CFSTR("canceled"));
+	else if (error == NULL)
+	    updateError(NULL, &error, ENOENT, CFSTR("no selection could acquire a credential"));
+    }
 
-	ret = __KRBCreateUTF8StringFromCFString(name, &n);
-	CFRelease(name);
-	if (ret)
-	    return false;
+    os_log(na_get_oslog(), "NAHAcquireFirstCredentialAsync: done: %@", selection ? selection->client : CFSTR("no credential"));
 
-	gbuf.value = n;
-	gbuf.length = strlen(n);
+    /* the race might be freed before the result is delivered */
+    void (^r)(NAHSelectionRef, CFErrorRef) = Block_copy(race->result);
+    NAHRef na = (NAHRef)CFRetain(race->na);
 
-	maj_stat = gss_import_name(&min_stat, &gbuf, nametype, &gname);
-	if (maj_stat != GSS_S_COMPLETE) {
-	    os_log(na_get_oslog(), "ChangeCred: name not importable %s/%s", n, mechname);
-	    free(n);
-	    return false;
-	}
+    dispatch_async(race->resultq, ^{
+	    r(selection, error);
+	    if (error)
+		CFRelease(error);
+	    Block_release(r);
+	    CFRelease(na);
+	});
+}
 
-	maj_stat = gss_acquire_cred(&min_stat, gname, GSS_C_INDEFINITE, oid ? &mechset : NULL, GSS_C_INITIATE, &cred, NULL, NULL);
-	gss_release_name(&min_stat, &gname);
+/* called on race->q when an acquisition finished */
+static void
+race_complete(struct acquire_race *race, CFIndex n, Boolean res, CFErrorRef e)
+{
+    CFIndex i, winner = -1;
+    /* the NTLM case returns true with an error when it failed */
+    bool ok = res && e == NULL;
 
-	if (maj_stat != GSS_S_COMPLETE) {
-	    os_log(na_get_oslog(), "ChangeCred: cred name %s/%s not found", n, mechname);
-	    free(n);
-	    return false;
-	}
-	free(n);
+    race->running--;
+    race->racers[n].state = ok ? RACE_OK : RACE_FAILED;
 
-	/* check that the credential is refcounted */
-	{
-	    gss_buffer_desc buffer;
-	    maj_stat = gss_cred_label_get(&min_stat, cred, nah_created, &buffer);
-	    if (maj_stat) {
-		gss_release_cred(&min_stat, &cred);
-		return false;
+    if (race->done) {
+	if (ok)
+	    race_drop_loser(race, &race->racers[n]);
+    } else {
+	if (!ok && e && race->error == NULL) {
+	    race->error = e;
+	    CFRetain(e);
+	}
+	/* the highest priority selection that is not still running decides */
+	for (i = 0; i < race->len; i++) {
+	    int state = race->racers[i].state;
+	    if (state == RACE_FAILED)
+		continue;
+	    if (state == RACE_OK) {
+		winner = i;
+		race_report(race, race->racers[i].selection);
 	    }
-	    gss_release_buffer(&min_stat, &buffer);
+	    break;
 	}
+	if (!race->done)
+	    race_start_more(race);
+	/* selections that finished but lost, or finished before a cancel */
+	if (race->done) {
+	    for (i = 0; i < race->len; i++)
+		if (i != winner && race->racers[i].state == RACE_OK)
+		    race_drop_loser(race, &race->racers[i]);
+	}
+    }
 
-	if (count == 0) {
-	    /* do nothing */
-	} else if (count > 0) {
-	    gss_cred_hold(&min_stat, cred);
-	} else {
-	    gss_cred_unhold(&min_stat, cred);
+    if (race->done && race->running == 0)
+	race_free(race);
+}
+
+/* called on race->q */
+static void
+race_start_more(struct acquire_race *race)
+{
+    while (race->running < NAH_ACQUIRE_WIDTH && !race->done) {
+	NAHSelectionRef selection;
+	struct acquire_racer *r;
+	CFIndex n;
+
+	if (race->na->cancelled) {
+	    race_report(race, NULL);
+	    break;
 	}
 
-	if (label) {
-	    gss_buffer_desc buffer = {
-		.value = "1",
-		.length = 1
-	    };
+	selection = NAHGetSelectionAtIndex(race->na, race->next);
+	if (selection == NULL) {
+	    /* nothing left to start, report if nothing is running either */
+	    if (race->running == 0)
+		race_report(race, NULL);
+	    break;
+	}
 
-	    gss_cred_label_set(&min_stat, cred, label, &buffer);
+	if (race->len <= race->next) {
+	    r = realloc(race->racers, sizeof(race->racers[0]) * (race->next + 1));
+	    if (r == NULL) {
+		if (race->running == 0)
+		    race_report(race, NULL);
+		break;
+	    }
+	    race->racers = r;
+	    race->len = race->next + 1;
 	}
 
-	gss_release_cred(&min_stat, &cred);
-	return true;
+	n = race->next++;
+	r = &race->racers[n];
+	r->selection = selection;
+	r->state = RACE_RUNNING;
+	r->had_ccache = (selection->mech == GSS_KERBEROS && selection->ccache != NULL);
+	race->running++;
+
+	dispatch_async(race->na->bgq, ^{
+		CFErrorRef e = NULL;
+		Boolean res;
+
+		res = NAHSelectionAcquireCredential(selection, race->info, &e);
+
+		dispatch_async(race->q, ^{
+			race_complete(race, n, res, e);
+			if (e)
+			    CFRelease(e);
+		    });
+	    });
     }
 }
 
-char *
-NAHCreateRefLabelFromIdentifier(CFStringRef identifier)
+Boolean
+NAHAcquireFirstCredentialAsync(NAHRef na,
+			       CFDictionaryRef info,
+			       dispatch_queue_t q,
+			       void (^result)(NAHSelectionRef selection, CFErrorRef error))
 {
-    CFStringRef str = CFStringCreateWithFormat(NULL, NULL, CFSTR("reference-label:%@"), identifier);
-    OSStatus ret;
-    char *label;
+    struct acquire_race *race;
+
+    race = calloc(1, sizeof(*race));
+    if (race == NULL)
+	return false;
+
+    race->na = (NAHRef)CFRetain(na);
+    if (info)
+	race->info = CFRetain(info);
+    race->q = dispatch_queue_create("network-authentication-acquire", NULL);
+    race->resultq = q;
+    dispatch_retain(q);
+    race->result = Block_copy(result);
+
+    dispatch_async(race->q, ^{
+	    race_start_more(race);
+	    if (race->done && race->running == 0)
+		race_free(race);
+	});
+
+    return true;
+}
+
+/*
+ * Selections that haven't started acquiring credentials yet will
+ * fail, acquisitions that are already talking to the KDC run to
+ * completion but their result is dropped by
+ * NAHAcquireFirstCredentialAsync.
+ */
+
+void
+NAHCancel(NAHRef na)
+{
+    na->cancelled = 1;
+}
+
+/*
+ * Prefetch, warm the shared caches for hosts that are going to be
+ * used soon.  The hosts are looked up with KRBCreateSessionInfoAsync,
+ * at most NAH_PREFETCH_WIDTH at the time, and whatever hasn't
+ * finished when the deadline passes is cancelled.
+ */
+
+#define NAH_PREFETCH_WIDTH	4
+#define NAH_PREFETCH_TIMEOUT	10.0
+
+const CFStringRef kNAHPrefetchTimeout = CFSTR("kNAHPrefetchTimeout");
+
+struct prefetch {
+    dispatch_queue_t q;
+    dispatch_source_t timer;
+    CFArrayRef hostnames;
+    CFNumberRef timeout;
+    CFIndex count, next, running, done;
+    KRBSessionRequestRef req[NAH_PREFETCH_WIDTH];
+    int expired;
+};
+
+static void
+prefetch_free(struct prefetch *p)
+{
+    os_log(na_get_oslog(), "NAHPrefetch: done, %d of %d hosts looked up%s",
+	   (int)p->done, (int)p->count, p->expired ? ", deadline passed" : "");
+
+    dispatch_source_cancel(p->timer);
+    dispatch_release(p->timer);
+    CFRelease(p->hostnames);
+    CFRelease(p->timeout);
+    dispatch_release(p->q);
+    free(p);
+}
+
+/* must be called on p->q */
+static void
+prefetch_start_more(struct prefetch *p)
+{
+    while (!p->expired && p->running < NAH_PREFETCH_WIDTH && p->next < p->count) {
+	CFStringRef hostname = CFArrayGetValueAtIndex(p->hostnames, p->next++);
+	CFMutableDictionaryRef dict;
+	KRBSessionRequestRef req;
+	size_t slot;
+
+	if (hostname == NULL || CFGetTypeID(hostname) != CFStringGetTypeID())
+	    continue;
+
+	for (slot = 0; slot < NAH_PREFETCH_WIDTH; slot++)
+	    if (p->req[slot] == NULL)
+		break;
+
+	dict = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	if (dict == NULL)
+	    continue;
+	CFDictionarySetValue(dict, kKRBHostnameKey, hostname);
+	CFDictionarySetValue(dict, kKRBReverseLookupTimeoutKey, p->timeout);
+
+	req = KRBCreateSessionInfoAsync(dict, p->q, ^(OSStatus err, KRBHelperContextRef session) {
+		if (session) {
+		    KRBCloseSession(session);
+		    p->done++;
+		}
+		KRBReleaseSessionRequest(p->req[slot]);
+		p->req[slot] = NULL;
+		p->running--;
+
+		prefetch_start_more(p);
+		if (p->running == 0)
+		    prefetch_free(p);
+	    });
+	CFRelease(dict);
+	if (req == NULL)
+	    continue;
+
+	p->req[slot] = req;
+	p->running++;
+    }
+}
+
+void
+NAHPrefetch(CFArrayRef hostnames, CFStringRef service, CFDictionaryRef info)
+{
+    double timeout = NAH_PREFETCH_TIMEOUT;
+    struct prefetch *p;
+
+    if (hostnames == NULL || CFArrayGetCount(hostnames) == 0)
+	return;
+
+    if (info) {
+	CFNumberRef num = CFDictionaryGetValue(info, kNAHPrefetchTimeout);
+	if (num && CFGetTypeID(num) == CFNumberGetTypeID())
+	    CFNumberGetValue(num, kCFNumberDoubleType, &timeout);
+    }
+
+    os_log(na_get_oslog(), "NAHPrefetch: %d hosts for service %@ within %d seconds",
+	   (int)CFArrayGetCount(hostnames), service, (int)timeout);
+
+    p = calloc(1, sizeof(*p));
+    if (p == NULL)
+	return;
+
+    p->count = CFArrayGetCount(hostnames);
+    p->hostnames = CFArrayCreateCopy(NULL, hostnames);
+    p->timeout = CFNumberCreate(NULL, kCFNumberDoubleType, &timeout);
+    p->q = dispatch_queue_create("com.apple.KerberosHelper.prefetch", NULL);
+    p->timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, p->q);
+    if (p->hostnames == NULL || p->timeout == NULL || p->q == NULL || p->timer == NULL) {
+	CFRELEASE(p->hostnames);
+	CFRELEASE(p->timeout);
+	if (p->timer)
+	    dispatch_release(p->timer);
+	if (p->q)
+	    dispatch_release(p->q);
+	free(p);
+	return;
+    }
+
+    /* stop starting new lookups and cancel the running ones at the deadline */
+    dispatch_source_set_timer(p->timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC)),
+			      DISPATCH_TIME_FOREVER, NSEC_PER_SEC / 10);
+    dispatch_source_set_event_handler(p->timer, ^{
+	    size_t n;
+
+	    p->expired = 1;
+	    for (n = 0; n < NAH_PREFETCH_WIDTH; n++)
+		KRBCancelSessionRequest(p->req[n]);
+	});
+    dispatch_resume(p->timer);
+
+    /* the credential cache snapshot is shared with NAHCreate */
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+	    krb5_context context;
+
+	    if (KRBContextPoolGetKrb5(&context))
+		return;
+	    KRBReleaseCacheSnapshot(KRBCopyCacheSnapshot(context));
+	    KRBContextPoolPutKrb5(context);
+	});
+
+    dispatch_async(p->q, ^{
+	    prefetch_start_more(p);
+	    if (p->running == 0)
+		prefetch_free(p);
+	});
+}
+
+/*
+ * Reference counting
+ */
+
+
+/*
+ * Find the credential for a reference key ("krb5:", "uuid:" or
+ * "ntlm:" followed by the name), only credentials created by NAH are
+ * reference counted.
+ */
+
+static gss_cred_id_t
+copyRefcountedCred(CFStringRef referenceKey)
+{
+    const char *mechname;
+    gss_OID nametype;
+    gss_OID oid;
+    gss_cred_id_t cred;
+    OM_uint32 min_stat, maj_stat;
+    CFStringRef name;
+    gss_name_t gname;
+    gss_OID_set_desc mechset;
+
+    if (CFStringHasPrefix(referenceKey, CFSTR("krb5:"))) {
+	oid = GSS_KRB5_MECHANISM;
+	nametype = GSS_C_NT_USER_NAME;
+	mechname = "kerberos";
+    } else if (CFStringHasPrefix(referenceKey, CFSTR("uuid:"))) {
+	oid = NULL;
+	nametype = GSS_C_NT_UUID;
+	mechname = "uuid";
+    } else if (CFStringHasPrefix(referenceKey, CFSTR("ntlm:"))) {
+	oid = GSS_NTLM_MECHANISM;
+	nametype = GSS_C_NT_USER_NAME;
+	mechname = "ntlm";
+    } else
+	return GSS_C_NO_CREDENTIAL;
+
+    if (oid) {
+	mechset.elements = oid;
+	mechset.count = 1;
+    }
+
+    name = CFStringCreateWithSubstring(NULL, referenceKey, CFRangeMake(5, CFStringGetLength(referenceKey) - 5));
+    if (name == NULL)
+	return GSS_C_NO_CREDENTIAL;
+
+    maj_stat = import_cfname(&min_stat, name, nametype, &gname);
+    if (maj_stat != GSS_S_COMPLETE) {
+	os_log(na_get_oslog(), "ChangeCred: name not importable %@/%s", name, mechname);
+	CFRelease(name);
+	return GSS_C_NO_CREDENTIAL;
+    }
+
+    maj_stat = gss_acquire_cred(&min_stat, gname, GSS_C_INDEFINITE, oid ? &mechset : NULL, GSS_C_INITIATE, &cred, NULL, NULL);
+    gss_release_name(&min_stat, &gname);
+
+    if (maj_stat != GSS_S_COMPLETE) {
+	os_log(na_get_oslog(), "ChangeCred: cred name %@/%s not found", name, mechname);
+	CFRelease(name);
+	return GSS_C_NO_CREDENTIAL;
+    }
+    CFRelease(name);
+
+    /* check that the credential is refcounted */
+    {
+	gss_buffer_desc buffer;
+	maj_stat = gss_cred_label_get(&min_stat, cred, nah_created, &buffer);
+	if (maj_stat) {
+	    gss_release_cred(&min_stat, &cred);
+	    return GSS_C_NO_CREDENTIAL;
+	}
+	gss_release_buffer(&min_stat, &buffer);
+    }
+
+    return cred;
+}
+
+static void
+setRefLabel(gss_cred_id_t cred, const char *label)
+{
+    gss_buffer_desc buffer = {
+	.value = "1",
+	.length = 1
+    };
+    OM_uint32 min_stat;
+
+    gss_cred_label_set(&min_stat, cred, label, &buffer);
+}
+
+/*
+ * Kerberos credentials held through NAH are renewed in the background
+ * when enabled, see KRBRenewalTrack().
+ */
+
+static void
+track_renewal(CFStringRef referenceKey, int delta)
+{
+    CFStringRef principal;
+
+    if (delta == 0 || !CFStringHasPrefix(referenceKey, CFSTR("krb5:")))
+	return;
+
+    principal = CFStringCreateWithSubstring(NULL, referenceKey, CFRangeMake(5, CFStringGetLength(referenceKey) - 5));
+    if (principal == NULL)
+	return;
+    KRBRenewalTrack(principal, delta);
+    CFRelease(principal);
+}
+
+static Boolean
+CredChange(CFStringRef referenceKey, int count, const char *label)
+{
+    OM_uint32 min_stat;
+    gss_cred_id_t cred;
+
+    if (referenceKey == NULL)
+	return false;
+
+    os_log(na_get_oslog(), "NAHCredChange: %@ count: %d label: %s",
+	  referenceKey, count, label ? label : "<nolabel>");
+
+    cred = copyRefcountedCred(referenceKey);
+    if (cred == GSS_C_NO_CREDENTIAL)
+	return false;
+
+    if (count == 0) {
+	/* do nothing */
+    } else if (count > 0) {
+	gss_cred_hold(&min_stat, cred);
+	track_renewal(referenceKey, 1);
+    } else {
+	gss_cred_unhold(&min_stat, cred);
+	track_renewal(referenceKey, -1);
+    }
+
+    if (label)
+	setRefLabel(cred, label);
+
+    gss_release_cred(&min_stat, &cred);
+    return true;
+}
+
+void
+NAHCredChangeReferences(NAHCredReferenceChange *changes, CFIndex count)
+{
+    CFMutableDictionaryRef groups;
+    CFIndex n, m;
+
+    if (changes == NULL || count <= 0)
+	return;
+
+    for (n = 0; n < count; n++)
+	changes[n].result = false;
+
+    /* referenceKey -> index of the first change for that key */
+    groups = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+    if (groups == NULL)
+	return;
+
+    for (n = 0; n < count; n++) {
+	if (changes[n].referenceKey == NULL)
+	    continue;
+	if (!CFDictionaryContainsKey(groups, changes[n].referenceKey))
+	    CFDictionaryAddValue(groups, changes[n].referenceKey, (const void *)(uintptr_t)n);
+    }
+
+    for (n = 0; n < count; n++) {
+	OM_uint32 min_stat;
+	gss_cred_id_t cred;
+	int delta = 0;
+
+	if (changes[n].referenceKey == NULL)
+	    continue;
+	if ((CFIndex)(uintptr_t)CFDictionaryGetValue(groups, changes[n].referenceKey) != n)
+	    continue; /* handled with the first change for the key */
+
+	for (m = n; m < count; m++)
+	    if (changes[m].referenceKey && CFEqual(changes[m].referenceKey, changes[n].referenceKey))
+		delta += changes[m].delta;
+
+	os_log(na_get_oslog(), "NAHCredChangeReferences: %@ delta: %d", changes[n].referenceKey, delta);
+
+	cred = copyRefcountedCred(changes[n].referenceKey);
+	if (cred == GSS_C_NO_CREDENTIAL)
+	    continue;
+
+	track_renewal(changes[n].referenceKey, delta);
+	for (; delta > 0; delta--)
+	    gss_cred_hold(&min_stat, cred);
+	for (; delta < 0; delta++)
+	    gss_cred_unhold(&min_stat, cred);
+
+	for (m = n; m < count; m++) {
+	    char *label;
+
+	    if (changes[m].referenceKey == NULL || !CFEqual(changes[m].referenceKey, changes[n].referenceKey))
+		continue;
+
+	    changes[m].result = true;
+	    if (changes[m].label == NULL)
+		continue;
+
+	    label = NAHCreateRefLabelFromIdentifier(changes[m].label);
+	    if (label == NULL) {
+		changes[m].result = false;
+		continue;
+	    }
+	    setRefLabel(cred, label);
+	    __KRBReleaseUTF8String(label);
+	    NAHLabelIndexAdd(changes[m].label, changes[m].referenceKey);
+	}
+
+	gss_release_cred(&min_stat, &cred);
+    }
+
+    CFRelease(groups);
+}
+
+char *
+NAHCreateRefLabelFromIdentifier(CFStringRef identifier)
+{
+    CFStringRef str = CFStringCreateWithFormat(NULL, NULL, CFSTR("reference-label:%@"), identifier);
+    OSStatus ret;
+    char *label;
 
     if (str == NULL)
 	return NULL;
@@ -2161,6 +3405,8 @@ NAHAddReferenceAndLabel(NAHSelectionRef selection,
     }
 
     res = CredChange(ref, 1, ident);
+    if (res)
+	NAHLabelIndexAdd(identifier, ref);
     CFRelease(ref);
     __KRBReleaseUTF8String(ident);
 
@@ -2197,47 +3443,244 @@ NAHCopyReferenceKey(NAHSelectionRef selection)
 				    type, selection->client);
 }
 
+/*
+ * Index of the reference labels this process has put on credentials,
+ * identifier -> set of reference keys, so releasing by label doesn't
+ * have to walk all credentials.  Only callers that labeled in this
+ * process benefit: labels set by other processes, or before this
+ * process started, are not in the index, and whenever the index
+ * doesn't account for every credential the identifier had here we
+ * still walk the credentials.
+ */
+
+static struct {
+    dispatch_queue_t q;
+    CFMutableDictionaryRef labels;
+} labelindex;
+
+static dispatch_queue_t
+labelindex_queue(void)
+{
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+	    labelindex.q = dispatch_queue_create("com.apple.NetworkAuthenticationHelper.labels", NULL);
+	    labelindex.labels = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	});
+    return labelindex.q;
+}
+
+void
+NAHLabelIndexAdd(CFStringRef identifier, CFStringRef referenceKey)
+{
+    if (identifier == NULL || referenceKey == NULL)
+	return;
+
+    dispatch_sync(labelindex_queue(), ^{
+	    CFMutableSetRef keys;
+
+	    if (labelindex.labels == NULL)
+		return;
+	    keys = (CFMutableSetRef)CFDictionaryGetValue(labelindex.labels, identifier);
+	    if (keys == NULL) {
+		keys = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+		if (keys == NULL)
+		    return;
+		CFDictionarySetValue(labelindex.labels, identifier, keys);
+		CFRelease(keys);
+	    }
+	    CFSetAddValue(keys, referenceKey);
+	});
+}
+
+/* Remove identifier from the index and return the reference keys it had */
+static CFArrayRef
+labelindex_copy_remove(CFStringRef identifier)
+{
+    __block CFArrayRef result = NULL;
+
+    dispatch_sync(labelindex_queue(), ^{
+	    CFSetRef keys;
+	    CFIndex count;
+	    const void **values;
+
+	    if (labelindex.labels == NULL)
+		return;
+	    keys = CFDictionaryGetValue(labelindex.labels, identifier);
+	    if (keys == NULL)
+		return;
+
+	    count = CFSetGetCount(keys);
+	    values = malloc(sizeof(values[0]) * (count ? count : 1));
+	    if (values) {
+		CFSetGetValues(keys, values);
+		result = CFArrayCreate(NULL, values, count, &kCFTypeArrayCallBacks);
+		free(values);
+	    }
+	    CFDictionaryRemoveValue(labelindex.labels, identifier);
+	});
+
+    return result;
+}
+
+/* same as track_renewal() but for a credential */
+static void
+track_renewal_cred(gss_cred_id_t cred, int delta)
+{
+    OM_uint32 min_stat;
+    gss_name_t name = GSS_C_NO_NAME;
+    gss_OID_set mechs = GSS_C_NO_OID_SET;
+    gss_buffer_desc buffer = { 0, NULL };
+    int present = 0;
+
+    if (gss_inquire_cred(&min_stat, cred, &name, NULL, NULL, &mechs) == GSS_S_COMPLETE &&
+	gss_test_oid_set_member(&min_stat, GSS_KRB5_MECHANISM, mechs, &present) == GSS_S_COMPLETE &&
+	present &&
+	gss_display_name(&min_stat, name, &buffer, NULL) == GSS_S_COMPLETE)
+    {
+	CFStringRef principal = CFStringCreateWithFormat(NULL, NULL, CFSTR("%.*s"),
+							 (int)buffer.length, buffer.value);
+	if (principal) {
+	    KRBRenewalTrack(principal, delta);
+	    CFRelease(principal);
+	}
+    }
+    gss_release_buffer(&min_stat, &buffer);
+    gss_release_oid_set(&min_stat, &mechs);
+    gss_release_name(&min_stat, &name);
+}
+
+/* unhold cred if it has the label, returns true if it did */
+static bool
+releaseIfLabeled(gss_cred_id_t cred, const char *str)
+{
+    OM_uint32 min_stat, maj_stat;
+    gss_buffer_desc buffer;
+
+    buffer.value = NULL;
+    buffer.length = 0;
+
+    /* if there is a label, unhold */
+    maj_stat = gss_cred_label_get(&min_stat, cred, str, &buffer);
+    gss_release_buffer(&min_stat, &buffer);
+    if (maj_stat != GSS_S_COMPLETE)
+	return false;
+
+    os_log(na_get_oslog(), "NAHFindByLabelAndRelease: found credential unholding");
+    gss_cred_label_set(&min_stat, cred, str, NULL);
+    gss_cred_unhold(&min_stat, cred);
+    track_renewal_cred(cred, -1);
+    return true;
+}
+
+/*
+ * Try the index, returns true only if every credential indexed for
+ * the identifier was found and released, otherwise the caller must
+ * walk the credentials as well.
+ */
+static bool
+releaseIndexed(CFStringRef identifier, const char *str)
+{
+    CFArrayRef keys;
+    bool covered;
+    CFIndex n;
+
+    keys = labelindex_copy_remove(identifier);
+    if (keys == NULL)
+	return false;
+
+    covered = CFArrayGetCount(keys) > 0;
+    for (n = 0; n < CFArrayGetCount(keys); n++) {
+	OM_uint32 min_stat;
+	gss_cred_id_t cred;
+
+	cred = copyRefcountedCred(CFArrayGetValueAtIndex(keys, n));
+	if (cred == GSS_C_NO_CREDENTIAL) {
+	    covered = false;
+	    continue;
+	}
+	if (!releaseIfLabeled(cred, str))
+	    covered = false;
+	gss_release_cred(&min_stat, &cred);
+    }
+    CFRelease(keys);
+
+    return covered;
+}
+
 void
 NAHFindByLabelAndRelease(CFStringRef identifier)
 {
+    CFArrayRef identifiers;
+
+    if (identifier == NULL)
+	return;
+
+    identifiers = CFArrayCreate(NULL, (const void **)&identifier, 1, &kCFTypeArrayCallBacks);
+    if (identifiers == NULL)
+	return;
+    NAHFindByLabelsAndRelease(identifiers);
+    CFRelease(identifiers);
+}
+
+void
+NAHFindByLabelsAndRelease(CFArrayRef identifiers)
+{
+    CFIndex n, count, nlabels = 0;
     OM_uint32 junk;
-    char *str;
+    char **labels;
 
-    os_log(na_get_oslog(), "NAHFindByLabelAndRelease: looking for label %@", identifier);
+    count = CFArrayGetCount(identifiers);
+    if (count == 0)
+	return;
 
-    str = NAHCreateRefLabelFromIdentifier(identifier);
-    if (str == NULL)
+    labels = calloc(count, sizeof(labels[0]));
+    if (labels == NULL)
 	return;
 
-    (void)gss_iter_creds(&junk, 0, GSS_C_NO_OID, ^(gss_OID mech, gss_cred_id_t cred) {
-	    OM_uint32 min_stat, maj_stat;
-	    gss_buffer_desc buffer;
+    for (n = 0; n < count; n++) {
+	CFStringRef identifier = CFArrayGetValueAtIndex(identifiers, n);
+	char *str;
 
-	    if (cred == NULL)
-		return;
+	os_log(na_get_oslog(), "NAHFindByLabelAndRelease: looking for label %@", identifier);
 
-	    maj_stat = gss_cred_label_get(&min_stat, cred, nah_created, &buffer);
-	    if (maj_stat) {
-		gss_release_cred(&min_stat, &cred);
-		return;
-	    }
-	    gss_release_buffer(&min_stat, &buffer);
+	str = NAHCreateRefLabelFromIdentifier(identifier);
+	if (str == NULL)
+	    continue;
 
-	    buffer.value = NULL;
-	    buffer.length = 0;
+	if (releaseIndexed(identifier, str)) {
+	    __KRBReleaseUTF8String(str);
+	    continue;
+	}
+	labels[nlabels++] = str;
+    }
 
-	    /* if there is a label, unhold */
-	    maj_stat = gss_cred_label_get(&min_stat, cred, str, &buffer);
-	    gss_release_buffer(&min_stat, &buffer);
-	    if (maj_stat == GSS_S_COMPLETE) {
-		os_log(na_get_oslog(), "NAHFindByLabelAndRelease: found credential unholding");
-		gss_cred_label_set(&min_stat, cred, str, NULL);
-		gss_cred_unhold(&min_stat, cred);
-	    }
-	    gss_release_cred(&min_stat, &cred);
-	});
+    /* walk the credentials once for all labels not found in the index */
+    if (nlabels) {
+	(void)gss_iter_creds(&junk, 0, GSS_C_NO_OID, ^(gss_OID mech, gss_cred_id_t cred) {
+		OM_uint32 min_stat, maj_stat;
+		gss_buffer_desc buffer;
+		CFIndex i;
 
-    __KRBReleaseUTF8String(str);
+		if (cred == NULL)
+		    return;
+
+		maj_stat = gss_cred_label_get(&min_stat, cred, nah_created, &buffer);
+		if (maj_stat) {
+		    gss_release_cred(&min_stat, &cred);
+		    return;
+		}
+		gss_release_buffer(&min_stat, &buffer);
+
+		for (i = 0; i < nlabels; i++)
+		    releaseIfLabeled(cred, labels[i]);
+
+		gss_release_cred(&min_stat, &cred);
+	    });
+    }
+
+    for (n = 0; n < nlabels; n++)
+	__KRBReleaseUTF8String(labels[n]);
+    free(labels);
 }
 
 Boolean
@@ -2263,24 +3706,54 @@ static CFStringRef kMech = CFSTR("mech");
 static CFStringRef kClient = CFSTR("client");
 
 
-static void
-add_user_selections(NAHRef na)
+/*
+ * The preferences are parsed once and kept until they change, with
+ * the UserSelections indexed by lowercased domain.  They are reread
+ * when NAH_PREFS_NOTIFICATION is posted, and after NAH_PREFS_TTL
+ * seconds in case nobody posted it.
+ */
+
+#define NAH_PREFS_DOMAIN	CFSTR("com.apple.NetworkAuthenticationHelper")
+#define NAH_PREFS_NOTIFICATION	"com.apple.NetworkAuthenticationHelper.preferences"
+#define NAH_PREFS_TTL		60
+
+static struct {
+    dispatch_queue_t q;
+    int notify_token;
+    int loaded;
+    time_t expire;
+    CFDictionaryRef userSelections; /* domain -> CFArray of CFDictionary */
+    bool use_gss_uam;
+    bool vnc_support_iakerb;
+} nahprefs;
+
+static dispatch_queue_t
+nah_prefs_queue(void)
 {
-    CFArrayRef array;
-    enum NAHMechType mech = GSS_KERBEROS;
-    CFIndex n;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+	nahprefs.q = dispatch_queue_create("com.apple.KerberosHelper.nah-prefs", NULL);
+	(void)notify_register_dispatch(NAH_PREFS_NOTIFICATION, &nahprefs.notify_token, nahprefs.q, ^(int token) {
+		nahprefs.loaded = 0;
+	    });
+    });
+    return nahprefs.q;
+}
 
-    array = CFPreferencesCopyAppValue(CFSTR("UserSelections"),
-				      CFSTR("com.apple.NetworkAuthenticationHelper"));
-    if (array == NULL || CFGetTypeID(array) != CFArrayGetTypeID()) {
-	CFRELEASE(array);
-	return;
-    }
+static CFDictionaryRef
+index_user_selections(CFArrayRef array)
+{
+    CFMutableDictionaryRef index;
+    CFMutableArrayRef entries;
+    CFMutableStringRef domain;
+    CFIndex n;
 
+    index = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (index == NULL)
+	return NULL;
 
     for (n = 0; n < CFArrayGetCount(array); n++) {
 	CFDictionaryRef dict = CFArrayGetValueAtIndex(array, n);
-	CFStringRef server = NULL;
 	CFStringRef d, u, m, c;
 
 	if (CFGetTypeID(dict) != CFDictionaryGetTypeID())
@@ -2293,36 +3766,133 @@ add_user_selections(NAHRef na)
 
 	if (c == NULL || CFGetTypeID(c) != CFStringGetTypeID())
 	    continue;
-	if (m == NULL || CFGetTypeID(m) != CFStringGetTypeID())
+	if (m == NULL || CFGetTypeID(m) != CFStringGetTypeID() || name2mech(m) == NO_MECH)
 	    continue;
 	if (d == NULL || CFGetTypeID(d) != CFStringGetTypeID())
 	    continue;
-	if (u == NULL && CFGetTypeID(u) != CFStringGetTypeID())
+	if (u != NULL && CFGetTypeID(u) != CFStringGetTypeID())
 	    continue;
 
-	/* find if matching */
-	/* exact matching for now, should really be domain matching */
-	if (CFStringCompare(d, na->hostname, kCFCompareCaseInsensitive) != kCFCompareEqualTo)
+	domain = CFStringCreateMutableCopy(NULL, 0, d);
+	if (domain == NULL)
 	    continue;
-
-	if (u == NULL) {
-	    if (CFStringCompare(d, na->username, 0) != kCFCompareEqualTo)
-		continue;
+	CFStringLowercase(domain, CFLocaleGetSystem());
+
+	entries = (CFMutableArrayRef)CFDictionaryGetValue(index, domain);
+	if (entries == NULL) {
+	    entries = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+	    if (entries) {
+		CFDictionarySetValue(index, domain, entries);
+		CFRelease(entries);
+	    }
 	}
+	if (entries)
+	    CFArrayAppendValue(entries, dict);
+	CFRelease(domain);
+    }
 
-	mech = name2mech(m);
-	if (mech == NO_MECH)
-	    continue;
+    return index;
+}
 
-	server = CFStringCreateWithFormat(na->alloc, 0, CFSTR("%@@%@"),
-					  na->service, na->hostname);
+/* must be called on nahprefs.q */
+static void
+nah_prefs_load(void)
+{
+    Boolean have_key = false;
+    CFArrayRef array;
 
-	/* add selection */
-	if (server && c)
-	    addSelection(na, c, NULL, server, NULL, mech, NULL, true);
-	CFRELEASE(server);
+    CFPreferencesAppSynchronize(NAH_PREFS_DOMAIN);
+
+    nahprefs.use_gss_uam = CFPreferencesGetAppBooleanValue(CFSTR("GSSEnable"), NAH_PREFS_DOMAIN, &have_key);
+    if (!have_key)
+	nahprefs.use_gss_uam = true;
+    nahprefs.vnc_support_iakerb = CFPreferencesGetAppBooleanValue(CFSTR("VNCSupportIAKerb"), NAH_PREFS_DOMAIN, &have_key);
+
+    CFRELEASE(nahprefs.userSelections);
+    array = CFPreferencesCopyAppValue(CFSTR("UserSelections"), NAH_PREFS_DOMAIN);
+    if (array && CFGetTypeID(array) == CFArrayGetTypeID() && CFArrayGetCount(array))
+	nahprefs.userSelections = index_user_selections(array);
+    CFRELEASE(array);
+
+    nahprefs.loaded = 1;
+    nahprefs.expire = time(NULL) + NAH_PREFS_TTL;
+}
+
+static void
+nah_prefs_copy(NAHRef na)
+{
+    dispatch_sync(nah_prefs_queue(), ^{
+	    if (!nahprefs.loaded || nahprefs.expire <= time(NULL))
+		nah_prefs_load();
+	    na->use_gss_uam = nahprefs.use_gss_uam;
+	    na->vnc_support_iakerb = nahprefs.vnc_support_iakerb;
+	    if (nahprefs.userSelections)
+		na->userSelections = CFRetain(nahprefs.userSelections);
+	});
+}
+
+static void
+add_user_selections_for_domain(NAHRef na, CFStringRef domain)
+{
+    CFArrayRef entries;
+    CFStringRef server;
+    CFIndex n;
+
+    entries = CFDictionaryGetValue(na->userSelections, domain);
+    if (entries == NULL)
+	return;
+
+    server = CFStringCreateWithFormat(na->alloc, 0, CFSTR("%@@%@"),
+				      na->service, na->hostname);
+    if (server == NULL)
+	return;
+
+    for (n = 0; n < CFArrayGetCount(entries); n++) {
+	CFDictionaryRef dict = CFArrayGetValueAtIndex(entries, n);
+
+	addSelection(na, CFDictionaryGetValue(dict, kClient), NULL, server, NULL,
+		     name2mech(CFDictionaryGetValue(dict, kMech)), NULL, true);
+    }
+    CFRelease(server);
+}
+
+/*
+ * Domain matching, the entries for the host name itself come first
+ * and then the ones for each parent domain, most specific first.
+ */
+
+static void
+add_user_selections(NAHRef na)
+{
+    CFMutableStringRef host;
+    CFStringRef domain;
+    CFRange r;
+    CFIndex len;
+
+    if (na->userSelections == NULL)
+	return;
+
+    host = CFStringCreateMutableCopy(NULL, 0, na->hostname);
+    if (host == NULL)
+	return;
+    CFStringLowercase(host, CFLocaleGetSystem());
+
+    add_user_selections_for_domain(na, host);
+
+    len = CFStringGetLength(host);
+    r = CFRangeMake(0, len);
+    while (CFStringFindWithOptions(host, CFSTR("."), r, 0, &r)) {
+	r.location += 1;
+	r.length = len - r.location;
+	if (r.length == 0)
+	    break;
+	domain = CFStringCreateWithSubstring(NULL, host, r);
+	if (domain) {
+	    add_user_selections_for_domain(na, domain);
+	    CFRelease(domain);
+	}
     }
-    CFRelease(array);
+    CFRelease(host);
 }
 
 
@@ -2352,7 +3922,6 @@ ntstring2oid(CFStringRef name)
 gss_cred_id_t
 NAHSelectionGetGSSCredential(NAHSelectionRef selection, CFErrorRef *error)
 {
-    gss_buffer_desc buffer;
     OM_uint32 minor_status, major_status, junk;
     gss_name_t name;
     gss_cred_id_t cred = NULL;
@@ -2368,13 +3937,8 @@ NAHSelectionGetGSSCredential(NAHSelectionRef selection, CFErrorRef *error)
     if (nt == NULL)
 	nt = GSS_C_NT_USER_NAME;
 
-    buffer.value = cf2cstring(selection->client);
-    if (buffer.value == NULL)
-	return NULL;
-    buffer.length = strlen((char *)buffer.value);
 
-    major_status = gss_import_name(&minor_status, &buffer, nt, &name);
-    free(buffer.value);
+    major_status = import_cfname(&minor_status, selection->client, nt, &name);
     if (major_status) {
 	updateError(NULL, error, major_status, CFSTR("Failed create name for %@"), selection->server);
 	return NULL;
@@ -2393,7 +3957,6 @@ NAHSelectionGetGSSCredential(NAHSelectionRef selection, CFErrorRef *error)
 gss_name_t
 NAHSelectionGetGSSAcceptorName(NAHSelectionRef selection, CFErrorRef *error)
 {
-    gss_buffer_desc buffer;
     OM_uint32 minor_status, major_status;
     gss_name_t name;
     gss_OID nt;
@@ -2404,17 +3967,12 @@ NAHSelectionGetGSSAcceptorName(NAHSelectionRef selection, CFErrorRef *error)
     if (selection->server == NULL)
 	return GSS_C_NO_NAME;
 
-    buffer.value = cf2cstring(selection->server);
-    if (buffer.value == NULL)
-	return NULL;
-    buffer.length = strlen((char *)buffer.value);
 
     nt = ntstring2oid(selection->servertype);
     if (nt == NULL)
 	nt = GSS_C_NT_HOSTBASED_SERVICE;
 
-    major_status = gss_import_name(&minor_status, &buffer, nt, &name);
-    free(buffer.value);
+    major_status = import_cfname(&minor_status, selection->server, nt, &name);
     if (major_status)
 	updateError(NULL, error, major_status, CFSTR("Failed create name for %@"), selection->server);
 
@@ -2434,7 +3992,6 @@ NAHSelectionGetGSSMech(NAHSelectionRef selection)
 gss_cred_id_t
 NAHAuthenticationInfoCopyClientCredential(CFDictionaryRef authInfo, CFErrorRef *error)
 {
-    gss_buffer_desc buffer;
     OM_uint32 minor_status, major_status, junk;
     gss_name_t name;
     gss_cred_id_t cred = NULL;
@@ -2462,13 +4019,8 @@ NAHAuthenticationInfoCopyClientCredential(CFDictionaryRef authInfo, CFErrorRef *
     if (nt == NULL)
 	nt = GSS_C_NT_USER_NAME;
 
-    buffer.value = cf2cstring(clientName);
-    if (buffer.value == NULL)
-	return NULL;
-    buffer.length = strlen((char *)buffer.value);
 
-    major_status = gss_import_name(&minor_status, &buffer, nt, &name);
-    free(buffer.value);
+    major_status = import_cfname(&minor_status, clientName, nt, &name);
     if (major_status) {
 	updateError(NULL, error, major_status, CFSTR("Failed create name for %@"), clientName);
 	return NULL;
@@ -2487,7 +4039,6 @@ NAHAuthenticationInfoCopyClientCredential(CFDictionaryRef authInfo, CFErrorRef *
 gss_name_t
 NAHAuthenticationInfoCopyServerName(CFDictionaryRef authInfo, CFErrorRef *error)
 {
-    gss_buffer_desc buffer;
     OM_uint32 minor_status, major_status;
     gss_name_t name;
     gss_OID nt;
@@ -2507,13 +4058,8 @@ NAHAuthenticationInfoCopyServerName(CFDictionaryRef authInfo, CFErrorRef *error)
     if (nt == NULL)
 	nt = GSS_C_NT_HOSTBASED_SERVICE;
 
-    buffer.value = cf2cstring(serverName);
-    if (buffer.value == NULL)
-	return NULL;
-    buffer.length = strlen((char *)buffer.value);
 
-    major_status = gss_import_name(&minor_status, &buffer, nt, &name);
-    free(buffer.value);
+    major_status = import_cfname(&minor_status, serverName, nt, &name);
     if (major_status) {
 	updateError(NULL, error, major_status, CFSTR("Failed create name for %@"), serverName);
 	return NULL;
@@ -25,6 +25,7 @@
 #include "KerberosHelper.h"
 
 #include <err.h>
+#include <unistd.h>
 
 #define IS_LOVE 0
 
@@ -49,6 +50,189 @@ lkdc_classic(void)
     CFRelease(na);
 }
 
+static void
+lkdc_lazy(void)
+{
+    CFMutableDictionaryRef info, lazy;
+    NAHSelectionRef nasel;
+    CFArrayRef array;
+    CFIndex n;
+    NAHRef na, eager;
+
+    CFShow(CFSTR("lkdc_lazy"));
+
+    info = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionaryAddValue(info, kNAHUserName, CFSTR("foo"));
+    CFDictionaryAddValue(info, kNAHPassword, CFSTR("bar"));
+
+    lazy = CFDictionaryCreateMutableCopy(NULL, 0, info);
+    CFDictionaryAddValue(lazy, kNAHLazySelections, kCFBooleanTrue);
+
+    na = NAHCreate(NULL, CFSTR("localhost.local"), CFSTR("host"), lazy);
+    if (na == NULL)
+	errx(1, "NACreate");
+    CFRelease(lazy);
+
+    eager = NAHCreate(NULL, CFSTR("localhost.local"), CFSTR("host"), info);
+    if (eager == NULL)
+	errx(1, "NACreate");
+    CFRelease(info);
+
+    for (n = 0; (nasel = NAHGetSelectionAtIndex(na, n)) != NULL; n++)
+	CFShow(nasel);
+
+    /* lazy and eager must produce the same list */
+    array = NAHGetSelections(eager);
+    if (n != CFArrayGetCount(array))
+	errx(1, "lazy selection count %d != %d", (int)n, (int)CFArrayGetCount(array));
+    if (CFArrayGetCount(NAHGetSelections(na)) != n)
+	errx(1, "NAHGetSelections changed after lazy iteration");
+    for (n = 0; n < CFArrayGetCount(array); n++) {
+	CFTypeRef a = NAHSelectionGetInfoForKey(NAHGetSelectionAtIndex(na, n), kNAHClientPrincipal);
+	CFTypeRef b = NAHSelectionGetInfoForKey((NAHSelectionRef)CFArrayGetValueAtIndex(array, n), kNAHClientPrincipal);
+	if (a != b && (a == NULL || b == NULL || !CFEqual(a, b)))
+	    errx(1, "lazy selection %d differs from eager", (int)n);
+    }
+
+    CFRelease(eager);
+    CFRelease(na);
+}
+
+static void
+concurrent_create(void)
+{
+    CFMutableDictionaryRef info;
+    __block CFIndex counts[8];
+    size_t n;
+
+    CFShow(CFSTR("concurrent_create"));
+
+    info = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionaryAddValue(info, kNAHUserName, CFSTR("foo"));
+    CFDictionaryAddValue(info, kNAHPassword, CFSTR("bar"));
+
+    /* coalesced or not, every caller must see the same selections */
+    dispatch_apply(sizeof(counts)/sizeof(counts[0]), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+	    NAHRef na = NAHCreate(NULL, CFSTR("localhost.local"), CFSTR("host"), info);
+	    if (na == NULL)
+		errx(1, "NACreate");
+	    counts[i] = CFArrayGetCount(NAHGetSelections(na));
+	    CFRelease(na);
+	});
+    CFRelease(info);
+
+    for (n = 1; n < sizeof(counts)/sizeof(counts[0]); n++)
+	if (counts[n] != counts[0])
+	    errx(1, "concurrent NAHCreate %d got %d selections, expected %d",
+		 (int)n, (int)counts[n], (int)counts[0]);
+}
+
+static void
+acquire_all_fail(void)
+{
+    CFMutableDictionaryRef info;
+    dispatch_semaphore_t s;
+    __block CFErrorRef error = NULL;
+    __block NAHSelectionRef winner = NULL;
+    NAHRef na;
+
+    CFShow(CFSTR("acquire_all_fail"));
+
+    info = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionaryAddValue(info, kNAHUserName, CFSTR("nah-test-user"));
+    CFDictionaryAddValue(info, kNAHPassword, CFSTR("not-the-password"));
+
+    /* there is no KDC for this realm, so every selection fails */
+    na = NAHCreate(NULL, CFSTR("nah-test.invalid"), CFSTR("host"), info);
+    CFRelease(info);
+    if (na == NULL)
+	errx(1, "NACreate");
+
+    s = dispatch_semaphore_create(0);
+    if (!NAHAcquireFirstCredentialAsync(na, NULL, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+					^(NAHSelectionRef selection, CFErrorRef e) {
+					    winner = selection;
+					    if (e)
+						error = (CFErrorRef)CFRetain(e);
+					    dispatch_semaphore_signal(s);
+					}))
+	errx(1, "NAHAcquireFirstCredentialAsync");
+    dispatch_semaphore_wait(s, DISPATCH_TIME_FOREVER);
+    dispatch_release(s);
+
+    if (winner != NULL)
+	errx(1, "a failing selection won the race");
+    if (error == NULL)
+	errx(1, "no error reported when every selection failed");
+    CFShow(error);
+    CFRelease(error);
+    CFRelease(na);
+}
+
+static long long
+host_cache_hits(void)
+{
+    CFDictionaryRef stats, caches, host;
+    CFNumberRef num;
+    long long hits = 0;
+
+    stats = KRBCopyStatistics();
+    if (stats == NULL)
+	errx(1, "KRBCopyStatistics");
+    caches = CFDictionaryGetValue(stats, kKRBStatisticsCaches);
+    host = caches ? CFDictionaryGetValue(caches, CFSTR("Host")) : NULL;
+    num = host ? CFDictionaryGetValue(host, CFSTR("Hits")) : NULL;
+    if (num)
+	CFNumberGetValue(num, kCFNumberLongLongType, &hits);
+    CFRelease(stats);
+    return hits;
+}
+
+static void
+prefetch(void)
+{
+    const void *hosts[] = { CFSTR("localhost.local"), CFSTR("fs11.cead.apple.com") };
+    CFMutableDictionaryRef info;
+    CFArrayRef hostnames;
+    double timeout = 2.0;
+    CFNumberRef num;
+    long long hits;
+    NAHRef na;
+
+    CFShow(CFSTR("prefetch"));
+
+    hostnames = CFArrayCreate(NULL, hosts, sizeof(hosts)/sizeof(hosts[0]), &kCFTypeArrayCallBacks);
+    num = CFNumberCreate(NULL, kCFNumberDoubleType, &timeout);
+    info = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionaryAddValue(info, kNAHPrefetchTimeout, num);
+    CFRelease(num);
+
+    NAHPrefetch(hostnames, CFSTR("host"), info);
+    CFRelease(hostnames);
+    CFRelease(info);
+
+    /* must work while the prefetch is still running */
+    na = NAHCreate(NULL, CFSTR("localhost.local"), CFSTR("host"), NULL);
+    if (na == NULL)
+	errx(1, "NACreate");
+    CFRelease(na);
+
+    sleep(3);
+
+    /* the classic Kerberos selections must come from the prefetched mappings */
+    hits = host_cache_hits();
+    info = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionaryAddValue(info, kNAHUserName, CFSTR("foo"));
+    CFDictionaryAddValue(info, kNAHPassword, CFSTR("bar"));
+    na = NAHCreate(NULL, CFSTR("fs11.cead.apple.com"), CFSTR("host"), info);
+    CFRelease(info);
+    if (na == NULL)
+	errx(1, "NACreate");
+    CFRelease(na);
+    if (host_cache_hits() <= hits)
+	errx(1, "NAHCreate after NAHPrefetch missed the host cache");
+}
+
 uint8_t token[] =
     "\x60\x66\x06\x06\x2b\x06\x01\x05\x05\x02\xa0\x5c"
     "\x30\x5a\xa0\x2c\x30\x2a\x06\x09\x2a\x86\x48\x82"
@@ -407,6 +591,10 @@ main(int argc, char **argv)
      */
     
     lkdc_classic();
+    lkdc_lazy();
+    concurrent_create();
+    acquire_all_fail();
+    prefetch();
     lkdc_wellknown();
     test_ntlm();
 
@@ -463,6 +651,14 @@ main(int argc, char **argv)
     verify_result(true, false, false, false, true, true, false, CFSTR("afpserver"), CFSTR("nutcracker.bitcollector.members.mac.com"), CFSTR("user"), CFSTR("password"), NULL, 0, NULL);
 #endif
 
+    {
+	CFDictionaryRef stats = KRBCopyStatistics();
+	if (stats == NULL)
+	    errx(1, "KRBCopyStatistics");
+	CFShow(stats);
+	CFRelease(stats);
+    }
+
     printf("PASS\n");
     
     return 0;
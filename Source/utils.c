@@ -34,32 +34,94 @@ OSStatus __KRBCreateUTF8StringFromCFString (CFStringRef inString, char **outStri
 {
 	OSStatus	err = noErr;
 	char		*string = NULL;
-	CFIndex		length;
 	
 	if (inString  == NULL) { err = paramErr; goto Done; }
     if (outString == NULL) { err = paramErr; goto Done; }
 	
+	string = __KRBCopyUTF8String (inString);
+	if (NULL == string)
+		err = -1; /* XXX Pick a good one! */
+		
+	*outString = string;
+Done:
+	return err;
+}
+
+char *__KRBCopyUTF8String (CFStringRef inString)
+{
+	char		*string = NULL;
+	CFIndex		length;
+
 	/* This is the fastest way to get the C string, but it does depend on how
 	 * it was encoded
 	 */
 	string = (char *) CFStringGetCStringPtr (inString, kCFStringEncodingUTF8);
+	if (NULL != string)
+		return strdup (string);
 
-	if (NULL != string) {
-		string = strdup (string);
-	} else {
-		length = CFStringGetMaximumSizeForEncoding (CFStringGetLength (inString), kCFStringEncodingUTF8) + 1;
-		string = malloc (length);
-		
-		if (NULL != string && !CFStringGetCString (inString, string, length, kCFStringEncodingUTF8)) {
-			free (string);
-			string = NULL;
-			err = -1; /* XXX Pick a good one! */
-		}
-	}		
-		
-	*outString = string;
-Done:
-	return err;
+	length = CFStringGetMaximumSizeForEncoding (CFStringGetLength (inString), kCFStringEncodingUTF8) + 1;
+	string = malloc (length);
+	if (NULL != string && !CFStringGetCString (inString, string, length, kCFStringEncodingUTF8)) {
+		free (string);
+		string = NULL;
+	}
+	return string;
+}
+
+const char *__KRBStringViewInit (__KRBStringView *view, CFStringRef inString)
+{
+	CFIndex		length, used = 0;
+	CFRange		range;
+
+	view->str = NULL;
+	view->len = 0;
+	view->heap = NULL;
+
+	if (NULL == inString)
+		return NULL;
+
+	view->str = CFStringGetCStringPtr (inString, kCFStringEncodingUTF8);
+	if (NULL != view->str) {
+		view->len = strlen (view->str);
+		return view->str;
+	}
+
+	/* Try the inline buffer first, most names fit */
+	range = CFRangeMake (0, CFStringGetLength (inString));
+	if (CFStringGetBytes (inString, range, kCFStringEncodingUTF8, 0, false,
+			      (UInt8 *)view->buffer, sizeof(view->buffer) - 1, &used) == range.length) {
+		view->buffer[used] = '\0';
+		view->str = view->buffer;
+		view->len = used;
+		return view->str;
+	}
+
+	length = CFStringGetMaximumSizeForEncoding (range.length, kCFStringEncodingUTF8) + 1;
+	view->heap = malloc (length);
+	if (NULL == view->heap)
+		return NULL;
+	if (!CFStringGetCString (inString, view->heap, length, kCFStringEncodingUTF8)) {
+		free (view->heap);
+		view->heap = NULL;
+		return NULL;
+	}
+	view->str = view->heap;
+	view->len = strlen (view->heap);
+	return view->str;
+}
+
+void __KRBStringViewRelease (__KRBStringView *view)
+{
+	/* the copies might be passwords */
+	if (view->str == view->buffer)
+		memset (view->buffer, 0, view->len);
+	if (NULL != view->heap) {
+		memset (view->heap, 0, view->len);
+		free (view->heap);
+	}
+	view->str = NULL;
+	view->heap = NULL;
+	view->len = 0;
 }
 
 OSStatus __KRBReleaseUTF8String (char *inString) 
@@ -31,3 +31,24 @@
 
 OSStatus __KRBCreateUTF8StringFromCFString (CFStringRef inString, char **outString);
 OSStatus __KRBReleaseUTF8String (char *inString);
+
+/* malloc'ed UTF-8 copy of inString, NULL on failure, free with free() */
+char *__KRBCopyUTF8String (CFStringRef inString);
+
+/*
+ * Borrowed UTF-8 view of a CFString, for strings that are only read
+ * while the CFString is alive.  Points into the CFString's own storage
+ * when CoreFoundation can hand it out, otherwise into the inline
+ * buffer, and only allocates for long strings.  Always pair
+ * __KRBStringViewInit with __KRBStringViewRelease.
+ */
+
+typedef struct __KRBStringView {
+	const char	*str;
+	size_t		len;
+	char		*heap;
+	char		buffer[256];
+} __KRBStringView;
+
+const char *__KRBStringViewInit (__KRBStringView *view, CFStringRef inString);
+void __KRBStringViewRelease (__KRBStringView *view);
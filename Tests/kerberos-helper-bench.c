@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Micro benchmark and load test for KerberosHelper.
+ *
+ * Runs each benchmark in a tight loop from a number of threads and
+ * prints one JSON object per benchmark with the throughput and the
+ * p50/p99 latency.  Nothing here needs a KDC or the network: name
+ * resolution goes through a generated krb5.conf (or the one given
+ * with -C) that maps the benchmark hosts to a fake realm whose KDC is
+ * a closed local port, and the credential cache collection is seeded
+ * with MEMORY caches.
+ *
+ * usage: kerberos-helper-bench [-t threads] [-n iterations] [-c caches]
+ *	      [-C krb5.conf] [-H host] [-N negtoken-file] [-s] [benchmark ...]
+ */
+
+#include <KerberosHelper/KerberosHelper.h>
+#include <KerberosHelper/NetworkAuthenticationHelper.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include <Heimdal/krb5.h>
+#include <GSS/gssapi.h>
+#include <dispatch/dispatch.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_REALM	"BENCH.TEST"
+
+static size_t threads = 4;
+static size_t iterations = 1000;
+static size_t ncaches = 16;
+static const char *hostname = "localhost";
+static CFDictionaryRef negtoken;	/* decoded, for NAHCreate */
+static CFDataRef negtokenblob;		/* raw, for KRBDecodeNegTokenInit */
+
+struct bench {
+    const char *name;
+    int (*op)(size_t thread, size_t i);
+};
+
+/*
+ * Fake resolver, a krb5.conf that keeps every lookup local
+ */
+
+static void
+setup_krb5_config(const char *config)
+{
+    static char path[] = "/tmp/kerberos-helper-bench.XXXXXX";
+    FILE *f;
+    int fd;
+
+    if (config == NULL) {
+	if ((fd = mkstemp(path)) < 0)
+	    err(1, "mkstemp");
+	if ((f = fdopen(fd, "w")) == NULL)
+	    err(1, "fdopen");
+	fprintf(f,
+		"[libdefaults]\n"
+		"\tdefault_realm = " BENCH_REALM "\n"
+		"\tdns_lookup_realm = false\n"
+		"\tdns_lookup_kdc = false\n"
+		"\tkdc_timeout = 1\n"
+		"[realms]\n"
+		"\t" BENCH_REALM " = {\n"
+		"\t\tkdc = 127.0.0.1:1\n"
+		"\t}\n"
+		"[domain_realm]\n"
+		"\t%s = " BENCH_REALM "\n"
+		"\t.bench.test = " BENCH_REALM "\n",
+		hostname);
+	fclose(f);
+	config = path;
+    }
+    setenv("KRB5_CONFIG", config, 1);
+}
+
+/*
+ * Fake credential cache collection, seeded with MEMORY caches that
+ * look like nah-created caches with a TGT.
+ */
+
+static void
+seed_caches(void)
+{
+    krb5_context context;
+    krb5_data data;
+    size_t n;
+
+    if (krb5_init_context(&context))
+	errx(1, "krb5_init_context");
+
+    for (n = 0; n < ncaches; n++) {
+	krb5_principal client;
+	krb5_ccache id;
+	krb5_creds cred;
+	char name[64];
+
+	snprintf(name, sizeof(name), "bench%zu@" BENCH_REALM, n);
+	if (krb5_parse_name(context, name, &client))
+	    errx(1, "krb5_parse_name %s", name);
+	if (krb5_cc_new_unique(context, "MEMORY", NULL, &id))
+	    errx(1, "krb5_cc_new_unique");
+	if (krb5_cc_initialize(context, id, client))
+	    errx(1, "krb5_cc_initialize");
+
+	memset(&cred, 0, sizeof(cred));
+	cred.client = client;
+	if (krb5_make_principal(context, &cred.server, BENCH_REALM,
+				KRB5_TGS_NAME, BENCH_REALM, NULL))
+	    errx(1, "krb5_make_principal");
+	cred.times.authtime = cred.times.starttime = time(NULL);
+	cred.times.endtime = cred.times.starttime + 10 * 60 * 60;
+	cred.session.keytype = ETYPE_AES128_CTS_HMAC_SHA1_96;
+	krb5_data_alloc(&cred.session.keyvalue, 16);
+	memset(cred.session.keyvalue.data, 0, 16);
+	krb5_data_alloc(&cred.ticket, 32);
+	memset(cred.ticket.data, 0, 32);
+
+	if (krb5_cc_store_cred(context, id, &cred))
+	    errx(1, "krb5_cc_store_cred");
+
+	data.data = "1";
+	data.length = 1;
+	krb5_cc_set_config(context, id, NULL, "nah-created", &data);
+
+	cred.client = NULL;
+	krb5_free_cred_contents(context, &cred);
+	krb5_free_principal(context, client);
+	/* MEMORY caches go away on destroy only */
+	krb5_cc_close(context, id);
+    }
+
+    krb5_free_context(context);
+}
+
+/*
+ * Canned NegTokenInit, either from a file or what the local acceptor
+ * sends, the same way the KRBDecodeNegTokenInit test gets it.
+ */
+
+static void
+setup_negtoken(const char *file)
+{
+    if (file) {
+	CFMutableDataRef data;
+	char buf[1024];
+	size_t len;
+	FILE *f;
+
+	if ((f = fopen(file, "r")) == NULL)
+	    err(1, "%s", file);
+	data = CFDataCreateMutable(NULL, 0);
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+	    CFDataAppendBytes(data, (const UInt8 *)buf, len);
+	fclose(f);
+	negtokenblob = data;
+    } else {
+	gss_buffer_desc empty = { 0, NULL }, out;
+	OM_uint32 maj_stat, min_stat;
+	gss_ctx_id_t ctx = GSS_C_NO_CONTEXT;
+
+	maj_stat = gss_accept_sec_context(&min_stat, &ctx, GSS_C_NO_CREDENTIAL,
+					  &empty, GSS_C_NO_CHANNEL_BINDINGS,
+					  NULL, NULL, &out, NULL, NULL, NULL);
+	if (maj_stat != GSS_S_CONTINUE_NEEDED)
+	    errx(1, "gss_accept_sec_context");
+	negtokenblob = CFDataCreate(NULL, out.value, out.length);
+	gss_release_buffer(&min_stat, &out);
+	gss_delete_sec_context(&min_stat, &ctx, NULL);
+    }
+
+    negtoken = KRBDecodeNegTokenInit(NULL, negtokenblob);
+    if (negtoken == NULL)
+	errx(1, "KRBDecodeNegTokenInit");
+}
+
+/*
+ * Benchmarks, return non-zero on failure
+ */
+
+static int
+bench_nahcreate(size_t thread, size_t i)
+{
+    CFMutableDictionaryRef info;
+    CFStringRef host;
+    NAHRef na;
+
+    info = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionaryAddValue(info, kNAHNegTokenInit, negtoken);
+    CFDictionaryAddValue(info, kNAHUserName, CFSTR("bench0@" BENCH_REALM));
+    CFDictionaryAddValue(info, kNAHPassword, CFSTR("password"));
+
+    host = CFStringCreateWithCString(NULL, hostname, kCFStringEncodingUTF8);
+    na = NAHCreate(NULL, host, kNAHServiceCIFSServer, info);
+    CFRelease(host);
+    CFRelease(info);
+    if (na == NULL)
+	return 1;
+
+    (void)NAHGetSelections(na);
+    CFRelease(na);
+    return 0;
+}
+
+static int
+bench_createsessioninfo(size_t thread, size_t i)
+{
+    CFMutableDictionaryRef dict;
+    KRBHelperContextRef session = NULL;
+    CFStringRef host;
+    OSStatus ret;
+
+    dict = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    host = CFStringCreateWithCString(NULL, hostname, kCFStringEncodingUTF8);
+    CFDictionarySetValue(dict, kKRBHostnameKey, host);
+    CFRelease(host);
+
+    ret = KRBCreateSessionInfo(dict, &session);
+    CFRelease(dict);
+    if (ret)
+	return 1;
+    KRBCloseSession(session);
+    return 0;
+}
+
+static int
+bench_decodenegtokeninit(size_t thread, size_t i)
+{
+    CFDictionaryRef dict;
+
+    dict = KRBDecodeNegTokenInit(NULL, negtokenblob);
+    if (dict == NULL)
+	return 1;
+    CFRelease(dict);
+    return 0;
+}
+
+static CFStringRef
+bench_principal(size_t thread, size_t i)
+{
+    return CFStringCreateWithFormat(NULL, NULL, CFSTR("bench%zu@" BENCH_REALM),
+				    ncaches ? (thread + i) % ncaches : 0);
+}
+
+static int
+bench_credchange(size_t thread, size_t i)
+{
+    CFStringRef principal = bench_principal(thread, i);
+    OSStatus ret;
+
+    ret = KRBCredAddReference(principal);
+    if (ret == 0)
+	ret = KRBCredRemoveReference(principal);
+    CFRelease(principal);
+    return ret != 0;
+}
+
+static int
+bench_nahcredchange(size_t thread, size_t i)
+{
+    CFStringRef principal = bench_principal(thread, i);
+    CFStringRef key;
+    Boolean ok;
+
+    key = CFStringCreateWithFormat(NULL, NULL, CFSTR("krb5:%@"), principal);
+    CFRelease(principal);
+    ok = NAHCredAddReference(key);
+    if (ok)
+	ok = NAHCredRemoveReference(key);
+    CFRelease(key);
+    return !ok;
+}
+
+static krb5_context lkdc_contexts[256];
+
+static int
+bench_lkdclookup(size_t thread, size_t i)
+{
+    krb5_context context = lkdc_contexts[thread];
+    krb5_krbhst_handle handle;
+    krb5_krbhst_info *hi;
+    char realm[64];
+
+    snprintf(realm, sizeof(realm), "LKDC:SHA1.%040zu", i % 8);
+    if (krb5_krbhst_init(context, realm, KRB5_KRBHST_KDC, &handle))
+	return 1;
+    /* fake realms don't resolve, this measures the plugin path */
+    (void)krb5_krbhst_next(context, handle, &hi);
+    krb5_krbhst_free(context, handle);
+    return 0;
+}
+
+static const struct bench benches[] = {
+    { "NAHCreate", bench_nahcreate },
+    { "KRBCreateSessionInfo", bench_createsessioninfo },
+    { "KRBDecodeNegTokenInit", bench_decodenegtokeninit },
+    { "CredChange", bench_credchange },
+    { "NAHCredChange", bench_nahcredchange },
+    { "LKDCLookup", bench_lkdclookup }
+};
+
+static uint64_t
+now_ns(void)
+{
+    return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+run(const struct bench *b)
+{
+    size_t total = threads * iterations;
+    uint64_t *lat, start, elapsed;
+    __block size_t errors = 0;
+    double seconds;
+
+    lat = calloc(total ? total : 1, sizeof(lat[0]));
+    if (lat == NULL)
+	err(1, "calloc");
+
+    /* warm up once so one time setup isn't in the numbers */
+    (void)b->op(0, 0);
+
+    start = now_ns();
+    dispatch_apply(threads, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t t) {
+	size_t i, failed = 0;
+
+	for (i = 0; i < iterations; i++) {
+	    uint64_t s = now_ns();
+	    if (b->op(t, i))
+		failed++;
+	    lat[t * iterations + i] = now_ns() - s;
+	}
+	if (failed)
+	    __sync_fetch_and_add(&errors, failed);
+    });
+    elapsed = now_ns() - start;
+
+    qsort(lat, total, sizeof(lat[0]), cmp_u64);
+    seconds = elapsed / 1e9;
+
+    printf("{\"benchmark\":\"%s\",\"threads\":%zu,\"ops\":%zu,\"errors\":%zu,"
+	   "\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+	   b->name, threads, total, errors, seconds,
+	   seconds > 0 ? total / seconds : 0.0,
+	   total ? lat[total * 50 / 100] / 1e3 : 0.0,
+	   total ? lat[total * 99 / 100] / 1e3 : 0.0);
+    fflush(stdout);
+
+    free(lat);
+}
+
+static void
+usage(void)
+{
+    size_t n;
+
+    fprintf(stderr, "usage: %s [-t threads] [-n iterations] [-c caches] "
+	    "[-C krb5.conf] [-H host] [-N negtoken-file] [-s] [benchmark ...]\n",
+	    getprogname());
+    fprintf(stderr, "benchmarks:");
+    for (n = 0; n < sizeof(benches)/sizeof(benches[0]); n++)
+	fprintf(stderr, " %s", benches[n].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *config = NULL, *negfile = NULL;
+    int ch, stats = 0;
+    size_t n;
+
+    while ((ch = getopt(argc, argv, "t:n:c:C:H:N:s")) != -1) {
+	switch (ch) {
+	case 't': threads = strtoul(optarg, NULL, 10); break;
+	case 'n': iterations = strtoul(optarg, NULL, 10); break;
+	case 'c': ncaches = strtoul(optarg, NULL, 10); break;
+	case 'C': config = optarg; break;
+	case 'H': hostname = optarg; break;
+	case 'N': negfile = optarg; break;
+	case 's': stats = 1; break;
+	default: usage();
+	}
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (threads == 0 || threads > sizeof(lkdc_contexts)/sizeof(lkdc_contexts[0]))
+	errx(1, "threads must be between 1 and %zu", sizeof(lkdc_contexts)/sizeof(lkdc_contexts[0]));
+
+    setup_krb5_config(config);
+    seed_caches();
+    setup_negtoken(negfile);
+
+    for (n = 0; n < threads; n++)
+	if (krb5_init_context(&lkdc_contexts[n]))
+	    errx(1, "krb5_init_context");
+
+    for (n = 0; n < sizeof(benches)/sizeof(benches[0]); n++) {
+	int i;
+
+	if (argc) {
+	    for (i = 0; i < argc; i++)
+		if (strcasecmp(argv[i], benches[n].name) == 0)
+		    break;
+	    if (i == argc)
+		continue;
+	}
+	run(&benches[n]);
+    }
+
+    if (stats) {
+	CFDictionaryRef dict = KRBCopyStatistics();
+	if (dict) {
+	    CFShow(dict);
+	    CFRelease(dict);
+	}
+    }
+
+    for (n = 0; n < threads; n++)
+	krb5_free_context(lkdc_contexts[n]);
+
+    return 0;
+}
@@ -101,6 +101,59 @@ int main (int argc, const char * argv[]) {
 	KRBCloseSession (krbHelper);
 	testNumber++;
 
+	/*******************************************************************************************/
+	{
+		__block OSStatus asyncErr = noErr;
+		__block KRBHelperContextRef asyncSession = NULL;
+		dispatch_semaphore_t sema = dispatch_semaphore_create(0);
+		CFDictionaryRef asyncDict;
+		KRBSessionRequestRef req;
+		const void *keys[] = { kKRBHostnameKey };
+		const void *values[] = { hostNameDotLocal };
+
+		asyncDict = CFDictionaryCreate (NULL, keys, values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+
+		req = KRBCreateSessionInfoAsync (asyncDict, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+						 ^(OSStatus e, KRBHelperContextRef session) {
+							 asyncErr = e;
+							 asyncSession = session;
+							 dispatch_semaphore_signal(sema);
+						 });
+		if (NULL == req) { lineNumber = __LINE__; goto Error; }
+		dispatch_semaphore_wait(sema, DISPATCH_TIME_FOREVER);
+		KRBReleaseSessionRequest (req);
+
+		err = asyncErr;
+		if (noErr != err) { lineNumber = __LINE__; goto Error; }
+
+		err = KRBCopyServicePrincipal (asyncSession, CFSTR("afpserver"), &outPrincipal);
+		if (noErr != err) { lineNumber = __LINE__; goto Error; }
+
+		__KRBCreateUTF8StringFromCFString (outPrincipal, &output);
+		printf ("[%d] Async ServicePrincipal = %s\n\n", testNumber, output);
+		__KRBReleaseUTF8String (output);
+		KRBCloseSession (asyncSession);
+
+		/* a cancelled request must complete with userCanceledErr */
+		req = KRBCreateSessionInfoAsync (asyncDict, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+						 ^(OSStatus e, KRBHelperContextRef session) {
+							 asyncErr = e;
+							 asyncSession = session;
+							 dispatch_semaphore_signal(sema);
+						 });
+		if (NULL == req) { lineNumber = __LINE__; goto Error; }
+		KRBCancelSessionRequest (req);
+		dispatch_semaphore_wait(sema, DISPATCH_TIME_FOREVER);
+		KRBReleaseSessionRequest (req);
+		CFRelease (asyncDict);
+		dispatch_release (sema);
+
+		if (userCanceledErr != asyncErr || NULL != asyncSession) { err = asyncErr; lineNumber = __LINE__; goto Error; }
+		printf ("[%d] Async cancel = %d\n\n", testNumber, (int)asyncErr);
+		err = noErr;
+	}
+	testNumber++;
+
 	/*******************************************************************************************/
 	err = KRBCreateSession (CFSTR("17.202.44.91"), CFSTR("afpserver/homedepot.apple.com@OD.APPLE.COM"), &krbHelper);
 	if (noErr != err) { lineNumber = __LINE__; goto Error; }
@@ -283,6 +336,44 @@ int main (int argc, const char * argv[]) {
                 testNumber++;
         }
 
+	/*******************************************************************************************/
+	{
+		CFArrayRef	entries, results = NULL;
+		CFIndex		n;
+
+		err = KRBCreateSession (hostNameDotLocal, NULL, &krbHelper);
+		if (noErr != err) { lineNumber = __LINE__; goto Error; }
+
+		err = KRBCopyServicePrincipal (krbHelper, CFSTR("afpserver"), &outPrincipal);
+		if (noErr != err) { lineNumber = __LINE__; goto Error; }
+
+		inDict = CFDictionaryCreateMutable (kCFAllocatorDefault, 4, &kCFCopyStringDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+		CFDictionarySetValue (inDict, kKRBAllowKerberosUI,       kKRBOptionNoUI);
+
+		err = KRBCopyClientPrincipalInfo (krbHelper, inDict, &outDict);
+		CFRelease(inDict);
+		if (noErr != err) { lineNumber = __LINE__; goto Error; }
+
+		outUsername  = CFDictionaryGetValue (outDict, kKRBUsernameKey);
+		CFDictionarySetValue ((CFMutableDictionaryRef)outDict, kKRBClientPasswordKey, outUsername);
+
+		entries = CFArrayCreate (kCFAllocatorDefault, (const void **)&outDict, 1, &kCFTypeArrayCallBacks);
+		err = KRBAcquireTickets (krbHelper, entries, &results);
+		CFRelease (entries);
+		if (noErr != err) { lineNumber = __LINE__; goto Error; }
+
+		for (n = 0; n < CFArrayGetCount (results); n++) {
+			SInt32 value = 0;
+			CFNumberGetValue (CFArrayGetValueAtIndex (results, n), kCFNumberSInt32Type, &value);
+			printf ("[%d] Batch entry %d = %d\n", testNumber, (int)n, (int)value);
+			if (noErr != value) { err = value; lineNumber = __LINE__; goto Error; }
+		}
+		CFRelease (results);
+
+		KRBCloseSession (krbHelper);
+		testNumber++;
+	}
+
 Error:
 	{
 		pid_t	pid = getpid();